@@ -0,0 +1,327 @@
+#ifndef E20_ASSEMBLER_H
+#define E20_ASSEMBLER_H
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "E20_Loader.h"
+
+/*
+    A built-in E20 assembler, so that both simulators can run a .s file
+    directly instead of the machine code the assembler would write.
+
+    A line holds at most one instruction; `#` starts a comment. Any
+    number of labels (`name:`, a letter or _ then letters, digits and
+    _) may come before it, or stand alone, naming the next word.
+    Opcodes and registers ($0 to $7) are case-insensitive, labels are
+    not. Immediates are decimal or 0x hex numbers, optionally negative,
+    or labels, which stand for their address.
+
+        add, sub, or, and, slt   $dst, $srcA, $srcB
+        jr                       $src
+        addi, slti               $dst, $src, imm
+        lw                       $dst, imm($addr)
+        sw                       $src, imm($addr)
+        jeq                      $srcA, $srcB, target
+        j, jal                   target
+
+    plus the pseudo-instructions movi $dst, imm (addi from $0), nop
+    (add $0, $0, $0), halt (a j to itself) and the directive .fill
+    value, which places value in the next word.
+
+    Immediates must fit the instruction: -64 to 63 for the 7-bit ones,
+    0 to 8191 for j and jal targets, and -32768 to 65535 for .fill. A
+    jeq target is an address, encoded relative to the next instruction,
+    and must be within that 7-bit range of it.
+
+    Errors are thrown as LoadError, as "file:line: message".
+*/
+
+/*
+    @return Whether filename names assembly source (ends in .s)
+*/
+inline bool is_assembly_source(std::string const &filename) {
+    return filename.size() > 2 && filename.compare(filename.size() - 2, 2, ".s") == 0;
+}
+
+/*
+    Assembles one source file, in two passes: the first finds every
+    label's address, the second encodes the instructions.
+*/
+class Assembler {
+public:
+    /*
+        @param name The file name used in error messages
+    */
+    explicit Assembler(std::string const &name) : name_(name) {}
+
+    /*
+        Assembles source into mem.
+
+        @param data The source text
+        @param size The length of data in bytes
+        @param mem Array representing memory into which to assemble
+        @param mem_size Number of words in mem
+        @return The number of words assembled
+    */
+    size_t assemble(char const *data, size_t size, unsigned short mem[], size_t mem_size) {
+        split_lines(data, size);
+        if (words_.size() > mem_size)
+            throw LoadError(name_ + ": Program too big for memory");
+        for (size_t addr = 0; addr < words_.size(); addr++)
+            mem[addr] = encode(words_[addr], addr);
+        return words_.size();
+    }
+
+    /*
+        @return The source of every word assembled (the instruction
+            without labels or comment), in address order
+    */
+    std::vector<std::string> listing() const {
+        std::vector<std::string> text;
+        for (Word const &w : words_)
+            text.push_back(w.text);
+        return text;
+    }
+
+private:
+    struct Word {
+        size_t line;
+        std::string text;
+        std::string op;
+        std::vector<std::string> operands;
+    };
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool starts_label(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    static bool in_label(char c) { return starts_label(c) || (c >= '0' && c <= '9'); }
+
+    static std::string trim(std::string const &s) {
+        size_t first = 0, last = s.size();
+        while (first < last && is_space(s[first]))
+            first++;
+        while (last > first && is_space(s[last - 1]))
+            last--;
+        return s.substr(first, last - first);
+    }
+
+    static std::string lower(std::string s) {
+        for (char &c : s)
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+        return s;
+    }
+
+    [[noreturn]] void fail(size_t line, std::string const &message) const {
+        throw LoadError(name_ + ":" + std::to_string(line) + ": " + message);
+    }
+
+    /*
+        First pass: records the labels and the text of every word.
+    */
+    void split_lines(char const *data, size_t size) {
+        char const *p = data;
+        char const *end = data + size;
+        for (size_t line = 1; p < end; line++) {
+            char const *eol = p;
+            while (eol < end && *eol != '\n')
+                eol++;
+            char const *hash = p;
+            while (hash < eol && *hash != '#')
+                hash++;
+            std::string text = trim(std::string(p, hash));
+            p = eol + 1;
+
+            // Labels, each an identifier followed by a colon
+            while (!text.empty() && starts_label(text[0])) {
+                size_t n = 1;
+                while (n < text.size() && in_label(text[n]))
+                    n++;
+                size_t colon = n;
+                while (colon < text.size() && is_space(text[colon]))
+                    colon++;
+                if (colon == text.size() || text[colon] != ':')
+                    break;
+                std::string label = text.substr(0, n);
+                if (!labels_.emplace(label, words_.size()).second)
+                    fail(line, "Duplicate label " + label);
+                text = trim(text.substr(colon + 1));
+            }
+            if (text.empty())
+                continue;
+
+            Word w{line, text, "", {}};
+            size_t n = 0;
+            while (n < text.size() && !is_space(text[n]))
+                n++;
+            w.op = lower(text.substr(0, n));
+            std::string rest = trim(text.substr(n));
+            if (!rest.empty())
+                for (size_t start = 0;;) {
+                    size_t comma = rest.find(',', start);
+                    w.operands.push_back(trim(rest.substr(start, comma == std::string::npos ? std::string::npos
+                                                                                             : comma - start)));
+                    if (w.operands.back().empty())
+                        fail(line, "Missing operand");
+                    if (comma == std::string::npos)
+                        break;
+                    start = comma + 1;
+                }
+            words_.push_back(w);
+        }
+    }
+
+    unsigned reg(Word const &w, std::string const &s) const {
+        if (s.size() != 2 || s[0] != '$' || s[1] < '0' || s[1] > '7')
+            fail(w.line, "Invalid register " + s);
+        return s[1] - '0';
+    }
+
+    /*
+        @return The value of a number or label, checked against lo..hi
+    */
+    long value(Word const &w, std::string const &s, long lo, long hi) const {
+        long v = 0;
+        auto label = labels_.find(s);
+        if (label != labels_.end())
+            v = label->second;
+        else if (starts_label(s[0]))
+            fail(w.line, "Undefined label " + s);
+        else {
+            size_t i = s[0] == '-' || s[0] == '+';
+            int base = 10;
+            if (s.size() > i + 2 && s[i] == '0' && (s[i + 1] == 'x' || s[i + 1] == 'X')) {
+                base = 16;
+                i += 2;
+            }
+            if (i == s.size())
+                fail(w.line, "Invalid number " + s);
+            for (; i < s.size(); i++) {
+                char c = s[i];
+                int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : base;
+                if (digit >= base)
+                    fail(w.line, "Invalid number " + s);
+                // Anything this big is out of range anyway
+                if (v < 1000000)
+                    v = v * base + digit;
+            }
+            if (s[0] == '-')
+                v = -v;
+        }
+        if (v < lo || v > hi)
+            fail(w.line, "Value out of range " + s + " (" + std::to_string(lo) + " to " + std::to_string(hi) + ")");
+        return v;
+    }
+
+    void expect_operands(Word const &w, size_t count) const {
+        if (w.operands.size() != count)
+            fail(w.line, w.op + " takes " + std::to_string(count) + " operand" + (count == 1 ? "" : "s"));
+    }
+
+    /*
+        Second pass: encodes the word at addr.
+    */
+    unsigned short encode(Word const &w, size_t addr) const {
+        static char const *const alu[] = {"add", "sub", "or", "and", "slt"};
+        std::vector<std::string> const &o = w.operands;
+        for (unsigned func = 0; func < 5; func++)
+            if (w.op == alu[func]) {
+                expect_operands(w, 3);
+                return reg(w, o[1]) << 10 | reg(w, o[2]) << 7 | reg(w, o[0]) << 4 | func;
+            }
+        if (w.op == "jr") {
+            expect_operands(w, 1);
+            return reg(w, o[0]) << 10 | 8;
+        }
+        if (w.op == "addi" || w.op == "slti") {
+            expect_operands(w, 3);
+            return (w.op == "addi" ? 1 : 7) << 13 | reg(w, o[1]) << 10 | reg(w, o[0]) << 7 |
+                (value(w, o[2], -64, 63) & 127);
+        }
+        if (w.op == "movi") {
+            expect_operands(w, 2);
+            return 1 << 13 | reg(w, o[0]) << 7 | (value(w, o[1], -64, 63) & 127);
+        }
+        if (w.op == "lw" || w.op == "sw") {
+            expect_operands(w, 2);
+            std::string const &m = o[1];
+            size_t open = m.find('(');
+            if (open == std::string::npos || m.back() != ')')
+                fail(w.line, "Invalid memory operand " + m);
+            std::string offset = trim(m.substr(0, open));
+            unsigned base = reg(w, trim(m.substr(open + 1, m.size() - open - 2)));
+            long imm = offset.empty() ? 0 : value(w, offset, -64, 63);
+            return (w.op == "lw" ? 4 : 5) << 13 | base << 10 | reg(w, o[0]) << 7 | (imm & 127);
+        }
+        if (w.op == "jeq") {
+            expect_operands(w, 3);
+            long target = value(w, o[2], 0, 8191);
+            long rel = target - (long)addr - 1;
+            if (rel < -64 || rel > 63)
+                fail(w.line, "jeq target " + o[2] + " is too far away");
+            return 6 << 13 | reg(w, o[0]) << 10 | reg(w, o[1]) << 7 | (rel & 127);
+        }
+        if (w.op == "j" || w.op == "jal") {
+            expect_operands(w, 1);
+            return (w.op == "j" ? 2 : 3) << 13 | value(w, o[0], 0, 8191);
+        }
+        if (w.op == "nop") {
+            expect_operands(w, 0);
+            return 0;
+        }
+        if (w.op == "halt") {
+            expect_operands(w, 0);
+            return 2 << 13 | addr;
+        }
+        if (w.op == ".fill") {
+            expect_operands(w, 1);
+            return value(w, o[0], -32768, 65535) & 0xffff;
+        }
+        fail(w.line, "Unknown instruction " + w.op);
+    }
+
+    std::string name_;
+    std::vector<Word> words_;
+    std::unordered_map<std::string, size_t> labels_;
+};
+
+/*
+    Assembles a source file into mem. Errors are thrown as LoadError.
+
+    @param filename The source file
+    @param mem Array representing memory into which to assemble
+    @param mem_size Number of words in mem
+    @param listing If not null, receives the source of every word
+    @return The number of words assembled
+*/
+inline size_t assemble_file(std::string const &filename, unsigned short mem[], size_t mem_size,
+                            std::vector<std::string> *listing = nullptr) {
+    MappedFile file;
+    if (!file.open(filename.c_str()))
+        throw LoadError("Can't open file " + filename);
+    Assembler assembler(filename);
+    size_t count = assembler.assemble(file.data(), file.size(), mem, mem_size);
+    if (listing)
+        *listing = assembler.listing();
+    return count;
+}
+
+/*
+    Assembles a source file and writes it as text machine code, each
+    word's line ending in its source, for tools that want a .bin file.
+    Errors are thrown as LoadError.
+
+    @param source The source file
+    @param filename The machine code file to create
+*/
+inline void emit_machine_code(std::string const &source, std::string const &filename) {
+    std::vector<unsigned short> mem(1 << 13, 0);
+    std::vector<std::string> listing;
+    size_t count = assemble_file(source, mem.data(), mem.size(), &listing);
+    if (!write_machine_code(filename, mem.data(), count, listing))
+        throw LoadError("Can't write file " + filename);
+}
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef E20_BATCH_H
+#define E20_BATCH_H
+
+#include <atomic>
+#include <cstdlib>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Batch mode, shared by E20_Processor and E20_Cache.
+
+    A manifest lists one simulation per line: the program file followed
+    by the same options the simulator takes on its command line, e.g.
+
+        loop.bin --jit
+        fib.bin --cache 32,4,2,256,4,8
+
+    Blank lines and lines starting with # are ignored. Every job runs
+    in-process on a work-stealing thread pool and produces exactly the
+    output a standalone run with those arguments would.
+*/
+
+/*
+    A simulation entry point: runs one simulation with the given
+    arguments (argv without the program name), writing to out and err,
+    and returns the process exit status a standalone run would have.
+*/
+typedef std::function<int(std::vector<std::string> const &, std::ostream &, std::ostream &)> SimulateFn;
+
+struct BatchOptions {
+    std::string manifest;
+    std::string output_dir;
+    unsigned jobs;
+};
+
+/*
+    Removes the batch options (--batch MANIFEST, --batch-dir DIR,
+    --jobs N) from args.
+
+    @param args The command-line arguments, without the program name
+    @param options Receives the batch options
+    @return true if --batch was given, or false if args is left for a
+        normal run (including when a batch option is malformed)
+*/
+inline bool parse_batch_options(std::vector<std::string> &args, BatchOptions &options) {
+    options.jobs = std::thread::hardware_concurrency();
+    if (options.jobs == 0)
+        options.jobs = 1;
+    std::vector<std::string> rest;
+    for (size_t i = 0; i < args.size(); i++) {
+        std::string const &arg = args[i];
+        bool takes_value = arg == "--batch" || arg == "--batch-dir" || arg == "--jobs";
+        if (!takes_value) {
+            rest.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= args.size())
+            return false;
+        std::string const &value = args[++i];
+        if (arg == "--batch")
+            options.manifest = value;
+        else if (arg == "--batch-dir")
+            options.output_dir = value;
+        else {
+            int jobs = atoi(value.c_str());
+            if (jobs <= 0)
+                return false;
+            options.jobs = jobs;
+        }
+    }
+    if (options.manifest.empty())
+        return false;
+    args = rest;
+    return true;
+}
+
+/*
+    Reads a manifest into one argument list per job.
+
+    @param filename The manifest file
+    @param jobs Receives the jobs
+    @return false if the manifest can't be opened
+*/
+inline bool read_manifest(std::string const &filename, std::vector<std::vector<std::string>> &jobs) {
+    std::ifstream f(filename);
+    if (!f.is_open())
+        return false;
+    std::string line;
+    while (getline(f, line)) {
+        std::istringstream words(line);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word)
+            args.push_back(word);
+        if (!args.empty() && args[0][0] != '#')
+            jobs.push_back(args);
+    }
+    return true;
+}
+
+/*
+    Runs task(0) ... task(count-1) on a pool of worker threads.
+
+    Each worker starts with a contiguous share of the indices in its
+    own deque and takes work from the front of it. A worker whose deque
+    is empty steals from the back of another worker's deque, so long
+    jobs don't leave the other threads idle.
+
+    @param count Number of tasks
+    @param threads Number of worker threads
+    @param task Called once per index, concurrently from several threads
+*/
+inline void run_work_stealing(size_t count, unsigned threads, std::function<void(size_t)> const &task) {
+    if (threads > count)
+        threads = count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            task(i);
+        return;
+    }
+
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<size_t> items;
+    };
+    std::vector<WorkQueue> queues(threads);
+    for (unsigned w = 0; w < threads; w++)
+        for (size_t i = count * w / threads; i < count * (w + 1) / threads; i++)
+            queues[w].items.push_back(i);
+
+    auto worker = [&](unsigned self) {
+        while (true) {
+            size_t item = 0;
+            bool found = false;
+            for (unsigned k = 0; k < threads && !found; k++) {
+                WorkQueue &q = queues[(self + k) % threads];
+                std::lock_guard<std::mutex> guard(q.lock);
+                if (q.items.empty())
+                    continue;
+                if (k == 0) {
+                    item = q.items.front();
+                    q.items.pop_front();
+                } else {
+                    item = q.items.back();
+                    q.items.pop_back();
+                }
+                found = true;
+            }
+            // Nothing is ever added back, so once every queue is empty
+            // this worker is done.
+            if (!found)
+                return;
+            task(item);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned w = 1; w < threads; w++)
+        pool.emplace_back(worker, w);
+    worker(0);
+    for (std::thread &t : pool)
+        t.join();
+}
+
+/*
+    Runs every job of a manifest.
+
+    With an output directory, job N writes its standard output to
+    DIR/N.out and, if it printed anything on standard error, DIR/N.err.
+    Otherwise a merged report goes to out in manifest order: for each
+    job a header line
+
+        ==> job N: ARGS (exit STATUS)
+
+    followed by the job's standard output and, if there was any, a
+    "--> stderr" line and the job's standard error.
+
+    @param options The batch options
+    @param simulate Runs one job
+    @param out Where the merged report goes
+    @param err Where batch-level errors go
+    @return 0 if every job exited with status 0, 1 otherwise
+*/
+inline int run_batch(BatchOptions const &options, SimulateFn const &simulate, std::ostream &out, std::ostream &err) {
+    std::vector<std::vector<std::string>> jobs;
+    if (!read_manifest(options.manifest, jobs)) {
+        err << "Can't open file " << options.manifest << std::endl;
+        return 1;
+    }
+
+    struct JobResult {
+        std::ostringstream out;
+        std::ostringstream err;
+        int status = 0;
+        bool done = false;
+    };
+    std::vector<JobResult> results(jobs.size());
+    std::atomic<bool> failed(false);
+    std::mutex report_lock;
+    size_t next_report = 0;
+
+    auto run_job = [&](size_t i, std::ostream &job_out, std::ostream &job_err) {
+        int status;
+        try {
+            status = simulate(jobs[i], job_out, job_err);
+        } catch (std::exception const &e) {
+            job_err << e.what() << std::endl;
+            status = 1;
+        }
+        if (status != 0)
+            failed = true;
+        return status;
+    };
+
+    run_work_stealing(jobs.size(), options.jobs, [&](size_t i) {
+        JobResult &r = results[i];
+        if (!options.output_dir.empty()) {
+            std::string base = options.output_dir + "/" + std::to_string(i);
+            std::ofstream job_out(base + ".out");
+            if (!job_out.is_open()) {
+                std::lock_guard<std::mutex> guard(report_lock);
+                err << "Can't open file " << base << ".out" << std::endl;
+                failed = true;
+                return;
+            }
+            r.status = run_job(i, job_out, r.err);
+            if (!r.err.str().empty())
+                std::ofstream(base + ".err") << r.err.str();
+            r.err.str(std::string());
+            return;
+        }
+
+        r.status = run_job(i, r.out, r.err);
+
+        // Write out every finished job at the head of the report, so
+        // the report stays in manifest order without holding the
+        // output of the whole batch in memory.
+        std::lock_guard<std::mutex> guard(report_lock);
+        r.done = true;
+        while (next_report < results.size() && results[next_report].done) {
+            JobResult &head = results[next_report];
+            out << "==> job " << next_report << ":";
+            for (std::string const &arg : jobs[next_report])
+                out << " " << arg;
+            out << " (exit " << head.status << ")" << std::endl;
+            out << head.out.str();
+            if (!head.err.str().empty())
+                out << "--> stderr" << std::endl << head.err.str();
+            head.out.str(std::string());
+            head.err.str(std::string());
+            next_report++;
+        }
+    });
+    return failed ? 1 : 0;
+}
+
+#endif
@@ -2,54 +2,34 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <fstream>
 #include <limits>
 #include <iomanip>
+#include <chrono>
 #include <cstdlib>
-#include <regex>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <thread>
+#include "E20_Loader.h"
+#include "E20_Batch.h"
+#include "E20_Hierarchy.h"
+#include "E20_Log.h"
+#include "E20_Checkpoint.h"
+#include "E20_Machine.h"
+#include "E20_Coherence.h"
+#include "E20_Profile.h"
+#include "E20_ExternalTrace.h"
 
 using namespace std;
 
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1<<13;
-size_t const static REG_SIZE = 1<<16;
-
-void load_machine_code(ifstream &f, unsigned short mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0; 
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
-        }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
-        }
-        expectedaddr ++;
-        mem[addr] = instr;
-    }
-}
-
-unsigned signExtender7B(unsigned imm){
-    if ((imm & 64) == 64){
-        return imm | 65408; 
-    }
-    return imm; 
-}
+size_t const static MAX_CORES = 64;
 
 /*
     Prints out the correctly-formatted configuration of a cache.
 
-    @param cache_name The name of the cache. "L1" or "L2"
+    @param out Where to print the configuration
+
+    @param cache_name The name of the cache. "L1", "L2", ...
 
     @param size The total size of the cache, measured in memory cells.
         Excludes metadata
@@ -60,17 +40,19 @@ unsigned signExtender7B(unsigned imm){
 
     @param num_rows The number of rows in the given cache.
 */
-void print_cache_config(const string &cache_name, int size, int assoc, int blocksize, int num_rows) {
-    cout << "Cache " << cache_name << " has size " << size <<
+void print_cache_config(ostream &out, const string &cache_name, int size, int assoc, int blocksize, int num_rows) {
+    out << "Cache " << cache_name << " has size " << size <<
         ", associativity " << assoc << ", blocksize " << blocksize <<
         ", rows " << num_rows << endl;
 }
 
 /*
-    Prints out a correctly-formatted log entry.
+    Appends a correctly-formatted log entry to buf.
+
+    @param buf Where to append the entry
 
     @param cache_name The name of the cache where the event
-        occurred. "L1" or "L2"
+        occurred. "L1", "L2", ...
 
     @param status The kind of cache event. "SW", "HIT", or
         "MISS"
@@ -82,489 +64,1379 @@ void print_cache_config(const string &cache_name, int size, int assoc, int block
 
     @param row The cache row or set number where the data
         is stored.
+
+    @param tag Appended after a tab if given: the class of a
+        miss with --tag-misses
 */
-void print_log_entry(const string &cache_name, const string &status, int pc, int addr, int row) {
-    cout << left << setw(8) << cache_name + " " + status <<  right <<
-        " pc:" << setw(5) << pc <<
-        "\taddr:" << setw(5) << addr <<
-        "\trow:" << setw(4) << row << endl;
+void append_log_entry(string &buf, char const *cache_name, char const *status, int pc, int addr, int row,
+                      char const *tag = nullptr) {
+    size_t start = buf.size();
+    buf.append(cache_name);
+    buf.push_back(' ');
+    buf.append(status);
+    if (buf.size() - start < 8)
+        buf.append(8 - (buf.size() - start), ' ');
+    buf.append(" pc:");
+    log_append_right(buf, pc, 5);
+    buf.append("\taddr:");
+    log_append_right(buf, addr, 5);
+    buf.append("\trow:");
+    log_append_right(buf, row, 4);
+    if (tag) {
+        buf.push_back('\t');
+        buf.append(tag);
+    }
+    buf.push_back('\n');
 }
 
-/**
-    Main function
-    Takes command-line args as documented below
+/*
+    One cache event as it travels through the log sink.
 */
-int main(int argc, char *argv[]) {
+struct CacheLogRecord {
+    unsigned short pc;
+    unsigned short addr;
+    unsigned row;
+    unsigned char level;    // 1 for L1, 2 for L2, ...
+    unsigned char status;   // a CacheEvent
+    unsigned char tag;      // 1 + the MissClass of a tagged miss, else 0
+};
+
+/*
+    Writes log records in the text format of append_log_entry.
+*/
+void write_text_log(CacheLogRecord const *records, size_t count, ostream &out) {
+    static char const *const statuses[] = {"HIT", "MISS", "SW", "WB", "PF"};
+    string buf;
+    buf.reserve(count * 40);
+    char name[8];
+    for (size_t i = 0; i < count; i++) {
+        CacheLogRecord const &r = records[i];
+        snprintf(name, sizeof(name), "L%u", r.level);
+        append_log_entry(buf, name, statuses[r.status], r.pc, r.addr, r.row,
+                         r.tag ? MISS_CLASS_NAMES[r.tag - 1] : nullptr);
+    }
+    out.write(buf.data(), buf.size());
+}
+
+/*
+    With --binary-log, the log is written raw instead: an 8-byte header
+    followed by one 10-byte record per event, all little-endian.
+
+        offset  size  field
+             0     4  magic "E20L"
+             4     2  format version (BINARY_LOG_VERSION)
+             6     2  reserved, 0
+
+    Each record is u16 pc, u16 address, u32 row, u8 level (1 for L1, 2
+    for L2, ...) and u8 status (0 hit, 1 miss, 2 sw, 3 wb, 4 prefetch).
+    The cache configuration lines and the --traffic summary are not
+    written.
+*/
+char const static BINARY_LOG_MAGIC[4] = {'E', '2', '0', 'L'};
+unsigned const static BINARY_LOG_VERSION = 1;
+size_t const static BINARY_LOG_RECORD_SIZE = 10;
+
+void write_binary_log(CacheLogRecord const *records, size_t count, ostream &out) {
+    vector<unsigned char> buf(count * BINARY_LOG_RECORD_SIZE);
+    unsigned char *p = buf.data();
+    for (size_t i = 0; i < count; i++, p += BINARY_LOG_RECORD_SIZE) {
+        CacheLogRecord const &r = records[i];
+        p[0] = r.pc;
+        p[1] = r.pc >> 8;
+        p[2] = r.addr;
+        p[3] = r.addr >> 8;
+        e20_write32(p + 4, r.row);
+        p[8] = r.level;
+        p[9] = r.status;
+    }
+    out.write(reinterpret_cast<char const *>(buf.data()), buf.size());
+}
+
+/*
+    Simulates every single-level LRU cache in a range of sizes,
+    associativities and blocksizes in one pass over the program's
+    memory accesses, using stack distances (Mattson et al.).
+
+    Caches with the same blocksize and number of rows index their sets
+    the same way, so they share one group of per-row recency stacks.
+    An access that finds its block at depth d of its row's stack hits
+    in every such cache with associativity greater than d. Stacks are
+    only kept as deep as the largest associativity swept, since deeper
+    blocks miss in every configuration.
+*/
+class StackDistanceSweep {
+public:
+    StackDistanceSweep(vector<int> const &sizes, vector<int> const &assocs, vector<int> const &blocksizes) : loads(0), stores(0) {
+        max_assoc = *max_element(assocs.begin(), assocs.end());
+        for (int blocksize : blocksizes)
+            for (int size : sizes)
+                for (int assoc : assocs) {
+                    int rows = size / (assoc * blocksize);
+                    if (rows < 1)
+                        continue;
+                    configs.push_back(Config{size, assoc, blocksize, rows, group_for(blocksize, rows)});
+                }
+    }
+
+    bool empty() const { return configs.empty(); }
+
+    /*
+        Records one memory access in every group.
+
+        @param address The memory address being accessed
+        @param is_store Whether the access is a sw
+    */
+    void access(unsigned short address, bool is_store) {
+        if (is_store)
+            stores++;
+        else
+            loads++;
+        for (Group &g : groups) {
+            int blockid = address / g.blocksize;
+            int *stack = &g.stacks[(size_t)(blockid % g.rows) * max_assoc];
+            int depth = 0;
+            while (depth < max_assoc - 1 && stack[depth] != blockid && stack[depth] != -1)
+                depth++;
+            if (stack[depth] == blockid && !is_store)
+                g.load_hits[depth]++;
+            for (int i = depth; i > 0; i--)
+                stack[i] = stack[i-1];
+            stack[0] = blockid;
+        }
+    }
+
+    /*
+        Prints the hit and miss counts of lw accesses for every
+        configuration, in the same terms as the L1 HIT and MISS log
+        entries of a single-cache run.
+
+        @param out Where to print the table
+    */
+    void print(ostream &out) const {
+        out << "Sweep over " << loads << " loads and " << stores << " stores" << endl;
+        out << "   size  assoc  blocksize   rows        hits      misses  miss rate" << endl;
+        for (Config const &c : configs) {
+            Group const &g = groups[c.group];
+            unsigned long long hits = 0;
+            for (int d = 0; d < c.assoc; d++)
+                hits += g.load_hits[d];
+            unsigned long long misses = loads - hits;
+            out << setw(7) << c.size << setw(7) << c.assoc << setw(11) << c.blocksize <<
+                setw(7) << c.rows << setw(12) << hits << setw(12) << misses << setw(11) <<
+                fixed << setprecision(4) << (loads ? (double)misses / loads : 0.0) << endl;
+        }
+    }
+
+private:
+    struct Group {
+        int blocksize;
+        int rows;
+        vector<int> stacks;
+        vector<unsigned long long> load_hits;
+    };
+    struct Config {
+        int size;
+        int assoc;
+        int blocksize;
+        int rows;
+        size_t group;
+    };
+
+    size_t group_for(int blocksize, int rows) {
+        for (size_t i = 0; i < groups.size(); i++)
+            if (groups[i].blocksize == blocksize && groups[i].rows == rows)
+                return i;
+        groups.push_back(Group{blocksize, rows, vector<int>((size_t)rows * max_assoc, -1), vector<unsigned long long>(max_assoc, 0)});
+        return groups.size() - 1;
+    }
+
+    int max_assoc;
+    vector<Group> groups;
+    vector<Config> configs;
+    unsigned long long loads;
+    unsigned long long stores;
+};
+
+/*
+    Parses one range of a --sweep argument: either a single value N or
+    LO-HI, meaning the powers of two from LO to HI. LO must itself be a
+    power of two.
+
+    @param text The range
+    @param values Receives the values
+    @return false if the range is malformed
+*/
+bool parse_sweep_range(string const &text, vector<int> &values) {
+    size_t dash = text.find('-');
+    int lo, hi;
+    try {
+        lo = stoi(text.substr(0, dash));
+        hi = dash == string::npos ? lo : stoi(text.substr(dash + 1));
+    } catch (exception const &) {
+        return false;
+    }
+    if (lo < 1 || hi < lo || (dash != string::npos && (lo & (lo - 1)) != 0))
+        return false;
+    for (long v = lo; v <= hi; v *= 2)
+        values.push_back(v);
+    return true;
+}
+
+/*
+    The statistics of a --sample run: load hits and misses and stores
+    at every cache level, counted separately for every detailed window.
+
+    Miss rates are ratio estimates over all windows, and their
+    confidence intervals treat the windows as the sampled units (the
+    standard error of a ratio estimator, with a normal approximation).
+    Extrapolated counts scale the sampled counts by the total number of
+    instructions over the number simulated in detail.
+*/
+class SampleStats {
+public:
+    explicit SampleStats(size_t depth) : depth(depth) {}
+
+    void begin_window() {
+        windows.push_back(Window{0, vector<unsigned long long>(depth * 3, 0)});
+    }
+
+    /*
+        Records one event of the current window.
+    */
+    void count(size_t level, CacheEvent event) {
+        if (event <= EVENT_SW)
+            windows.back().counts[level * 3 + event]++;
+    }
+
+    void end_window(unsigned long long instructions) {
+        windows.back().instructions = instructions;
+    }
+
+    /*
+        @param out Where to print the report
+        @param total_instructions The instructions executed in the run,
+            detailed or not
+        @param period The --sample period
+    */
+    void print(ostream &out, unsigned long long total_instructions, unsigned long long period) const {
+        unsigned long long detailed = 0;
+        for (Window const &w : windows)
+            detailed += w.instructions;
+        double scale = detailed ? (double)total_instructions / detailed : 0.0;
+        out << "Sampled " << windows.size() << " windows every " << period << " instructions: " << detailed <<
+            " of " << total_instructions << " instructions in detail" << endl;
+        for (size_t level = 0; level < depth; level++) {
+            unsigned long long hits = sum(level * 3 + EVENT_HIT);
+            unsigned long long misses = sum(level * 3 + EVENT_MISS);
+            unsigned long long stores = sum(level * 3 + EVENT_SW);
+            out << "L" << level + 1 << " lw: " << hits << " hits, " << misses << " misses sampled; miss rate ";
+            if (hits + misses == 0)
+                out << "n/a";
+            else {
+                double rate = (double)misses / (hits + misses);
+                out << fixed << setprecision(2) << 100 * rate << "%";
+                double margin = confidence_margin(level, rate);
+                if (margin >= 0)
+                    out << " +/- " << 100 * margin << "% (95% confidence)";
+                out << defaultfloat;
+            }
+            out << "; " << llround(hits * scale) << " hits, " << llround(misses * scale) << " misses extrapolated" << endl;
+            out << "L" << level + 1 << " sw: " << stores << " sampled; " << llround(stores * scale) << " extrapolated" << endl;
+        }
+    }
+
+private:
+    struct Window {
+        unsigned long long instructions;
+        // hits, misses and stores of each level
+        vector<unsigned long long> counts;
+    };
+
+    unsigned long long sum(size_t index) const {
+        unsigned long long total = 0;
+        for (Window const &w : windows)
+            total += w.counts[index];
+        return total;
+    }
+
+    /*
+        @return Half the width of the 95% confidence interval of the
+            miss rate of level, or -1 with fewer than two windows
+    */
+    double confidence_margin(size_t level, double rate) const {
+        size_t n = windows.size();
+        if (n < 2)
+            return -1;
+        double mean_loads = 0;
+        double residuals = 0;
+        for (Window const &w : windows) {
+            double loads = w.counts[level * 3 + EVENT_HIT] + w.counts[level * 3 + EVENT_MISS];
+            double r = w.counts[level * 3 + EVENT_MISS] - rate * loads;
+            mean_loads += loads / n;
+            residuals += r * r;
+        }
+        return 1.96 * sqrt(residuals / (n * (n - 1.0))) / mean_loads;
+    }
+
+    size_t depth;
+    vector<Window> windows;
+};
+
+/*
+    Memory access traces, written with --trace-out and replayed with
+    --replay. A trace is a 16-byte header followed by one record per
+    lw or sw, all little-endian.
+
+        offset  size  field
+             0     4  magic "E20T"
+             4     2  format version (TRACE_VERSION)
+             6     2  reserved, 0
+             8     8  number of records
+
+    Each record is two LEB128 varints holding zigzag-encoded deltas
+    from the previous record (the first record is relative to pc 0,
+    address 0):
+
+        zigzag(pc - previous pc) << 1 | is_store
+        zigzag(address - previous address)
+
+    Loops and strided accesses mostly take two bytes per record.
+*/
+char const static TRACE_MAGIC[4] = {'E', '2', '0', 'T'};
+unsigned const static TRACE_VERSION = 1;
+size_t const static TRACE_HEADER_SIZE = 16;
+
+inline unsigned zigzag(int v) {
+    return v < 0 ? ((unsigned)(-v) << 1) - 1 : (unsigned)v << 1;
+}
+
+inline int unzigzag(unsigned v) {
+    return v & 1 ? -(int)((v + 1) >> 1) : (int)(v >> 1);
+}
+
+/*
+    Writes a trace file through a fixed-size buffer.
+*/
+class TraceWriter {
+public:
+    TraceWriter() : records(0), prev_pc(0), prev_addr(0) {}
+
+    /*
+        @param filename The trace file to create
+        @return false if the file can't be created
+    */
+    bool open(string const &filename) {
+        f.open(filename, ios::binary | ios::trunc);
+        if (!f.is_open())
+            return false;
+        buffer.reserve(BUFFER_SIZE + 16);
+        buffer.assign(TRACE_HEADER_SIZE, 0);
+        memcpy(buffer.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        buffer[4] = TRACE_VERSION;
+        return true;
+    }
+
+    bool is_open() const { return f.is_open(); }
+
+    void record(unsigned short pc, unsigned short address, bool is_store) {
+        put_varint(zigzag((int)pc - prev_pc) << 1 | is_store);
+        put_varint(zigzag((int)address - prev_addr));
+        prev_pc = pc;
+        prev_addr = address;
+        records++;
+        if (buffer.size() >= BUFFER_SIZE) {
+            f.write(reinterpret_cast<char const *>(buffer.data()), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    /*
+        Flushes the buffer and fills in the record count.
+
+        @return false if writing failed
+    */
+    bool close() {
+        f.write(reinterpret_cast<char const *>(buffer.data()), buffer.size());
+        buffer.clear();
+        unsigned char count[8];
+        for (int i = 0; i < 8; i++)
+            count[i] = records >> (8 * i);
+        f.seekp(8);
+        f.write(reinterpret_cast<char const *>(count), sizeof(count));
+        f.close();
+        return !f.fail();
+    }
+
+private:
+    size_t const static BUFFER_SIZE = 1<<16;
+
+    void put_varint(unsigned v) {
+        while (v >= 0x80) {
+            buffer.push_back(v | 0x80);
+            v >>= 7;
+        }
+        buffer.push_back(v);
+    }
+
+    ofstream f;
+    vector<unsigned char> buffer;
+    unsigned long long records;
+    int prev_pc;
+    int prev_addr;
+};
+
+/*
+    Streams every record of a trace file to on_access. The file is
+    mapped rather than read, so traces don't have to fit in memory.
+
+    @param filename The trace file
+    @param on_access Called as on_access(pc, address, is_store) for
+        every record
+    @throws LoadError if the file can't be opened or isn't a valid trace
+*/
+template <typename OnAccess>
+void replay_trace(string const &filename, OnAccess &&on_access) {
+    MappedFile file;
+    if (!file.open(filename.c_str()))
+        throw LoadError("Can't open file " + filename);
+    unsigned char const *p = reinterpret_cast<unsigned char const *>(file.data());
+    unsigned char const *end = p + file.size();
+    if (file.size() < TRACE_HEADER_SIZE || memcmp(p, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+            (p[4] | p[5] << 8) != TRACE_VERSION)
+        throw LoadError("Not a trace file: " + filename);
+    unsigned long long records = 0;
+    for (int i = 7; i >= 0; i--)
+        records = records << 8 | p[8 + i];
+    p += TRACE_HEADER_SIZE;
+
+    auto get_varint = [&](unsigned &v) {
+        v = 0;
+        for (int shift = 0; p < end && shift < 32; shift += 7) {
+            unsigned char b = *p++;
+            v |= (unsigned)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return true;
+        }
+        return false;
+    };
+
+    int pc = 0;
+    int address = 0;
+    for (unsigned long long i = 0; i < records; i++) {
+        unsigned first, second;
+        if (!get_varint(first) || !get_varint(second))
+            throw LoadError("Trace file is corrupt: " + filename);
+        pc += unzigzag(first >> 1);
+        address += unzigzag(second);
+        on_access((unsigned short)pc, (unsigned short)address, (first & 1) != 0);
+    }
+    if (p != end)
+        throw LoadError("Trace file is corrupt: " + filename);
+}
+
+/*
+    Runs machine until it halts or has executed limit instructions in
+    all, counting those before a restored checkpoint.
+
+    @param on_access Called as on_access(pc, address, is_store) for
+        every lw and sw
+*/
+template <typename OnAccess>
+void run_until(Machine &machine, unsigned long long limit, OnAccess &&on_access) {
+    if (machine.instructions() < limit)
+        machine.run(limit - machine.instructions(), on_access);
+}
+
+/*
+    Like run_until, counting every instruction in profiler.
+*/
+template <typename OnAccess>
+void run_profiled(Machine &machine, unsigned long long limit, Profiler &profiler, OnAccess &&on_access) {
+    if (machine.instructions() < limit)
+        machine.trace(limit - machine.instructions(), [&](DecodedInstr const &d, unsigned pc, unsigned short const regs[]) {
+            profiler.instruction(d, pc, regs);
+        }, on_access);
+}
+
+/*
+    Prints the memory traffic summary of --traffic: the bytes (two per
+    word) moved across the boundary below every cache level.
+*/
+template <typename Hierarchy>
+void print_traffic(ostream &out, Hierarchy const &caches) {
+    for (size_t i = 0; i < caches.depth(); i++) {
+        LevelTraffic const &t = caches.traffic(i);
+        string below = i + 1 < caches.depth() ? "L" + to_string(i + 2) : "memory";
+        out << "Traffic L" << i + 1 << "-" << below << ": read " << t.words_read * 2
+            << " bytes, written " << t.words_written * 2 << " bytes" << endl;
+    }
+}
+
+/*
+    Formats a miss rate as a percentage, or n/a without accesses.
+*/
+string percent(unsigned long long misses, unsigned long long accesses) {
+    if (accesses == 0)
+        return "n/a";
+    ostringstream text;
+    text << fixed << setprecision(2) << 100.0 * misses / accesses << "%";
+    return text.str();
+}
+
+/*
+    Prints the prefetch summary of --prefetch: what the prefetches of
+    every cache level achieved (see E20_Prefetch.h).
+*/
+template <typename Hierarchy>
+void print_prefetch_stats(ostream &out, Hierarchy const &caches) {
+    for (size_t i = 0; i < caches.depth(); i++) {
+        PrefetchStats const &s = caches.prefetcher(i).stats();
+        out << "Prefetch L" << i + 1 << " " << PREFETCHER_NAMES[caches.prefetcher(i).kind()] << ": " << s.issued
+            << " issued, " << s.useful << " useful, " << s.unused << " unused, " << s.late << " late; accuracy "
+            << percent(s.useful, s.issued) << ", coverage " << percent(s.useful, s.useful + s.misses)
+            << ", timeliness " << percent(s.useful - s.late, s.useful) << "; " << s.pollution << " pollution misses"
+            << endl;
+    }
+}
+
+/*
+    Runs --cores: the program on several cores with private, MESI
+    coherent L1s and a shared L2 (see E20_Coherence.h). Prints the cache
+    configuration, then for every core its final pc and registers and
+    what its L1 saw, then the bus and L2 totals and the first 128 words
+    of the final shared memory.
+
+    @param program A machine loaded with the program
+    @param levels The L1 and, optionally, the L2 configuration
+    @param cores Number of cores
+    @param quantum Instructions every core runs between synchronizations
+    @param threads Host threads to run the cores on
+*/
+void run_multicore(Machine const &program, vector<CacheLevelConfig> const &levels, ReplacementPolicy policy,
+                   uint32_t seed, size_t cores, unsigned long long quantum, unsigned threads, ostream &out) {
+    for (size_t i = 0; i < levels.size(); i++)
+        print_cache_config(out, "L" + to_string(i + 1), levels[i].size, levels[i].assoc, levels[i].blocksize, levels[i].rows());
+    out << cores << " cores with private L1" << (levels.size() > 1 ? ", shared L2" : "") << ", quantum " << quantum
+        << " instructions" << endl;
+
+    with_replacement_policy(policy, [&](auto policy_tag) {
+        typedef typename decltype(policy_tag)::type Policy;
+        MesiCaches<Policy> caches(cores, levels[0], levels.size() > 1 ? &levels[1] : nullptr, seed);
+        MultiCore system(program, cores);
+        while (!system.halted())
+            system.run_quantum(quantum, threads, [&](size_t core, unsigned address, bool is_store) {
+                if (is_store)
+                    caches.store(core, address);
+                else
+                    caches.load(core, address);
+            });
+
+        for (size_t i = 0; i < cores; i++) {
+            Machine const &core = system.core(i);
+            CoreCacheStats const &s = caches.core_stats(i);
+            out << "Core " << i << ": pc=" << core.pc();
+            for (size_t reg = 1; reg < NUM_REGS; reg++)
+                out << " $" << reg << "=" << core.reg(reg);
+            out << ", " << core.instructions() << " instructions" << endl;
+            out << "  L1 lw: " << s.loads << " (" << s.load_misses << " misses, " << percent(s.load_misses, s.loads)
+                << "), sw: " << s.stores << " (" << s.store_misses << " misses, " << percent(s.store_misses, s.stores)
+                << "), " << s.upgrades << " upgrades" << endl;
+            out << "  invalidated " << s.invalidated << ", supplied " << s.supplied << ", written back "
+                << s.writebacks << endl;
+        }
+        BusStats const &bus = caches.bus_stats();
+        out << "Bus: " << bus.reads << " BusRd, " << bus.read_exclusives << " BusRdX, " << bus.upgrades
+            << " BusUpgr, " << bus.invalidations << " invalidations, " << bus.transfers << " cache-to-cache transfers"
+            << endl;
+        if (levels.size() > 1)
+            out << "L2: " << bus.l2_hits << " hits, " << bus.l2_misses << " misses ("
+                << percent(bus.l2_misses, bus.l2_hits + bus.l2_misses) << "), ";
+        out << bus.memory_writes << " blocks written to memory" << endl;
+
+        string buf = "Final memory:\n";
+        for (size_t i = 0; i < 128; i++) {
+            log_append_hex4(buf, system.memory()[i]);
+            buf.push_back(i % 8 == 7 ? '\n' : ' ');
+        }
+        out << buf;
+    });
+}
+
+/*
+    Runs one simulation.
+
+    @param progname The name to show in the usage message
+    @param args The command-line arguments, without the program name
+    @param out Where the cache configuration and log go
+    @param err Where the usage message and errors go
+    @return The exit status of the run
+*/
+int simulate(string const &progname, vector<string> const &args, ostream &out, ostream &err) {
     /*
         Parse the command-line arguments
     */
-    char *filename = nullptr;
+    string filename;
     bool do_help = false;
     bool arg_error = false;
+    bool use_image_cache = false;
     string cache_config;
-    for (int i=1; i<argc; i++) {
-        string arg(argv[i]);
+    string sweep_config;
+    string trace_out;
+    string trace_in;
+    string profile_file;
+    string ingest_file;
+    string emit_file;
+    TraceFormat ingest_format = TRACE_DIN;
+    bool binary_log = false;
+    ReplacementPolicy policy = POLICY_LRU;
+    Inclusion inclusion = NON_INCLUSIVE;
+    string write_policy;
+    string prefetch;
+    unsigned long long prefetch_degree = 1;
+    unsigned long long prefetch_distance = 1;
+    unsigned long long prefetch_latency = 16;
+    bool prefetch_tuned = false;
+    bool classify_misses = false;
+    bool tag_misses = false;
+    bool detect_loops = false;
+    unsigned long long max_instructions = 0;
+    unsigned long long checkpoint_at = 0;
+    string checkpoint_file = "e20.ckpt";
+    string restore_file;
+    unsigned long long sample_period = 0;
+    unsigned long long sample_window = 0;
+    bool sample_warm = false;
+    bool show_traffic = false;
+    unsigned long seed = 1;
+    unsigned long long cores = 0;
+    unsigned long long quantum = 10000;
+    unsigned long long threads = thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    for (size_t i=0; i<args.size(); i++) {
+        string const &arg = args[i];
         if (arg.rfind("-",0)==0) {
             if (arg== "-h" || arg == "--help")
                 do_help = true;
+            else if (arg == "--image-cache")
+                use_image_cache = true;
+            else if (arg == "--binary-log")
+                binary_log = true;
+            else if (arg == "--traffic")
+                show_traffic = true;
+            else if (arg == "--classify-misses")
+                classify_misses = true;
+            else if (arg == "--tag-misses")
+                classify_misses = tag_misses = true;
+            else if (arg == "--warm")
+                sample_warm = true;
+            else if (arg == "--detect-loops")
+                detect_loops = true;
+            else if (arg=="--sample") {
+                i++;
+                char *end;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    sample_period = strtoull(args[i].c_str(), &end, 10);
+                    if (*end != ',')
+                        arg_error = true;
+                    else {
+                        sample_window = strtoull(end + 1, &end, 10);
+                        if (*end != '\0' || sample_window == 0 || sample_window > sample_period)
+                            arg_error = true;
+                    }
+                }
+            }
             else if (arg=="--cache") {
                 i++;
-                if (i>=argc)
+                if (i>=args.size())
                     arg_error = true;
                 else
-                    cache_config = argv[i];
+                    cache_config = args[i];
+            }
+            else if (arg=="--policy") {
+                i++;
+                if (i>=args.size() || !parse_replacement_policy(args[i], policy))
+                    arg_error = true;
+            }
+            else if (arg=="--inclusion") {
+                i++;
+                if (i>=args.size() || !parse_inclusion(args[i], inclusion))
+                    arg_error = true;
+            }
+            else if (arg=="--write-policy") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    write_policy = args[i];
+            }
+            else if (arg=="--prefetch") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    prefetch = args[i];
+            }
+            else if (arg=="--prefetch-degree" || arg=="--prefetch-distance" || arg=="--prefetch-latency") {
+                i++;
+                char *end;
+                prefetch_tuned = true;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    unsigned long long value = strtoull(args[i].c_str(), &end, 10);
+                    if (*end != '\0' || args[i].empty() ||
+                            (arg=="--prefetch-degree" ? value == 0 || value > 64 :
+                             arg=="--prefetch-distance" ? value == 0 || value > 65536 : value > 1000000))
+                        arg_error = true;
+                    (arg=="--prefetch-degree" ? prefetch_degree :
+                     arg=="--prefetch-distance" ? prefetch_distance : prefetch_latency) = value;
+                }
+            }
+            else if (arg=="--cores" || arg=="--quantum" || arg=="--threads") {
+                i++;
+                char *end;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    unsigned long long value = strtoull(args[i].c_str(), &end, 10);
+                    if (*end != '\0' || args[i].empty() || value == 0)
+                        arg_error = true;
+                    (arg=="--cores" ? cores : arg=="--quantum" ? quantum : threads) = value;
+                }
+            }
+            else if (arg=="--seed") {
+                i++;
+                char *end;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    seed = strtoul(args[i].c_str(), &end, 10);
+                    if (*end != '\0' || args[i].empty())
+                        arg_error = true;
+                }
+            }
+            else if (arg=="--sweep") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    sweep_config = args[i];
+            }
+            else if (arg=="--checkpoint-at" || arg=="--max-instructions") {
+                i++;
+                char *end;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    unsigned long long &n = arg=="--checkpoint-at" ? checkpoint_at : max_instructions;
+                    n = strtoull(args[i].c_str(), &end, 10);
+                    if (*end != '\0' || args[i].empty() || n == 0)
+                        arg_error = true;
+                }
+            }
+            else if (arg=="--checkpoint-file") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    checkpoint_file = args[i];
+            }
+            else if (arg=="--restore") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    restore_file = args[i];
+            }
+            else if (arg=="--trace-out") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    trace_out = args[i];
+            }
+            else if (arg=="--replay") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    trace_in = args[i];
+            }
+            else if (arg=="--profile") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    profile_file = args[i];
+            }
+            else if (arg=="--emit-bin") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    emit_file = args[i];
+            }
+            else if (arg=="--ingest") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    ingest_file = args[i];
+            }
+            else if (arg=="--trace-format") {
+                i++;
+                if (i>=args.size() || !parse_trace_format(args[i], ingest_format))
+                    arg_error = true;
             }
             else
                 arg_error = true;
         } else {
-            if (filename == nullptr)
-                filename = argv[i];
+            if (filename.empty())
+                filename = arg;
             else
                 arg_error = true;
         }
     }
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] filename" << endl << endl;
-        cerr << "Simulate E20 cache" << endl << endl;
-        cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
-        cerr << "optional arguments:"<<endl;
-        cerr << "  -h, --help  show this help message and exit"<<endl;
-        cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one"<<endl;
-        cerr << "                 cache) or"<<endl;
-        cerr << "                 size,associativity,blocksize,size,associativity,blocksize"<<endl;
-        cerr << "                 (for two caches)"<<endl;
+    bool replaying = !trace_in.empty();
+    bool restoring = !restore_file.empty();
+    bool checkpointing = checkpoint_at > 0;
+    bool profiling = !profile_file.empty();
+    bool ingesting = !ingest_file.empty();
+    bool prefetching = !prefetch.empty();
+    bool bounded = max_instructions > 0 || detect_loops;
+    if (arg_error || do_help || !filename.empty() + replaying + restoring + ingesting != 1 || (replaying && !trace_out.empty()) ||
+            (!cache_config.empty() && !sweep_config.empty()) || (!sweep_config.empty() && policy != POLICY_LRU) ||
+            ((checkpointing || restoring) && (replaying || !sweep_config.empty())) ||
+            (sample_period > 0 && (cache_config.empty() || replaying || checkpointing || binary_log ||
+                                   show_traffic || !trace_out.empty())) ||
+            (sample_warm && sample_period == 0) || cores > MAX_CORES ||
+            (!emit_file.empty() && !is_assembly_source(filename)) ||
+            (profiling && (replaying || sample_period > 0 || cores > 0)) ||
+            (prefetching && (cache_config.empty() || checkpointing || restoring || sample_period > 0 || cores > 0)) ||
+            (prefetch_tuned && !prefetching) ||
+            (classify_misses && (cache_config.empty() || restoring || sample_period > 0 || cores > 0)) ||
+            (tag_misses && (binary_log || ingesting)) ||
+            (bounded && (replaying || ingesting || cores > 0)) ||
+            (ingesting && (cache_config.empty() || checkpointing || sample_period > 0 || cores > 0 || profiling ||
+                           binary_log || show_traffic || !trace_out.empty())) ||
+            (cores > 0 && (cache_config.empty() || filename.empty() || checkpointing || sample_period > 0 ||
+                           binary_log || show_traffic || !trace_out.empty() || !write_policy.empty() ||
+                           inclusion != NON_INCLUSIVE))) {
+        err << "usage " << progname << " [-h] [--image-cache] [--cache CACHE | --sweep SWEEP]" << endl;
+        err << "       [--policy POLICY] [--seed N] [--inclusion INCLUSION] [--binary-log]" << endl;
+        err << "       [--write-policy WRITE_POLICY] [--traffic] [--trace-out TRACE]" << endl;
+        err << "       [--prefetch PREFETCHER [--prefetch-degree N] [--prefetch-distance N]" << endl;
+        err << "        [--prefetch-latency N]] [--classify-misses | --tag-misses]" << endl;
+        err << "       [--checkpoint-at N [--checkpoint-file FILE]] [--sample PERIOD,WINDOW [--warm]]" << endl;
+        err << "       [--max-instructions N] [--detect-loops]" << endl;
+        err << "       [--cores N [--quantum Q] [--threads T]] [--profile FILE]" << endl;
+        err << "       [--batch MANIFEST] [--batch-dir DIR] [--jobs N] [--emit-bin FILE]" << endl;
+        err << "       (filename | --replay TRACE | --restore FILE |" << endl;
+        err << "        --ingest FILE [--trace-format FORMAT])" << endl << endl;
+        err << "Simulate E20 cache" << endl << endl;
+        err << "positional arguments:" << endl;
+        err << "  filename    The file containing machine code, typically with .bin suffix," << endl;
+        err << "              a binary program image, or assembly source with .s suffix" << endl<<endl;
+        err << "optional arguments:"<<endl;
+        err << "  -h, --help  show this help message and exit"<<endl;
+        err << "  --image-cache  load the program from filename.img when it is up to"<<endl;
+        err << "                 date, and write that binary image otherwise"<<endl;
+        err << "  --emit-bin FILE  also write the assembled .s program to FILE as machine"<<endl;
+        err << "                 code, in the .bin format"<<endl;
+        err << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one"<<endl;
+        err << "                 cache) or"<<endl;
+        err << "                 size,associativity,blocksize,size,associativity,blocksize"<<endl;
+        err << "                 (for two caches), and so on for L3 and below"<<endl;
+        err << "  --sweep SWEEP  Simulate many single caches at once and print a miss-rate"<<endl;
+        err << "                 table: sizes,associativities,blocksizes where each is N"<<endl;
+        err << "                 or LO-HI (the powers of two from LO to HI)"<<endl;
+        err << "  --policy POLICY  replacement policy of the caches: lru (default), plru,"<<endl;
+        err << "                 fifo, random, srrip, brrip or lfu. --sweep only supports lru"<<endl;
+        err << "  --inclusion INCLUSION  how the contents of the cache levels relate:"<<endl;
+        err << "                 non-inclusive (default), inclusive or exclusive"<<endl;
+        err << "  --write-policy WRITE_POLICY  how each cache level handles stores: wt-wa"<<endl;
+        err << "                 (write-through, write-allocate; the default), wt-nwa,"<<endl;
+        err << "                 wb-wa or wb-nwa (write-back, no-write-allocate), one for"<<endl;
+        err << "                 every level or one per level, comma-separated"<<endl;
+        err << "  --prefetch PREFETCHER  prefetcher of each cache level: none, next-line,"<<endl;
+        err << "                 stride (by pc) or stream (stream buffers), one for every"<<endl;
+        err << "                 level or one per level, comma-separated; prints accuracy,"<<endl;
+        err << "                 coverage, timeliness and pollution after the log"<<endl;
+        err << "  --prefetch-degree N  blocks each prefetch asks for, or the depth of each"<<endl;
+        err << "                 stream buffer (default: 1)"<<endl;
+        err << "  --prefetch-distance N  how many blocks or strides ahead prefetches start"<<endl;
+        err << "                 (default: 1)"<<endl;
+        err << "  --prefetch-latency N  demand accesses a prefetch takes to arrive; blocks"<<endl;
+        err << "                 used sooner count as late (default: 16)"<<endl;
+        err << "  --classify-misses  after the log, print how many lw misses of each"<<endl;
+        err << "                 level were compulsory, capacity and conflict misses, in"<<endl;
+        err << "                 all and per pc"<<endl;
+        err << "  --tag-misses  like --classify-misses, and also end every MISS line of the"<<endl;
+        err << "                 log with the class of the miss"<<endl;
+        err << "  --traffic   after the log, print the bytes read and written across each"<<endl;
+        err << "                 level boundary (to stderr with --binary-log)"<<endl;
+        err << "  --seed N    seed for the random choices of the random and brrip policies"<<endl;
+        err << "                 (default: 1)"<<endl;
+        err << "  --binary-log  write the cache log as raw binary records instead of text"<<endl;
+        err << "  --trace-out TRACE  write every memory access of the run to the binary"<<endl;
+        err << "                 trace file TRACE"<<endl;
+        err << "  --replay TRACE  feed the accesses recorded in TRACE to the caches instead"<<endl;
+        err << "                 of running a program"<<endl;
+        err << "  --ingest FILE  with --cache, feed an external address trace (byte"<<endl;
+        err << "                 addresses up to 64 bits) to the caches and print hit and"<<endl;
+        err << "                 miss counts instead of the log"<<endl;
+        err << "  --trace-format FORMAT  format of the --ingest trace: din (default), lackey"<<endl;
+        err << "                 or bin64"<<endl;
+        err << "  --checkpoint-at N  after N instructions, save the machine and cache state"<<endl;
+        err << "                 to the checkpoint file, then go on"<<endl;
+        err << "  --checkpoint-file FILE  where --checkpoint-at writes (default: e20.ckpt)"<<endl;
+        err << "  --restore FILE  resume from the checkpoint FILE instead of running a"<<endl;
+        err << "                 program from the start; its cache state is restored when"<<endl;
+        err << "                 the cache options are the same as when it was taken"<<endl;
+        err << "  --sample PERIOD,WINDOW  with --cache, simulate only the last WINDOW"<<endl;
+        err << "                 instructions of every PERIOD in detail, skip the rest and"<<endl;
+        err << "                 print estimated miss rates instead of the log"<<endl;
+        err << "  --warm      with --sample, keep updating the caches between windows"<<endl;
+        err << "  --max-instructions N  stop the program after N instructions if it hasn't"<<endl;
+        err << "                 halted, and exit with status "<<EXIT_INSTRUCTION_LIMIT<<" after the usual output"<<endl;
+        err << "  --detect-loops  stop the program as soon as it comes back to an earlier"<<endl;
+        err << "                 state (pc, registers and memory), which means it will never"<<endl;
+        err << "                 halt, and exit with status "<<EXIT_NEVER_HALTS<<" after the usual output"<<endl;
+        err << "  --cores N   run the program on N cores (core i starts with i in $1), with"<<endl;
+        err << "                 a private L1 each, kept coherent with MESI, and the L2 of"<<endl;
+        err << "                 --cache shared; prints per-core and bus statistics"<<endl;
+        err << "  --quantum Q  with --cores, instructions each core runs between"<<endl;
+        err << "                 synchronizations (default: 10000)"<<endl;
+        err << "  --threads T  with --cores, host threads to run cores on (default: all"<<endl;
+        err << "                 cores of the host)"<<endl;
+        err << "  --profile FILE  count instructions, taken branches and cache hits and"<<endl;
+        err << "                 misses per pc; write a hot-spot report to FILE and the"<<endl;
+        err << "                 instructions per jal call chain, as folded stacks for"<<endl;
+        err << "                 flame graphs, to FILE.folded"<<endl;
+        err << "  --batch MANIFEST  run every simulation listed in MANIFEST (one program"<<endl;
+        err << "                 and its options per line) in-process, instead of filename"<<endl;
+        err << "  --batch-dir DIR  write job N's output to DIR/N.out instead of a merged"<<endl;
+        err << "                 report on stdout"<<endl;
+        err << "  --jobs N    number of worker threads for --batch (default: all cores)"<<endl;
         return 1;
     }
 
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file "<<filename<<endl;
+    Machine machine;
+    //E20_Cache has always stopped when pc runs past the end of memory
+    machine.set_stop_at_end(true);
+    machine.set_loop_detection(detect_loops);
+    Checkpoint restored;
+
+    try {
+        if (restoring) {
+            read_checkpoint(restore_file, restored);
+            machine.restore(restored);
+        }
+        else if (!replaying && !ingesting) {
+            if (!emit_file.empty())
+                emit_machine_code(filename, emit_file);
+            if (!machine.load(filename, use_image_cache))
+                err << "Can't write program image " << program_image_name(filename) << endl;
+        }
+    } catch (LoadError const &e) {
+        err << e.what() << endl;
+        return 1;
+    }
+    if (checkpointing && checkpoint_at <= machine.instructions()) {
+        err << "The checkpoint must come after instruction " << machine.instructions() << " of the restored run" << endl;
         return 1;
     }
+    //--max-instructions counts from the start of this run
+    unsigned long long limit = numeric_limits<unsigned long long>::max();
+    if (max_instructions > 0 && max_instructions < limit - machine.instructions())
+        limit = machine.instructions() + max_instructions;
 
-    unsigned short memory[8192] = {0}; 
-    unsigned short pc = 0; 
-    unsigned short registers[8] = {0}; 
-    
-    load_machine_code(f, memory); 
+    if (cores > 0) {
+        vector<CacheLevelConfig> levels;
+        if (!parse_cache_levels(cache_config, levels) || levels.size() > 2) {
+            err << "Invalid cache config (--cores takes an L1 and an optional shared L2)" << endl;
+            return 1;
+        }
+        run_multicore(machine, levels, policy, seed, cores, quantum, threads, out);
+        return 0;
+    }
 
-    unsigned short dst; 
-    unsigned short srcA; 
-    unsigned short srcB; 
-    unsigned short imm; 
-    unsigned short opcode; 
-    bool halt = false; 
+    //The options the cache state depends on, as recorded in checkpoints
+    string cache_description;
+    if (!cache_config.empty())
+        cache_description = "cache " + cache_config + " policy " + REPLACEMENT_POLICY_NAMES[policy] +
+            " inclusion " + INCLUSION_NAMES[inclusion] + " write " + (write_policy.empty() ? "wt-wa" : write_policy);
 
-    /* parse cache config */
-    if (cache_config.size() > 0) {
-        vector<int> parts;
+    Profiler profiler;
+
+    TraceWriter trace_writer;
+    if (!trace_out.empty() && !trace_writer.open(trace_out)) {
+        err << "Can't open file " << trace_out << endl;
+        return 1;
+    }
+
+    /*
+        Feeds every memory access to sink, either by running the program
+        or by replaying a trace, and records the accesses if asked to.
+        With --checkpoint-at, stops at the checkpoint to write it, with
+        save_caches(checkpoint) adding the cache state, unless the run
+        stops before it. Returns false if the trace can't be replayed or
+        the checkpoint can't be written.
+    */
+    auto drive = [&](auto &&sink, auto &&save_caches) {
+        if (replaying) {
+            try {
+                replay_trace(trace_in, sink);
+            } catch (LoadError const &e) {
+                err << e.what() << endl;
+                return false;
+            }
+            return true;
+        }
+        auto run = [&](unsigned long long limit) {
+            auto traced = [&](unsigned short pc, unsigned short address, bool is_store) {
+                trace_writer.record(pc, address, is_store);
+                sink(pc, address, is_store);
+            };
+            if (profiling && trace_writer.is_open())
+                run_profiled(machine, limit, profiler, traced);
+            else if (profiling)
+                run_profiled(machine, limit, profiler, sink);
+            else if (trace_writer.is_open())
+                run_until(machine, limit, traced);
+            else
+                run_until(machine, limit, sink);
+            return !machine.halted();
+        };
+        if (checkpointing) {
+            if (!run(min(checkpoint_at, limit))) {
+                err << "The program ended after " << machine.instructions() << " instructions, before the checkpoint" << endl;
+                return false;
+            }
+            if (machine.looping() || machine.instructions() < checkpoint_at)
+                return true;
+            Checkpoint checkpoint;
+            machine.save(checkpoint);
+            save_caches(checkpoint);
+            if (!write_checkpoint(checkpoint_file, checkpoint)) {
+                err << "Can't write checkpoint file " << checkpoint_file << endl;
+                return false;
+            }
+        }
+        run(limit);
+        return true;
+    };
+    auto no_caches = [](Checkpoint &) {};
+
+    /*
+        Runs the program with --sample: fast-forwards through all but
+        the last WINDOW instructions of every PERIOD, only updating the
+        caches with --warm, and counts the cache events of the windows.
+    */
+    auto run_sampled = [&](auto &caches) {
+        SampleStats stats(caches.depth());
+        auto ignore = [](size_t, CacheEvent, int, unsigned) {};
+        auto warm = [&](unsigned short, unsigned short address, bool is_store) {
+            if (is_store)
+                caches.store(address, ignore);
+            else
+                caches.load(address, ignore);
+        };
+        auto detailed = [&](unsigned short, unsigned short address, bool is_store) {
+            auto on_event = [&](size_t level, CacheEvent event, int, unsigned) { stats.count(level, event); };
+            if (is_store)
+                caches.store(address, on_event);
+            else
+                caches.load(address, on_event);
+        };
+        auto running = [&] { return !machine.halted() && !machine.looping() && machine.instructions() < limit; };
+        unsigned long long first = machine.instructions();
+        while (running()) {
+            unsigned long long skip = min(sample_period - sample_window, limit - machine.instructions());
+            if (sample_warm)
+                machine.run(skip, warm);
+            else
+                machine.run(skip);
+            if (!running())
+                break;
+            stats.begin_window();
+            stats.end_window(machine.run(min(sample_window, limit - machine.instructions()), detailed));
+        }
+        stats.print(out, machine.instructions() - first, sample_period);
+    };
+
+    /*
+        Runs --ingest: feeds the external trace to the caches and prints
+        every level's counts, and the throughput to err.
+    */
+    auto run_ingest = [&](auto &caches, vector<CacheLevelConfig> const &levels) {
+        size_t const events = EVENT_PREFETCH + 1;
+        vector<unsigned long long> counts(caches.depth() * events, 0);
+        MissClassCounts miss_classes(caches.depth());
+        auto on_event = [&](size_t level, CacheEvent event, int, unsigned) {
+            counts[level * events + event]++;
+            if (classify_misses && event == EVENT_MISS)
+                miss_classes.count(0, level, caches.miss_class(level));
+        };
+        AddressFolder folder(levels, prefetching ? TRACE_PAGE_SIZE : 1);
+        ExternalTraceReader reader;
+        unsigned long long loads = 0, stores = 0;
+        bool folded_all = true;
+        auto start = chrono::steady_clock::now();
+        try {
+            reader.read(ingest_file, ingest_format, [&](TraceAccess const &a) {
+                unsigned address;
+                if (!folded_all || !(folded_all = folder.fold(a.address, address)))
+                    return;
+                if (a.is_store) {
+                    stores++;
+                    caches.store(address, on_event);
+                } else {
+                    loads++;
+                    caches.load(address, on_event);
+                }
+            });
+        } catch (LoadError const &e) {
+            err << e.what() << endl;
+            return false;
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (!folded_all) {
+            err << "The trace touches more memory than the cache model can tell apart" << endl;
+            return false;
+        }
+        for (size_t level = 0; level < caches.depth(); level++) {
+            unsigned long long hits = counts[level * events + EVENT_HIT];
+            unsigned long long misses = counts[level * events + EVENT_MISS];
+            out << "L" << level + 1 << " lw: " << hits << " hits, " << misses << " misses ("
+                << percent(misses, hits + misses) << "), sw: " << counts[level * events + EVENT_SW]
+                << ", writebacks: " << counts[level * events + EVENT_WB] << endl;
+        }
+        if (prefetching)
+            print_prefetch_stats(out, caches);
+        if (classify_misses)
+            miss_classes.write_levels(out);
+        out << "Trace: " << loads + stores << " accesses (" << loads << " lw, " << stores << " sw), "
+            << reader.skipped() << " other records skipped" << endl;
+        err << "Simulated " << loads + stores << " accesses in " << elapsed.count() << " s ("
+            << (loads + stores) / elapsed.count() << " accesses/s)" << endl;
+        return true;
+    };
+
+    /* parse sweep config */
+    if (sweep_config.size() > 0) {
+        vector<string> ranges;
         size_t pos;
         size_t lastpos = 0;
-
-        //Variables for one cache 
-        int c1L1size; //rows 
-        int c1L1assoc;//blocks per row 
-        int c1L1blocksize; //blocksize 
-        int c1L1rows; 
-        vector<vector<int>> cache; 
-
-        //Variables for two caches 
-        int c2L1size;
-        int c2L1assoc;
-        int c2L1blocksize;
-        int c2L1rows;
-        int c2L2size;
-        int c2L2assoc;
-        int c2L2blocksize;
-        int c2L2rows;
-        vector<vector<int>> L1cache; 
-        vector<vector<int>> L2cache; 
-
-        while ((pos = cache_config.find(",", lastpos)) != string::npos) {
-            parts.push_back(stoi(cache_config.substr(lastpos,pos)));
+        while ((pos = sweep_config.find(",", lastpos)) != string::npos) {
+            ranges.push_back(sweep_config.substr(lastpos, pos - lastpos));
             lastpos = pos + 1;
         }
-        parts.push_back(stoi(cache_config.substr(lastpos)));
-        if (parts.size() == 3) {
-            c1L1size = parts[0]; 
-            c1L1assoc = parts[1]; //blocks per row 
-            c1L1blocksize = parts[2]; //blocksize 
-            c1L1rows = c1L1size / (c1L1assoc * c1L1blocksize);
-            cache = vector<vector<int>>(c1L1rows, vector<int>(c1L1assoc, -1)); 
-            print_cache_config("L1", c1L1size, c1L1assoc, c1L1blocksize, c1L1rows);
-            // TODO: execute E20 program and simulate one cache here
-        } else if (parts.size() == 6) {
-            c2L1size = parts[0];
-            c2L1assoc = parts[1];
-            c2L1blocksize = parts[2];
-            c2L1rows = c2L1size / (c2L1assoc * c2L1blocksize);
-            c2L2size = parts[3];
-            c2L2assoc = parts[4];
-            c2L2blocksize = parts[5];
-            c2L2rows = c2L2size / (c2L2assoc * c2L2blocksize);
-            L1cache = vector<vector<int>>(c2L1rows, vector<int>(c2L1assoc, -1)); 
-            L2cache = vector<vector<int>>(c2L2rows, vector<int>(c2L2assoc, -1));
-            print_cache_config("L1", c2L1size, c2L1assoc, c2L1blocksize, c2L1rows); 
-            print_cache_config("L2", c2L2size, c2L2assoc, c2L2blocksize, c2L2rows);
-            // TODO: execute E20 program and simulate two caches here
-        } else {
-            cerr << "Invalid cache config"  << endl;
+        ranges.push_back(sweep_config.substr(lastpos));
+        vector<int> sizes, assocs, blocksizes;
+        if (ranges.size() != 3 || !parse_sweep_range(ranges[0], sizes) ||
+                !parse_sweep_range(ranges[1], assocs) || !parse_sweep_range(ranges[2], blocksizes)) {
+            err << "Invalid sweep config" << endl;
+            return 1;
+        }
+        StackDistanceSweep sweep(sizes, assocs, blocksizes);
+        if (sweep.empty()) {
+            err << "Invalid sweep config" << endl;
             return 1;
         }
+        if (!drive([&](unsigned short, unsigned short address, bool is_store) {
+                sweep.access(address, is_store);
+            }, no_caches))
+            return 1;
+        sweep.print(out);
+    }
 
-        //E20 Processor 
-
-        while (!halt && pc < 8192){ 
-            unsigned short curr_instruction = memory[pc]; 
-            opcode = curr_instruction>>13;  
-            if (opcode == 0){
-                srcA = curr_instruction>>10 & 7;
-                srcB = curr_instruction>>7 & 7; 
-                dst = curr_instruction>>4 & 7;
-                if (dst != 0){ //the following directions all modify the dst register
-                    if ((curr_instruction & 15) == 0){
-                        unsigned short result = registers[srcA] + registers[srcB]; 
-                        registers[dst] = result;   
-                        //add
-                    }
-                    else if ((curr_instruction & 15) == 1){
-                        unsigned short result = registers[srcA] - registers[srcB]; 
-                        registers[dst] = result; 
-                        //sub
-                    }
-                    else if ((curr_instruction & 15) == 2){
-                        unsigned short result = registers[srcA] | registers[srcB]; 
-                        registers[dst] = result; 
-                        //or
-                    }
-                    else if ((curr_instruction & 15) == 3){
-                        unsigned short result = registers[srcA] & registers[srcB]; 
-                        registers[dst] = result; 
-                        //and 
-                    }
-                    else if ((curr_instruction & 15) == 4){
-                        if (registers[srcA] < registers[srcB]){
-                            registers[dst] = 1; 
-                        }
-                        else{
-                            registers[dst] = 0; 
-                        }
-                        //slt
-                    }
-                }
-                pc += 1;
-                if ((curr_instruction & 15) == 8){
-                    pc = registers[srcA];
-                    //jr 
-                }
-            }
-            else if (opcode == 7){
-                srcA = curr_instruction>>10 & 7; 
-                dst = curr_instruction>>7 & 7; 
-                imm = signExtender7B(curr_instruction & 127);  
-                if (dst != 0){
-                    if (registers[srcA] < imm){
-                        registers[dst] = 1; 
-                    }
-                    else{
-                        registers[dst] = 0; 
-                    }
+    /* parse cache config */
+    if (cache_config.size() > 0) {
+        vector<CacheLevelConfig> levels;
+        if (!parse_cache_levels(cache_config, levels)) {
+            err << "Invalid cache config"  << endl;
+            return 1;
+        }
+        if (inclusion == EXCLUSIVE)
+            for (CacheLevelConfig const &level : levels)
+                if (level.blocksize != levels[0].blocksize) {
+                    err << "Exclusive caches need the same blocksize at every level" << endl;
+                    return 1;
                 }
-                pc += 1; 
-                //slti
-            }
-            else if (opcode == 4){
-                srcA = curr_instruction>>10 & 7;
-                dst = curr_instruction>>7 & 7; 
-                imm = signExtender7B(curr_instruction & 127); 
-                unsigned short address = registers[srcA] + imm;
-                if (dst != 0){
-                    registers[dst] = memory[address]; 
+        vector<WritePolicy> write_policies;
+        if (!write_policy.empty() && !parse_write_policies(write_policy, levels.size(), write_policies)) {
+            err << "Invalid write policy" << endl;
+            return 1;
+        }
+        if (inclusion == EXCLUSIVE)
+            for (WritePolicy const &wp : write_policies)
+                if (!wp.write_allocate) {
+                    err << "Exclusive caches need write-allocate" << endl;
+                    return 1;
                 }
-                //lw
-
-                //1 Cache 
-                if (parts.size() == 3){
-                    int blockid = address / c1L1blocksize; 
-                    int index = blockid % c1L1rows; 
-                    int curr_tag = blockid / c1L1rows; 
-                    bool evictLRU = true; 
-                    bool tagFound = false; 
-
-                    for (int i = cache[index].size()-1; i >= 0 ; i--){  //Traverse through the row to check for current tag 
-                        if (cache[index][i] == curr_tag){
-                            for (int j = i+1; j < cache[index].size(); j++){ //If current tag is found, move current tag to front and shift all other tags back 
-                                cache[index][j-1] = cache[index][j]; 
-                            }
-                            cache[index][cache[index].size() - 1] = curr_tag;
-                            tagFound = true; 
-                            break; 
-                        }
-                        else if (cache[index][i] == -1){
-                            for (int i = 1; i < cache[index].size(); i++){ //If an empty space in the row is available, move current tag to front and shift other tags/empty spaces back 
-                                cache[index][i-1] = cache[index][i]; 
-                            }
-                            cache[index][cache[index].size() - 1] = curr_tag; 
-                            evictLRU = false; 
-                            break; 
-                        }
-                    }
+        vector<PrefetcherKind> prefetchers;
+        if (prefetching && !parse_prefetchers(prefetch, levels.size(), prefetchers)) {
+            err << "Invalid prefetcher" << endl;
+            return 1;
+        }
+        if (prefetching && inclusion == EXCLUSIVE) {
+            err << "Exclusive caches can't prefetch" << endl;
+            return 1;
+        }
+        if (classify_misses && inclusion == EXCLUSIVE) {
+            err << "Exclusive caches can't classify misses" << endl;
+            return 1;
+        }
+        //Program addresses stay within E20's memory; trace addresses
+        //stay within their 4 KB page
+        vector<PrefetchConfig> prefetch_configs;
+        for (PrefetcherKind kind : prefetchers)
+            prefetch_configs.push_back(PrefetchConfig{kind, (unsigned)prefetch_degree, (unsigned)prefetch_distance,
+                                                      (unsigned)prefetch_latency,
+                                                      ingesting ? TRACE_PAGE_SIZE : (unsigned long)MEM_SIZE});
 
-                    if (evictLRU && !tagFound){  
-                        for (int i = 1; i < cache[index].size(); i++){  //If an eviction is necessary, shift all elements back to remove the least recently used tag, and then insert the current tag at the front
-                            cache[index][i-1] = cache[index][i]; 
-                        }
-                        cache[index][cache[index].size() - 1] = curr_tag;
-                    }
+        //Everything that touches the caches is compiled once per policy
+        //and inclusion mode
+        bool ok = with_cache_hierarchy(policy, inclusion, [&](auto hierarchy_tag) {
+            typename decltype(hierarchy_tag)::type caches(levels, seed, write_policies, prefetch_configs,
+                                                     classify_misses);
 
-                    if (tagFound){
-                        print_log_entry("L1","HIT",pc,address,index);                     
-                    }
-                    else{
-                        print_log_entry("L1","MISS",pc,address,index);                     
-                    }
+            //A checkpoint without cache state leaves the caches empty
+            if (!restored.cache_config.empty()) {
+                if (restored.cache_config != cache_description) {
+                    err << "Checkpoint " << restore_file << " was taken with different cache options ("
+                        << restored.cache_config << ")" << endl;
+                    return false;
                 }
-                //2 Caches 
-                else if (parts.size() == 6){
-                    int L1blockid = address / c2L1blocksize; 
-                    int L1index = L1blockid % c2L1rows;
-                    int L1curr_tag = L1blockid / c2L1rows; 
-                    bool L1evictLRU = true; 
-                    bool L1tagFound = false; 
-
-                    int L2blockid = address / c2L2blocksize; 
-                    int L2index = L2blockid % c2L2rows;
-                    int L2curr_tag = L2blockid / c2L2rows; 
-                    bool L2evictLRU = true; 
-                    bool L2tagFound = false; 
-
-                    for (int i = L1cache[L1index].size()-1; i >= 0 ; i--){ 
-                        if (L1cache[L1index][i] == L1curr_tag){
-                            for (int j = i+1; j < L1cache[L1index].size(); j++){ 
-                                L1cache[L1index][j-1] = L1cache[L1index][j]; 
-                            }
-                            L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag;
-                            L1tagFound = true; 
-                            break; 
-                        }
-                        else if (L1cache[L1index][i] == -1){
-                            for (int i = 1; i < L1cache[L1index].size(); i++){
-                                L1cache[L1index][i-1] = L1cache[L1index][i]; 
-                            }
-                            L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag;  
-                            L1evictLRU = false; 
-                            break; 
-                        }
-                    }
+                StateReader reader(restored.cache_state.data(), restored.cache_state.size());
+                caches.transfer(reader);
+                if (!reader.ok()) {
+                    err << "Checkpoint file is corrupt: " << restore_file << endl;
+                    return false;
+                }
+            }
 
-                    if (L1evictLRU){
-                        for (int i = 1; i < L1cache[L1index].size(); i++){
-                            L1cache[L1index][i-1] = L1cache[L1index][i]; 
-                        }
-                        L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag; 
-                    }
+            if (binary_log) {
+                unsigned char header[8] = {0};
+                memcpy(header, BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC));
+                header[4] = BINARY_LOG_VERSION;
+                out.write(reinterpret_cast<char const *>(header), sizeof(header));
+            }
+            else {
+                for (size_t i = 0; i < levels.size(); i++)
+                    print_cache_config(out, "L" + to_string(i + 1), levels[i].size, levels[i].assoc, levels[i].blocksize, levels[i].rows());
+            }
 
-                    if(L1tagFound){
-                        print_log_entry("L1","HIT",pc,address,L1index); 
-                    }
-                    else{
-                        print_log_entry("L1","MISS",pc,address,L1index);  //Only if the L1 Cache is a miss do we consult the L2 cache 
-
-                        for (int i = L2cache[L2index].size()-1; i >= 0 ; i--){ 
-                            if (L2cache[L2index][i] == L2curr_tag){
-                                for (int j = i+1; j < L2cache[L2index].size(); j++){ 
-                                    L2cache[L2index][j-1] = L2cache[L2index][j]; 
-                                }
-                                L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag;
-                                L2tagFound = true; 
-                                break; 
-                            }
-                            else if (L2cache[L2index][i] == -1){
-                                for (int i = 1; i < L2cache[L2index].size(); i++){
-                                    L2cache[L2index][i-1] = L2cache[L2index][i]; 
-                                }
-                                L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag; 
-                                L2evictLRU = false; 
-                                break; 
-                            }
-                        }
-
-                        if (L2evictLRU && !L2tagFound){
-                            for (int i = 1; i < L2cache[L2index].size(); i++){
-                                L2cache[L2index][i-1] = L2cache[L2index][i]; 
-                            }
-                            L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag; 
-                        }
-                        
-                        if (L2tagFound){
-                            print_log_entry("L2","HIT",pc,address,L2index); 
-                        }
-                        else{
-                            print_log_entry("L2","MISS",pc,address,L2index); 
-                        }
-                    }
-                }
-                pc += 1; 
+            if (sample_period > 0) {
+                run_sampled(caches);
+                return true;
             }
-            else if (opcode == 5){
-                srcA = curr_instruction>>10 & 7;
-                srcB = curr_instruction>>7 & 7; 
-                imm = signExtender7B(curr_instruction & 127); 
-                unsigned short address = registers[srcA] + imm; 
-                memory[address] = registers[srcB]; 
-                //sw 
-
-                //1 Cache 
-                if (parts.size() == 3){
-                    int blockid = address / c1L1blocksize; 
-                    int index = blockid % c1L1rows;
-                    int curr_tag = blockid / c1L1rows; 
-                    bool evictLRU = true; 
-                    bool tagFound = false; 
-
-                    for (int i = cache[index].size()-1; i >= 0 ; i--){ 
-                        if (cache[index][i] == curr_tag){
-                            for (int j = i+1; j < cache[index].size(); j++){ 
-                                cache[index][j-1] = cache[index][j]; 
-                            }
-                            cache[index][cache[index].size() - 1] = curr_tag;
-                            tagFound = true; 
-                            break; 
-                        }
-                        else if (cache[index][i] == -1){
-                            for (int i = 1; i < cache[index].size(); i++){
-                                cache[index][i-1] = cache[index][i]; 
-                            }
-                            cache[index][cache[index].size() - 1] = curr_tag; 
-                            evictLRU = false; 
-                            break; 
-                        }
-                    }
+            if (ingesting)
+                return run_ingest(caches, levels);
 
-                    if (evictLRU){
-                        for (int i = 1; i < cache[index].size(); i++){
-                            cache[index][i-1] = cache[index][i]; 
-                        }
-                        cache[index][cache[index].size() - 1] = curr_tag; 
-                    }
-                    print_log_entry("L1","SW",pc,address,index);                     
-                }
-                //2 Caches 
-                else if (parts.size() == 6){
-                    int L1blockid = address / c2L1blocksize; 
-                    int L1index = L1blockid % c2L1rows;
-                    int L1curr_tag = L1blockid / c2L1rows; 
-                    bool L1evictLRU = true; 
-                    bool L1tagFound = false; 
-
-                    int L2blockid = address / c2L2blocksize; 
-                    int L2index = L2blockid % c2L2rows;
-                    int L2curr_tag = L2blockid / c2L2rows; 
-                    bool L2evictLRU = true; 
-                    bool L2tagFound = false; 
-
-                    for (int i = L1cache[L1index].size()-1; i >= 0 ; i--){ 
-                        if (L1cache[L1index][i] == L1curr_tag){
-                            for (int j = i+1; j < L1cache[L1index].size(); j++){ 
-                                L1cache[L1index][j-1] = L1cache[L1index][j]; 
-                            }
-                            L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag;
-                            L1tagFound = true; 
-                            break; 
-                        }
-                        else if (L1cache[L1index][i] == -1){
-                            for (int i = 1; i < L1cache[L1index].size(); i++){
-                                L1cache[L1index][i-1] = L1cache[L1index][i]; 
-                            }
-                            L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag;  
-                            L1evictLRU = false; 
-                            break; 
-                        }
-                    }
+            //Log entries are formatted and written on a separate thread
+            AsyncLogSink<CacheLogRecord> log(out, binary_log ? write_binary_log : write_text_log);
 
-                    if (L1evictLRU && !L1tagFound){
-                        for (int i = 1; i < L1cache[L1index].size(); i++){
-                            L1cache[L1index][i-1] = L1cache[L1index][i]; 
-                        }
-                        L1cache[L1index][L1cache[L1index].size() - 1] = L1curr_tag; 
-                    }
-                    print_log_entry("L1","SW",pc,address,L1index); 
-
-                    for (int i = L2cache[L2index].size()-1; i >= 0 ; i--){ 
-                            if (L2cache[L2index][i] == L2curr_tag){
-                                for (int j = i+1; j < L2cache[L2index].size(); j++){ 
-                                    L2cache[L2index][j-1] = L2cache[L2index][j]; 
-                                }
-                                L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag;
-                                L2tagFound = true; 
-                                break; 
-                            }
-                            else if (L2cache[L2index][i] == -1){
-                                for (int i = 1; i < L2cache[L2index].size(); i++){
-                                    L2cache[L2index][i-1] = L2cache[L2index][i]; 
-                                }
-                                L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag; 
-                                L2evictLRU = false; 
-                                break; 
-                            }
+            profiler = Profiler(levels.size());
+            MissClassCounts miss_classes(classify_misses ? levels.size() : 0, MEM_SIZE);
+            auto access = [&](unsigned short pc, unsigned short address, bool is_store) {
+                auto on_event = [&](size_t level, CacheEvent event, int row, unsigned block_address) {
+                    unsigned char tag = 0;
+                    if (classify_misses && event == EVENT_MISS) {
+                        MissClass c = caches.miss_class(level);
+                        miss_classes.count(pc, level, c);
+                        if (tag_misses)
+                            tag = 1 + c;
                     }
+                    log.push(CacheLogRecord{pc, (unsigned short)block_address, (unsigned)row,
+                                            (unsigned char)(level + 1), (unsigned char)event, tag});
+                    if (profiling)
+                        profiler.cache_event(pc, level, event);
+                };
+                if (is_store)
+                    caches.store(address, on_event, pc);
+                else
+                    caches.load(address, on_event, pc);
+            };
+            auto save_caches = [&](Checkpoint &checkpoint) {
+                StateWriter writer;
+                caches.transfer(writer);
+                checkpoint.cache_config = cache_description;
+                checkpoint.cache_state.swap(writer.bytes);
+            };
+            if (!drive(access, save_caches))
+                return false;
+            log.close();
 
-                    if (L2evictLRU && !L2tagFound){
-                        for (int i = 1; i < L2cache[L2index].size(); i++){
-                            L2cache[L2index][i-1] = L2cache[L2index][i]; 
-                        }
-                        L2cache[L2index][L2cache[L2index].size() - 1] = L2curr_tag; 
-                    }
-                    print_log_entry("L2","SW",pc,address,L2index); 
-                }
-                pc += 1; 
-            }
-            else if (opcode == 6){
-                srcA = curr_instruction>>10 & 7;
-                srcB = curr_instruction>>7 & 7; 
-                imm = signExtender7B(curr_instruction & 127); 
-                if (registers[srcA] == registers[srcB]){
-                    pc += imm;  
-                }
-                pc += 1; 
-                //jeq 
-            }
-            else if (opcode == 1){
-                srcA = curr_instruction>>10 & 7; 
-                dst = curr_instruction>>7 & 7;  
-                imm = signExtender7B(curr_instruction & 127); 
-                if (dst != 0){
-                    unsigned short result = registers[srcA] + imm;
-                    registers[dst] = result; 
-                }
-                pc += 1; 
-                //addi
+            if (show_traffic)
+                print_traffic(binary_log ? err : out, caches);
+            if (prefetching)
+                print_prefetch_stats(binary_log ? err : out, caches);
+            if (classify_misses) {
+                miss_classes.write_levels(binary_log ? err : out);
+                miss_classes.write_pcs(binary_log ? err : out);
             }
-            else if (opcode == 2){
-                imm = curr_instruction & 8191;
-                if (pc == imm){
-                    halt = true; 
-                }
-                else{
-                    pc = imm;
-                } 
-                //j
-            }
-            else if (opcode == 3){
-                imm = curr_instruction & 8191;
-                registers[7] = pc+1; 
-                pc = imm; 
-                //jal
-            }
-        }    
+            return true;
+        });
+        if (!ok)
+            return 1;
+    }
+    else if (sweep_config.empty() && (trace_writer.is_open() || checkpointing || profiling || bounded)) {
+        if (!drive([](unsigned short, unsigned short, bool) {}, no_caches))
+            return 1;
     }
 
-    f.close(); 
+    if (trace_writer.is_open() && !trace_writer.close()) {
+        err << "Can't write trace file " << trace_out << endl;
+        return 1;
+    }
 
+    if (profiling) {
+        ofstream report(profile_file);
+        ofstream folded(profile_file + ".folded");
+        if (report.is_open())
+            profiler.write_report(report);
+        if (folded.is_open())
+            profiler.write_folded(folded);
+        if (!report.is_open() || !folded.is_open() || !report || !folded) {
+            err << "Can't write profile " << profile_file << endl;
+            return 1;
+        }
+    }
+
+    if (machine.looping()) {
+        err << "The program came back to an earlier state at pc " << machine.pc() << " after " <<
+            machine.instructions() << " instructions, so it will never halt" << endl;
+        return EXIT_NEVER_HALTS;
+    }
+    if (max_instructions > 0 && !machine.halted()) {
+        err << "Stopped after " << machine.instructions() << " instructions without halting" << endl;
+        return EXIT_INSTRUCTION_LIMIT;
+    }
     return 0;
 }
 
+/*
+    Main function
+    Takes command-line args as documented in simulate
+*/
+int main(int argc, char *argv[]) {
+    string progname = argv[0];
+    vector<string> args(argv + 1, argv + argc);
+    BatchOptions batch;
+    if (parse_batch_options(args, batch)) {
+        SimulateFn simulate_job = [&progname](vector<string> const &job_args, ostream &out, ostream &err) {
+            return simulate(progname, job_args, out, err);
+        };
+        return run_batch(batch, simulate_job, cout, cerr);
+    }
+    return simulate(progname, args, cout, cerr);
+}
+
 
-//ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file
+//ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file
@@ -0,0 +1,213 @@
+#ifndef E20_CHECKPOINT_H
+#define E20_CHECKPOINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "E20_Loader.h"
+
+/*
+    Checkpoints of a simulation, shared by E20_Processor and E20_Cache.
+
+    A checkpoint file holds the machine state after some number of
+    instructions and, when written by E20_Cache, the complete state of
+    its cache hierarchy. All values are little-endian.
+
+        offset  size  field
+             0     4  magic "E20C"
+             4     2  format version (E20_CHECKPOINT_VERSION)
+             6     2  reserved, 0
+             8     8  instructions executed before the checkpoint
+            16     2  pc
+            18    16  registers $0..$7
+            34     2  reserved, 0
+            36     4  FNV-1a checksum of everything from offset 48 on
+            40     4  length of the cache configuration text (0: no caches)
+            44     4  length of the cache state
+            48 16384  memory, 8192 words
+         16432        cache configuration text, then cache state
+
+    The cache configuration text records the options the caches were
+    built with, so a restore can check that it rebuilds the same
+    hierarchy before it loads the state into it. The state itself is
+    whatever the hierarchy's transfer() writes (see StateWriter).
+*/
+
+char const static E20_CHECKPOINT_MAGIC[4] = {'E', '2', '0', 'C'};
+unsigned const static E20_CHECKPOINT_VERSION = 1;
+size_t const static E20_CHECKPOINT_HEADER_SIZE = 48;
+size_t const static E20_CHECKPOINT_MEM_SIZE = 1<<13;
+
+/*
+    The contents of a checkpoint file.
+*/
+struct Checkpoint {
+    unsigned long long instructions = 0;
+    unsigned short pc = 0;
+    unsigned short registers[8] = {0};
+    std::vector<unsigned short> memory = std::vector<unsigned short>(E20_CHECKPOINT_MEM_SIZE, 0);
+    std::string cache_config;
+    std::vector<unsigned char> cache_state;
+};
+
+/*
+    Serializes simulator state into bytes. Objects describe their state
+    once, in a template member
+
+        template <typename Archive> void transfer(Archive &a);
+
+    that passes every field to a(...); the same function then both
+    saves (with a StateWriter) and restores (with a StateReader).
+    Integers are written little-endian.
+*/
+class StateWriter {
+public:
+    template <typename T>
+    void operator()(T &value) {
+        uint64_t v = (uint64_t)value;
+        for (size_t i = 0; i < sizeof(T); i++)
+            bytes.push_back(v >> (8 * i));
+    }
+
+    template <typename T>
+    void operator()(T *values, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            (*this)(values[i]);
+    }
+
+    template <typename T>
+    void operator()(std::vector<T> &values) {
+        uint64_t size = values.size();
+        (*this)(size);
+        (*this)(values.data(), values.size());
+    }
+
+    std::vector<unsigned char> bytes;
+};
+
+/*
+    Restores state written by StateWriter. Vectors must already have
+    the size they were saved with, i.e. the object must have been built
+    from the same configuration; anything else makes ok() false.
+*/
+class StateReader {
+public:
+    StateReader(unsigned char const *data, size_t size) : p_(data), end_(data + size), ok_(true) {}
+
+    template <typename T>
+    void operator()(T &value) {
+        if ((size_t)(end_ - p_) < sizeof(T)) {
+            ok_ = false;
+            p_ = end_;
+            return;
+        }
+        uint64_t v = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            v |= (uint64_t)p_[i] << (8 * i);
+        p_ += sizeof(T);
+        value = (T)v;
+    }
+
+    template <typename T>
+    void operator()(T *values, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            (*this)(values[i]);
+    }
+
+    template <typename T>
+    void operator()(std::vector<T> &values) {
+        uint64_t size = 0;
+        (*this)(size);
+        if (size != values.size()) {
+            ok_ = false;
+            p_ = end_;
+            return;
+        }
+        (*this)(values.data(), values.size());
+    }
+
+    /*
+        @return false if the state didn't match or was used up early
+    */
+    bool ok() const { return ok_ && p_ == end_; }
+
+private:
+    unsigned char const *p_;
+    unsigned char const *end_;
+    bool ok_;
+};
+
+/*
+    Writes a checkpoint file, through a temporary name so that a
+    half-written file is never left behind.
+
+    @param filename The file to create
+    @param checkpoint What to write
+    @return false if the file can't be written
+*/
+inline bool write_checkpoint(std::string const &filename, Checkpoint const &checkpoint) {
+    std::vector<unsigned char> bytes(E20_CHECKPOINT_HEADER_SIZE + 2 * E20_CHECKPOINT_MEM_SIZE);
+    memcpy(bytes.data(), E20_CHECKPOINT_MAGIC, sizeof(E20_CHECKPOINT_MAGIC));
+    e20_write32(bytes.data() + 4, E20_CHECKPOINT_VERSION);
+    e20_write32(bytes.data() + 8, checkpoint.instructions);
+    e20_write32(bytes.data() + 12, checkpoint.instructions >> 32);
+    bytes[16] = checkpoint.pc;
+    bytes[17] = checkpoint.pc >> 8;
+    for (size_t i = 0; i < 8; i++) {
+        bytes[18 + 2*i] = checkpoint.registers[i];
+        bytes[19 + 2*i] = checkpoint.registers[i] >> 8;
+    }
+    e20_write32(bytes.data() + 40, checkpoint.cache_config.size());
+    e20_write32(bytes.data() + 44, checkpoint.cache_state.size());
+    unsigned char *words = bytes.data() + E20_CHECKPOINT_HEADER_SIZE;
+    for (size_t i = 0; i < E20_CHECKPOINT_MEM_SIZE; i++) {
+        words[2*i] = checkpoint.memory[i];
+        words[2*i+1] = checkpoint.memory[i] >> 8;
+    }
+    bytes.insert(bytes.end(), checkpoint.cache_config.begin(), checkpoint.cache_config.end());
+    bytes.insert(bytes.end(), checkpoint.cache_state.begin(), checkpoint.cache_state.end());
+    e20_write32(bytes.data() + 36, e20_fnv1a(bytes.data() + E20_CHECKPOINT_HEADER_SIZE,
+                                             bytes.size() - E20_CHECKPOINT_HEADER_SIZE));
+    return e20_write_file(filename, bytes);
+}
+
+/*
+    Reads a checkpoint file, which is mapped rather than read. Errors
+    are thrown as LoadError.
+
+    @param filename The checkpoint file
+    @param checkpoint Receives its contents
+*/
+inline void read_checkpoint(std::string const &filename, Checkpoint &checkpoint) {
+    MappedFile file;
+    if (!file.open(filename.c_str()))
+        throw LoadError("Can't open file " + filename);
+    char const *data = file.data();
+    size_t size = file.size();
+    if (size < E20_CHECKPOINT_HEADER_SIZE || memcmp(data, E20_CHECKPOINT_MAGIC, sizeof(E20_CHECKPOINT_MAGIC)) != 0)
+        throw LoadError("Not a checkpoint file: " + filename);
+    if ((e20_read32(data + 4) & 0xffff) != E20_CHECKPOINT_VERSION)
+        throw LoadError("Unsupported checkpoint version: " + filename);
+    size_t config_size = e20_read32(data + 40);
+    size_t state_size = e20_read32(data + 44);
+    unsigned char const *body = reinterpret_cast<unsigned char const *>(data) + E20_CHECKPOINT_HEADER_SIZE;
+    if (size - E20_CHECKPOINT_HEADER_SIZE != 2 * E20_CHECKPOINT_MEM_SIZE + config_size + state_size ||
+            e20_fnv1a(body, size - E20_CHECKPOINT_HEADER_SIZE) != e20_read32(data + 36))
+        throw LoadError("Checkpoint file is corrupt: " + filename);
+
+    unsigned char const *u = reinterpret_cast<unsigned char const *>(data);
+    checkpoint.instructions = e20_read32(data + 8) | (unsigned long long)e20_read32(data + 12) << 32;
+    checkpoint.pc = u[16] | u[17] << 8;
+    for (size_t i = 0; i < 8; i++)
+        checkpoint.registers[i] = u[18 + 2*i] | u[19 + 2*i] << 8;
+    checkpoint.memory.resize(E20_CHECKPOINT_MEM_SIZE);
+    for (size_t i = 0; i < E20_CHECKPOINT_MEM_SIZE; i++)
+        checkpoint.memory[i] = body[2*i] | body[2*i+1] << 8;
+    char const *rest = data + E20_CHECKPOINT_HEADER_SIZE + 2 * E20_CHECKPOINT_MEM_SIZE;
+    checkpoint.cache_config.assign(rest, config_size);
+    checkpoint.cache_state.assign(rest + config_size, rest + config_size + state_size);
+}
+
+#endif
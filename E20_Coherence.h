@@ -0,0 +1,366 @@
+#ifndef E20_COHERENCE_H
+#define E20_COHERENCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "E20_Batch.h"
+#include "E20_Hierarchy.h"
+#include "E20_Machine.h"
+#include "E20_TagStore.h"
+
+/*
+    Multi-core simulation for E20_Cache --cores: several E20 cores run
+    the same program on one shared memory, each with a private L1, in
+    front of a shared L2 (optional) and memory. The L1s are kept
+    coherent with a MESI snooping protocol on a bus every L1 sees.
+
+    Cores run in quanta of a fixed number of instructions. Within a
+    quantum every core executes on its own host thread against its own
+    copy of memory, so it sees memory as it was at the start of the
+    quantum plus its own stores. At the end of the quantum:
+
+    - the recorded lw/sw of all cores go through the coherent caches
+      in one interleaving, ordered by instruction number within the
+      quantum and then by core, and
+    - the stores are merged into shared memory (of several stores to
+      one address the latest wins, ties going to the higher core) and
+      copied into every core's memory.
+
+    So other cores see a store at the next quantum boundary at the
+    latest. Results depend on the quantum but not on the number of
+    threads.
+*/
+
+/*
+    The state of a block in one L1.
+*/
+enum MesiState : unsigned char { MESI_INVALID, MESI_SHARED, MESI_EXCLUSIVE, MESI_MODIFIED };
+
+/*
+    What one core's L1 saw.
+*/
+struct CoreCacheStats {
+    unsigned long long loads = 0;
+    unsigned long long load_misses = 0;
+    unsigned long long stores = 0;
+    unsigned long long store_misses = 0;
+    unsigned long long upgrades = 0;        // stores to shared blocks
+    unsigned long long invalidated = 0;     // blocks other cores' stores took away
+    unsigned long long supplied = 0;        // blocks sent to other cores' misses
+    unsigned long long writebacks = 0;      // modified blocks written to L2
+};
+
+/*
+    Bus and shared-level totals.
+*/
+struct BusStats {
+    unsigned long long reads = 0;               // BusRd: load misses
+    unsigned long long read_exclusives = 0;     // BusRdX: store misses
+    unsigned long long upgrades = 0;            // BusUpgr: stores to shared blocks
+    unsigned long long invalidations = 0;       // L1 blocks invalidated by the above
+    unsigned long long transfers = 0;           // misses served by another L1
+    unsigned long long l2_hits = 0;
+    unsigned long long l2_misses = 0;
+    unsigned long long memory_writes = 0;       // dirty blocks leaving L2 (or L1 without L2)
+};
+
+/*
+    Private write-back, write-allocate L1s with MESI states, snooping a
+    shared bus, and a shared L2.
+
+    A block with a copy in another L1 in E or M is supplied by that L1
+    (which drops to S, writing an M block back to L2); otherwise misses
+    read L2. A load miss fills E when no other L1 holds the block and S
+    otherwise; a store miss or a store to an S block invalidates every
+    other copy and leaves the block M. E blocks become M silently.
+
+    Since the address space is only MEM_SIZE words, each L1 keeps the
+    state of every block in a flat array, indexed by block number, next
+    to its TagStore; a block not in the TagStore is always invalid.
+*/
+template <typename Policy>
+class MesiCaches {
+public:
+    /*
+        @param cores Number of cores, at least 1
+        @param l1 Configuration of every core's L1
+        @param l2 Configuration of the shared L2, or nullptr for none
+        @param seed Seed for policies that make random choices
+    */
+    MesiCaches(size_t cores, CacheLevelConfig const &l1, CacheLevelConfig const *l2, uint32_t seed)
+            : blocksize_(l1.blocksize), cores_(cores), has_l2_(l2 != nullptr),
+              l2_(l2 ? l2->rows() : 1, l2 ? l2->assoc : 1, l2 ? l2->blocksize : 1, seed) {
+        l1_.reserve(cores);
+        for (size_t i = 0; i < cores; i++)
+            l1_.emplace_back(PrivateCache{TagStore<Policy>(l1.rows(), l1.assoc, l1.blocksize, seed + i),
+                                          std::vector<unsigned char>(MEM_SIZE / blocksize_ + 1, MESI_INVALID),
+                                          CoreCacheStats()});
+    }
+
+    void load(size_t core, unsigned address) {
+        PrivateCache &self = l1_[core];
+        unsigned block = address / blocksize_;
+        self.stats.loads++;
+        int row;
+        if (self.state[block] != MESI_INVALID) {
+            self.tags.access(address, row);
+            return;
+        }
+        self.stats.load_misses++;
+        bus_.reads++;
+        bool shared = false;
+        bool supplied = false;
+        for (size_t i = 0; i < cores_; i++) {
+            PrivateCache &other = l1_[i];
+            if (i == core || other.state[block] == MESI_INVALID)
+                continue;
+            shared = true;
+            if (other.state[block] == MESI_MODIFIED) {
+                other.stats.writebacks++;
+                write_back(address);
+            }
+            if (other.state[block] != MESI_SHARED) {
+                other.state[block] = MESI_SHARED;
+                other.stats.supplied++;
+                supplied = true;
+            }
+        }
+        fill(core, address, shared ? MESI_SHARED : MESI_EXCLUSIVE, supplied);
+    }
+
+    void store(size_t core, unsigned address) {
+        PrivateCache &self = l1_[core];
+        unsigned block = address / blocksize_;
+        unsigned char &state = self.state[block];
+        self.stats.stores++;
+        int row;
+        if (state != MESI_INVALID) {
+            self.tags.access(address, row);
+            if (state == MESI_SHARED) {
+                self.stats.upgrades++;
+                bus_.upgrades++;
+                invalidate_others(core, address);
+            }
+            state = MESI_MODIFIED;
+            return;
+        }
+        self.stats.store_misses++;
+        bus_.read_exclusives++;
+        bool supplied = invalidate_others(core, address);
+        fill(core, address, MESI_MODIFIED, supplied);
+    }
+
+    size_t cores() const { return cores_; }
+    CoreCacheStats const &core_stats(size_t core) const { return l1_[core].stats; }
+    BusStats const &bus_stats() const { return bus_; }
+
+    /*
+        @return The state of the block holding address in core's L1
+    */
+    MesiState state(size_t core, unsigned address) const {
+        return MesiState(l1_[core].state[address / blocksize_]);
+    }
+
+private:
+    struct PrivateCache {
+        TagStore<Policy> tags;
+        std::vector<unsigned char> state;
+        CoreCacheStats stats;
+    };
+
+    /*
+        Drops every other L1's copy of the block holding address.
+
+        @return true if one of them supplies the block
+    */
+    bool invalidate_others(size_t core, unsigned address) {
+        unsigned block = address / blocksize_;
+        bool supplied = false;
+        for (size_t i = 0; i < cores_; i++) {
+            PrivateCache &other = l1_[i];
+            if (i == core || other.state[block] == MESI_INVALID)
+                continue;
+            if (other.state[block] == MESI_MODIFIED) {
+                other.stats.writebacks++;
+                write_back(address);
+            }
+            if (other.state[block] != MESI_SHARED) {
+                other.stats.supplied++;
+                supplied = true;
+            }
+            other.tags.invalidate(address);
+            other.state[block] = MESI_INVALID;
+            other.stats.invalidated++;
+            bus_.invalidations++;
+        }
+        return supplied;
+    }
+
+    /*
+        Brings the block holding address into core's L1, from another L1
+        if supplied, from L2 otherwise.
+    */
+    void fill(size_t core, unsigned address, MesiState state, bool supplied) {
+        PrivateCache &self = l1_[core];
+        if (supplied)
+            bus_.transfers++;
+        else
+            read_shared(address);
+        int row;
+        typename TagStore<Policy>::Eviction evicted;
+        self.tags.access(address, row, evicted);
+        if (evicted.address >= 0) {
+            unsigned char &victim = self.state[evicted.address / blocksize_];
+            if (victim == MESI_MODIFIED) {
+                self.stats.writebacks++;
+                write_back(evicted.address);
+            }
+            victim = MESI_INVALID;
+        }
+        self.state[address / blocksize_] = state;
+    }
+
+    void read_shared(unsigned address) {
+        if (!has_l2_)
+            return;
+        int row;
+        typename TagStore<Policy>::Eviction evicted;
+        if (l2_.access(address, row, evicted))
+            bus_.l2_hits++;
+        else
+            bus_.l2_misses++;
+        if (evicted.dirty)
+            bus_.memory_writes++;
+    }
+
+    void write_back(unsigned address) {
+        if (!has_l2_) {
+            bus_.memory_writes++;
+            return;
+        }
+        int row;
+        typename TagStore<Policy>::Eviction evicted;
+        l2_.access(address, row, evicted, true, true);
+        if (evicted.dirty)
+            bus_.memory_writes++;
+    }
+
+    unsigned blocksize_;
+    size_t cores_;
+    bool has_l2_;
+    std::vector<PrivateCache> l1_;
+    TagStore<Policy> l2_;
+    BusStats bus_;
+};
+
+/*
+    Cores running one program in quanta, as described at the top.
+    Core i starts at pc 0 with i in $1 and all other registers 0, so
+    cores can tell themselves apart.
+*/
+class MultiCore {
+public:
+    /*
+        @param program A machine loaded with the program
+        @param cores Number of cores
+    */
+    MultiCore(Machine const &program, size_t cores)
+            : machines_(cores, program), accesses_(cores), memory_(program.memory(), program.memory() + MEM_SIZE),
+              last_store_(MEM_SIZE, uint64_t(NO_STORE)) {
+        for (size_t i = 0; i < cores; i++)
+            machines_[i].set_reg(1, i);
+    }
+
+    /*
+        Runs one quantum on every core that hasn't halted, then feeds
+        the memory accesses to on_access(core, address, is_store) in
+        their interleaved order and merges the stores.
+
+        @param quantum Instructions per core
+        @param threads Host threads to run cores on
+    */
+    template <typename OnAccess>
+    void run_quantum(unsigned long long quantum, unsigned threads, OnAccess &&on_access) {
+        run_work_stealing(machines_.size(), threads, [&](size_t core) {
+            std::vector<Access> &accesses = accesses_[core];
+            accesses.clear();
+            unsigned long long time = 0;
+            machines_[core].trace(quantum, [&](DecodedInstr const &d, unsigned, unsigned short const regs[]) {
+                if (d.op == OP_LW || d.op == OP_SW)
+                    accesses.push_back(Access{time, (unsigned short)((regs[d.srcA] + d.imm) % MEM_SIZE), d.op == OP_SW});
+                time++;
+            });
+        });
+
+        // Interleave by time, then core
+        std::vector<size_t> next(machines_.size(), 0);
+        while (true) {
+            size_t best = machines_.size();
+            for (size_t i = 0; i < machines_.size(); i++)
+                if (next[i] < accesses_[i].size() &&
+                        (best == machines_.size() || accesses_[i][next[i]].time < accesses_[best][next[best]].time))
+                    best = i;
+            if (best == machines_.size())
+                break;
+            Access const &a = accesses_[best][next[best]++];
+            on_access(best, a.address, a.is_store);
+        }
+
+        // The last store to each address wins, ties going to the
+        // higher core
+        std::vector<unsigned short> stored;
+        for (size_t i = 0; i < machines_.size(); i++)
+            for (Access const &a : accesses_[i]) {
+                if (!a.is_store)
+                    continue;
+                uint64_t &last = last_store_[a.address];
+                uint64_t key = a.time * machines_.size() + i;
+                if (last == NO_STORE)
+                    stored.push_back(a.address);
+                if (last == NO_STORE || key > last)
+                    last = key;
+            }
+        for (unsigned short address : stored) {
+            unsigned short value = machines_[last_store_[address] % machines_.size()].memory()[address];
+            memory_[address] = value;
+            for (Machine &m : machines_)
+                if (m.memory()[address] != value)
+                    m.write(address, value);
+            last_store_[address] = NO_STORE;
+        }
+    }
+
+    /*
+        @return true once every core has halted
+    */
+    bool halted() const {
+        for (Machine const &m : machines_)
+            if (!m.halted())
+                return false;
+        return true;
+    }
+
+    size_t cores() const { return machines_.size(); }
+    Machine const &core(size_t i) const { return machines_[i]; }
+    unsigned short const *memory() const { return memory_.data(); }
+
+private:
+    static constexpr uint64_t NO_STORE = ~uint64_t(0);
+
+    struct Access {
+        unsigned long long time;
+        unsigned short address;
+        bool is_store;
+    };
+
+    std::vector<Machine> machines_;
+    // The lw/sw of each core in the current quantum, in order.
+    std::vector<std::vector<Access>> accesses_;
+    std::vector<unsigned short> memory_;
+    // Per address, time * cores + core of the winning store so far.
+    std::vector<uint64_t> last_store_;
+};
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef E20_EXTERNALTRACE_H
+#define E20_EXTERNALTRACE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "E20_Hierarchy.h"
+#include "E20_Loader.h"
+
+/*
+    Address traces from outside E20, for E20_Cache --ingest. Addresses
+    are up to 64 bits wide and count bytes, i.e. one byte per cache
+    cell. Three formats are read:
+
+    - din (Dinero): one "LABEL ADDRESS [SIZE]" record per line, with
+      the address in hex. Label 0 is a read and 1 a write; instruction
+      fetches (2) and the escape records (3, 4) are skipped.
+    - lackey (valgrind --tool=lackey --trace-mem=yes): " L ADDR,SIZE"
+      loads, " S ADDR,SIZE" stores and " M ADDR,SIZE" modifies (a load
+      then a store), addresses in hex. Instruction fetches ("I") and
+      valgrind's own "==PID==" lines are skipped.
+    - bin64: 8-byte little-endian records without a header, holding
+      the address in bits 0-62 and 1 for a store in bit 63.
+
+    Every record is one access at its address, whatever its size.
+
+    The file is mapped (see MappedFile) and parsed on a separate thread,
+    which hands the accesses over in batches; the simulation only waits
+    when it has used up every parsed batch.
+*/
+
+enum TraceFormat { TRACE_DIN, TRACE_LACKEY, TRACE_BIN64 };
+
+char const static *const TRACE_FORMAT_NAMES[] = {"din", "lackey", "bin64"};
+
+/*
+    @param name din, lackey or bin64
+    @param format Receives the format
+    @return false if name is not a format
+*/
+inline bool parse_trace_format(std::string const &name, TraceFormat &format) {
+    for (int i = TRACE_DIN; i <= TRACE_BIN64; i++)
+        if (name == TRACE_FORMAT_NAMES[i]) {
+            format = TraceFormat(i);
+            return true;
+        }
+    return false;
+}
+
+/*
+    The page size of trace addresses: prefetches into a cache fed by a
+    trace don't cross 4 KB pages.
+*/
+unsigned long const static TRACE_PAGE_SIZE = 4096;
+
+/*
+    One memory access of an external trace.
+*/
+struct TraceAccess {
+    uint64_t address;
+    bool is_store;
+};
+
+/*
+    Reads an external trace on a background thread.
+*/
+class ExternalTraceReader {
+public:
+    /*
+        @param batch_accesses Accesses per batch
+        @param batches Number of batches in the ring
+    */
+    explicit ExternalTraceReader(size_t batch_accesses = 1<<16, size_t batches = 4)
+            : batch_accesses_(batch_accesses), batches_(batches), accesses_(batch_accesses * batches),
+              counts_(batches, 0), head_(0), tail_(0), done_(false), stopping_(false), skipped_(0) {}
+
+    ~ExternalTraceReader() { stop(); }
+
+    ExternalTraceReader(ExternalTraceReader const &) = delete;
+    ExternalTraceReader &operator=(ExternalTraceReader const &) = delete;
+
+    /*
+        Opens a trace, starts parsing it, and calls on_access(access)
+        for every access in order. Errors in the file are thrown as
+        LoadError.
+    */
+    template <typename OnAccess>
+    void read(std::string const &filename, TraceFormat format, OnAccess &&on_access) {
+        if (!file_.open(filename.c_str()))
+            throw LoadError("Can't open file " + filename);
+        if (format == TRACE_BIN64 && file_.size() % 8 != 0)
+            throw LoadError("Trace file is truncated: " + filename);
+        filename_ = filename;
+        thread_ = std::thread(&ExternalTraceReader::parse, this, format);
+        while (true) {
+            std::unique_lock<std::mutex> guard(lock_);
+            changed_.wait(guard, [this] { return tail_ < head_ || done_; });
+            if (tail_ == head_)
+                break;
+            size_t batch = tail_ % batches_;
+            guard.unlock();
+            TraceAccess const *accesses = &accesses_[batch * batch_accesses_];
+            for (size_t i = 0; i < counts_[batch]; i++)
+                on_access(accesses[i]);
+            guard.lock();
+            tail_++;
+            changed_.notify_all();
+        }
+        stop();
+        if (!error_.empty())
+            throw LoadError(error_);
+    }
+
+    /*
+        @return The records skipped as not data accesses
+    */
+    unsigned long long skipped() const { return skipped_; }
+
+private:
+    /*
+        Parses the file into batches. Runs on thread_.
+    */
+    void parse(TraceFormat format) {
+        char const *p = file_.data();
+        char const *end = p + file_.size();
+        size_t line = 0;
+        size_t fill = 0;
+        TraceAccess *batch = &accesses_[0];
+        auto emit = [&](uint64_t address, bool is_store) {
+            if (!batch)
+                return;
+            batch[fill++] = TraceAccess{address, is_store};
+            if (fill == batch_accesses_) {
+                batch = submit(fill);
+                fill = 0;
+            }
+        };
+        while (p < end && batch) {
+            if (format == TRACE_BIN64) {
+                uint64_t record = 0;
+                for (int i = 0; i < 8; i++)
+                    record |= (uint64_t)(unsigned char)p[i] << (8 * i);
+                p += 8;
+                emit(record & ~(uint64_t(1) << 63), record >> 63);
+                continue;
+            }
+            line++;
+            char const *eol = p;
+            while (eol < end && *eol != '\n')
+                eol++;
+            if (!parse_line(format, p, eol, emit)) {
+                error_ = filename_ + ":" + std::to_string(line) + ": Invalid " + TRACE_FORMAT_NAMES[format] + " record";
+                break;
+            }
+            p = eol + 1;
+        }
+        if (batch && fill > 0)
+            submit(fill);
+        std::lock_guard<std::mutex> guard(lock_);
+        done_ = true;
+        changed_.notify_all();
+    }
+
+    /*
+        Parses the text record from p to eol.
+
+        @return false if it is malformed
+    */
+    template <typename Emit>
+    bool parse_line(TraceFormat format, char const *p, char const *eol, Emit &&emit) {
+        while (p < eol && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p == eol || *p == '\r')
+            return true;
+        if (format == TRACE_DIN) {
+            char label = *p++;
+            if (p == eol || (*p != ' ' && *p != '\t') || label < '0' || label > '4')
+                return false;
+            uint64_t address;
+            if (!parse_hex(p, eol, address))
+                return false;
+            if (label <= '1')
+                emit(address, label == '1');
+            else
+                skipped_++;
+            return true;
+        }
+        if (*p == '=') {
+            skipped_++;
+            return true;
+        }
+        char kind = *p++;
+        uint64_t address;
+        if ((kind != 'I' && kind != 'L' && kind != 'S' && kind != 'M') || !parse_hex(p, eol, address))
+            return false;
+        if (kind == 'I')
+            skipped_++;
+        if (kind == 'L' || kind == 'M')
+            emit(address, false);
+        if (kind == 'S' || kind == 'M')
+            emit(address, true);
+        return true;
+    }
+
+    /*
+        Reads a hex number, after blanks and an optional 0x, ending at
+        the end of the line, a blank or a comma.
+    */
+    static bool parse_hex(char const *&p, char const *eol, uint64_t &value) {
+        while (p < eol && (*p == ' ' || *p == '\t'))
+            p++;
+        if (eol - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+            p += 2;
+        value = 0;
+        int digits = 0;
+        for (; p < eol; p++, digits++) {
+            char c = *p;
+            unsigned digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                break;
+            if (digits == 16)
+                return false;
+            value = value << 4 | digit;
+        }
+        return digits > 0 && (p == eol || *p == ' ' || *p == '\t' || *p == ',' || *p == '\r');
+    }
+
+    /*
+        Queues the batch being filled and waits for a free one.
+
+        @return The batch to fill next, or nullptr if reading stopped
+    */
+    TraceAccess *submit(size_t fill) {
+        std::unique_lock<std::mutex> guard(lock_);
+        counts_[head_ % batches_] = fill;
+        head_++;
+        changed_.notify_all();
+        changed_.wait(guard, [this] { return head_ - tail_ < batches_ || stopping_; });
+        if (stopping_)
+            return nullptr;
+        return &accesses_[(head_ % batches_) * batch_accesses_];
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    size_t batch_accesses_;
+    size_t batches_;
+    std::vector<TraceAccess> accesses_;
+    std::vector<size_t> counts_;
+    size_t head_;
+    size_t tail_;
+    bool done_;
+    bool stopping_;
+    unsigned long long skipped_;
+    std::string error_;
+    std::string filename_;
+    MappedFile file_;
+    std::mutex lock_;
+    std::condition_variable changed_;
+    std::thread thread_;
+};
+
+/*
+    Maps wide trace addresses into the 32-bit addresses CacheHierarchy
+    takes, without changing any hit or miss.
+
+    The address space is cut into regions of a size that every level's
+    rows * blocksize, and the page size if given, divides. Within a
+    region, addresses keep their offset, so they keep their row in every
+    level (and their page); each region in use gets the next free region
+    number, so addresses share a tag in a level exactly when they did
+    before. Only the number of distinct
+    regions a trace touches is limited, to 2 GB worth (folded addresses
+    stay below 2^31, so that tags never reach TagStore's markers).
+*/
+class AddressFolder {
+public:
+    /*
+        @param page A size every region must be a multiple of, so that
+            pages fold as a whole
+    */
+    explicit AddressFolder(std::vector<CacheLevelConfig> const &levels, uint64_t page = 1)
+            : region_size_(1), last_region_(~uint64_t(0)) {
+        std::vector<uint64_t> spans(1, page);
+        for (CacheLevelConfig const &level : levels)
+            spans.push_back((uint64_t)level.rows() * level.blocksize);
+        for (uint64_t span : spans) {
+            uint64_t a = region_size_, b = span;
+            while (b != 0) {
+                uint64_t t = a % b;
+                a = b;
+                b = t;
+            }
+            region_size_ = region_size_ / a * span;
+            if (region_size_ > FOLDED_LIMIT)
+                break;
+        }
+        max_regions_ = region_size_ > FOLDED_LIMIT ? 0 : FOLDED_LIMIT / region_size_;
+    }
+
+    /*
+        @param folded Receives the folded address
+        @return false if the address needs more regions than fit
+    */
+    bool fold(uint64_t address, unsigned &folded) {
+        uint64_t region = address / region_size_;
+        if (region != last_region_) {
+            auto it = regions_.find(region);
+            if (it == regions_.end()) {
+                if (regions_.size() == max_regions_)
+                    return false;
+                it = regions_.emplace(region, regions_.size()).first;
+            }
+            last_region_ = region;
+            last_base_ = it->second * region_size_;
+        }
+        folded = last_base_ + address % region_size_;
+        return true;
+    }
+
+private:
+    static constexpr uint64_t FOLDED_LIMIT = uint64_t(1) << 31;
+
+    uint64_t region_size_;
+    uint64_t max_regions_;
+    uint64_t last_region_;
+    uint64_t last_base_;
+    std::unordered_map<uint64_t, uint64_t> regions_;
+};
+
+#endif
@@ -0,0 +1,571 @@
+#ifndef E20_HIERARCHY_H
+#define E20_HIERARCHY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "E20_MissClass.h"
+#include "E20_Prefetch.h"
+#include "E20_TagStore.h"
+
+/*
+    A cache hierarchy of any depth (L1, L2, L3, ...), built from one
+    TagStore per level.
+
+    Loads look up L1 first and go one level further down on every
+    miss. Stores follow each level's WritePolicy; by default they are
+    written through to every level, allocating on misses. Dirty blocks
+    evicted from a write-back level are written into the next one. The
+    words moving across every level boundary are counted. How the
+    contents of the levels relate is set by the inclusion mode:
+
+    - Non-inclusive (the default): each level fills on its own misses
+      and evicts on its own, so a block may be in any set of levels.
+
+    - Inclusive: every block of a level is also in all levels below
+      it. When a level below L1 evicts a block, the block is
+      invalidated in every level above (back-invalidation).
+
+    - Exclusive: a block is in at most one level. A load or store that
+      hits below L1 moves the block up into L1; a block evicted from a
+      level moves down into the next one, and the last level's evictions
+      go back to memory. All levels must have the same block size and
+      be write-allocate.
+
+    The inclusion mode is a template parameter, like the replacement
+    policy, so the access path doesn't test the configuration.
+
+    Non-exclusive hierarchies can also prefetch, with a Prefetcher per
+    level (see E20_Prefetch.h). The prefetches a demand access asks for
+    are fetched once it is done, and each goes down the levels until
+    one holds the block, filling the levels that don't; a level with
+    stream buffers has its prefetches fetched from the level below.
+    Each level then also has a shadow TagStore that only sees its
+    demand accesses, to tell which misses prefetches caused.
+
+    Non-exclusive hierarchies can classify every miss as compulsory,
+    capacity or conflict too, with a MissClassifier per level (see
+    E20_MissClass.h) that sees every access of the level.
+*/
+
+enum Inclusion { NON_INCLUSIVE, INCLUSIVE, EXCLUSIVE };
+
+/*
+    The command-line names of the inclusion modes, in Inclusion order.
+*/
+char const static *const INCLUSION_NAMES[] = {"non-inclusive", "inclusive", "exclusive"};
+
+/*
+    @param name An inclusion mode name, as in INCLUSION_NAMES
+    @param inclusion Receives the mode
+    @return false if the name is unknown
+*/
+inline bool parse_inclusion(std::string const &name, Inclusion &inclusion) {
+    for (size_t i = 0; i < sizeof(INCLUSION_NAMES) / sizeof(INCLUSION_NAMES[0]); i++)
+        if (name == INCLUSION_NAMES[i]) {
+            inclusion = Inclusion(i);
+            return true;
+        }
+    return false;
+}
+
+/*
+    What happened at one level for one access, as reported to the
+    on_event callbacks of CacheHierarchy. EVENT_WB is a dirty block
+    written back into the level from the one above, and EVENT_PREFETCH
+    a block a prefetch brought into the level.
+*/
+enum CacheEvent { EVENT_HIT, EVENT_MISS, EVENT_SW, EVENT_WB, EVENT_PREFETCH };
+
+/*
+    How one level handles stores. Write-through passes every store on
+    to the next level; write-back only marks the block dirty and writes
+    it to the next level when it is evicted. Write-allocate brings the
+    block in on a store miss; no-write-allocate leaves the level alone.
+*/
+struct WritePolicy {
+    bool write_back;
+    bool write_allocate;
+};
+
+/*
+    The command-line names of the write policies, indexed by
+    write_back * 2 + !write_allocate.
+*/
+char const static *const WRITE_POLICY_NAMES[] = {"wt-wa", "wt-nwa", "wb-wa", "wb-nwa"};
+
+/*
+    Parses a --write-policy argument: one write policy name per level,
+    comma-separated, or a single name for every level.
+
+    @param text The argument
+    @param depth Number of levels
+    @param policies Receives one policy per level
+    @return false if the text is malformed or has the wrong length
+*/
+inline bool parse_write_policies(std::string const &text, size_t depth, std::vector<WritePolicy> &policies) {
+    policies.clear();
+    size_t start = 0;
+    while (true) {
+        size_t comma = text.find(',', start);
+        std::string name = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t i = 0;
+        while (i < 4 && name != WRITE_POLICY_NAMES[i])
+            i++;
+        if (i == 4)
+            return false;
+        policies.push_back(WritePolicy{i >= 2, i % 2 == 0});
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    if (policies.size() == 1)
+        policies.resize(depth, policies[0]);
+    return policies.size() == depth;
+}
+
+/*
+    Words moved across the boundary below one level: read up into the
+    level from the one below (or memory), and written down from it.
+*/
+struct LevelTraffic {
+    unsigned long long words_read = 0;
+    unsigned long long words_written = 0;
+};
+
+/*
+    The geometry of one cache level, as given on the command line.
+*/
+struct CacheLevelConfig {
+    int size;
+    int assoc;
+    int blocksize;
+
+    int rows() const { return size / (assoc * blocksize); }
+
+    bool valid() const {
+        return assoc >= 1 && assoc <= TagStore<LruPolicy>::MAX_ASSOC && blocksize >= 1 && size / assoc / blocksize >= 1;
+    }
+};
+
+/*
+    Parses a --cache argument: size,associativity,blocksize for each
+    level, L1 first.
+
+    @param text The argument
+    @param levels Receives one config per level
+    @return false if the text is malformed or a level is invalid
+*/
+inline bool parse_cache_levels(std::string const &text, std::vector<CacheLevelConfig> &levels) {
+    std::vector<int> parts;
+    size_t start = 0;
+    while (true) {
+        size_t comma = text.find(',', start);
+        std::string part = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        char *end;
+        long value = strtol(part.c_str(), &end, 10);
+        if (part.empty() || *end != '\0' || value < 0 || value > INT32_MAX)
+            return false;
+        parts.push_back(value);
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    if (parts.empty() || parts.size() % 3 != 0)
+        return false;
+    levels.clear();
+    for (size_t i = 0; i < parts.size(); i += 3) {
+        CacheLevelConfig level = {parts[i], parts[i+1], parts[i+2]};
+        if (!level.valid())
+            return false;
+        levels.push_back(level);
+    }
+    return true;
+}
+
+/*
+    The hierarchy described at the top of this file.
+*/
+template <typename Policy, Inclusion Mode>
+class CacheHierarchy {
+public:
+    typedef typename TagStore<Policy>::Eviction Eviction;
+
+    /*
+        @param configs One config per level, L1 first, all valid
+        @param seed Seed for policies that make random choices
+        @param write One write policy per level; empty for
+            write-through/write-allocate everywhere
+        @param prefetch One prefetcher config per level; empty for no
+            prefetching. Not for exclusive hierarchies
+        @param classify Whether to classify misses (see miss_class).
+            Not for exclusive hierarchies
+    */
+    CacheHierarchy(std::vector<CacheLevelConfig> const &configs, uint32_t seed,
+                   std::vector<WritePolicy> const &write = std::vector<WritePolicy>(),
+                   std::vector<PrefetchConfig> const &prefetch = std::vector<PrefetchConfig>(),
+                   bool classify = false)
+            : write_(write), traffic_(configs.size()), now_(0) {
+        for (CacheLevelConfig const &c : configs)
+            levels_.emplace_back(c.rows(), c.assoc, c.blocksize, seed);
+        write_.resize(configs.size(), WritePolicy{false, true});
+        for (size_t i = 0; i < prefetch.size(); i++) {
+            prefetchers_.emplace_back(prefetch[i], configs[i].blocksize);
+            shadows_.emplace_back(configs[i].rows(), configs[i].assoc, configs[i].blocksize, seed);
+        }
+        if (classify)
+            for (CacheLevelConfig const &c : configs)
+                classifiers_.emplace_back((size_t)c.rows() * c.assoc, c.blocksize);
+        classes_.resize(configs.size(), MISS_COMPULSORY);
+    }
+
+    size_t depth() const { return levels_.size(); }
+    TagStore<Policy> const &level(size_t i) const { return levels_[i]; }
+
+    Prefetcher const &prefetcher(size_t i) const { return prefetchers_[i]; }
+
+    /*
+        @return The class of the last access of level i, when it missed;
+            during on_event for the EVENT_MISS of that level, the class
+            of that miss
+    */
+    MissClass miss_class(size_t i) const { return classes_[i]; }
+
+    /*
+        @return The words moved across the boundary below level i
+    */
+    LevelTraffic const &traffic(size_t i) const { return traffic_[i]; }
+
+    /*
+        Saves or restores every level and the traffic counters, for
+        checkpoints (see E20_Checkpoint.h).
+    */
+    template <typename Archive>
+    void transfer(Archive &a) {
+        for (TagStore<Policy> &level : levels_)
+            level.transfer(a);
+        for (LevelTraffic &t : traffic_) {
+            a(t.words_read);
+            a(t.words_written);
+        }
+    }
+
+    /*
+        Simulates a lw.
+
+        @param address The memory address being accessed
+        @param on_event Called as on_event(level, event, row, address)
+            for every level the load reaches, L1 (level 0) first, and
+            for every writeback and prefetch it causes
+        @param pc The pc of the lw, for prefetchers
+    */
+    template <typename OnEvent>
+    void load(unsigned address, OnEvent &&on_event, unsigned pc = 0) {
+        now_++;
+        if (Mode == EXCLUSIVE)
+            access_exclusive(address, false, on_event);
+        else
+            read_from(0, address, false, on_event, pc);
+        if (!pending_.empty())
+            issue_prefetches(on_event);
+    }
+
+    /*
+        Simulates a sw.
+
+        @param address The memory address being accessed
+        @param on_event Called as on_event(level, event, row, address)
+            with EVENT_SW for every level the store reaches, L1 (level
+            0) first, EVENT_WB for every writeback and EVENT_PREFETCH
+            for every prefetch it causes
+        @param pc The pc of the sw, for prefetchers
+    */
+    template <typename OnEvent>
+    void store(unsigned address, OnEvent &&on_event, unsigned pc = 0) {
+        now_++;
+        if (Mode == EXCLUSIVE) {
+            access_exclusive(address, true, on_event);
+            return;
+        }
+        write_to(address, on_event, pc);
+        if (!pending_.empty())
+            issue_prefetches(on_event);
+    }
+
+private:
+    /*
+        A block a prefetcher asked for, to fetch once the demand access
+        that caused it is done.
+    */
+    struct PendingPrefetch {
+        size_t level;
+        unsigned address;
+    };
+
+    /*
+        Writes a store into the levels, as each one's WritePolicy says.
+    */
+    template <typename OnEvent>
+    void write_to(unsigned address, OnEvent &on_event, unsigned pc) {
+        for (size_t i = 0; i < levels_.size(); i++) {
+            WritePolicy const &wp = write_[i];
+            int row;
+            Eviction evicted;
+            bool hit = demand_level(i, pc, address, row, evicted, wp.write_allocate, wp.write_back);
+            on_event(i, EVENT_SW, row, address);
+            if (evicted.dirty)
+                write_back(i, evicted.address, levels_[i].blocksize(), on_event);
+            if (!hit && wp.write_allocate)
+                traffic_[i].words_read += levels_[i].blocksize();
+            if (wp.write_back && (hit || wp.write_allocate)) {
+                // The write stops here; a write-allocate miss still
+                // fetches the rest of the block from below.
+                if (!hit)
+                    read_from(i + 1, address, true, on_event, pc);
+                return;
+            }
+            traffic_[i].words_written++;
+        }
+    }
+
+    /*
+        Reads the block holding address into levels first and below,
+        going down one level on every miss.
+    */
+    template <typename OnEvent>
+    void read_from(size_t first, unsigned address, bool is_store, OnEvent &on_event, unsigned pc) {
+        for (size_t i = first; i < levels_.size(); i++) {
+            int row;
+            Eviction evicted;
+            bool hit = demand_level(i, pc, address, row, evicted, true, false);
+            on_event(i, is_store ? EVENT_SW : hit ? EVENT_HIT : EVENT_MISS, row, address);
+            if (evicted.dirty)
+                write_back(i, evicted.address, levels_[i].blocksize(), on_event);
+            if (hit)
+                break;
+            traffic_[i].words_read += levels_[i].blocksize();
+        }
+    }
+
+    /*
+        Writes words dirty words starting at address from level i down
+        to level i+1, or to memory below the last level.
+    */
+    template <typename OnEvent>
+    void write_back(size_t i, unsigned address, unsigned words, OnEvent &on_event) {
+        traffic_[i].words_written += words;
+        size_t below = i + 1;
+        if (below == levels_.size())
+            return;
+        WritePolicy const &wp = write_[below];
+        int row;
+        Eviction evicted;
+        bool hit = access_level(below, address, row, evicted, wp.write_back && wp.write_allocate, wp.write_back);
+        on_event(below, EVENT_WB, row, address);
+        if (evicted.dirty)
+            write_back(below, evicted.address, levels_[below].blocksize(), on_event);
+        if (!wp.write_back || !(hit || wp.write_allocate))
+            write_back(below, address, words, on_event);
+    }
+
+    /*
+        Prefetches the blocks the last demand access asked for. Every
+        prefetch goes into the level that asked for it, unless it holds
+        the block already, or into the level below for stream buffers.
+    */
+    template <typename OnEvent>
+    void issue_prefetches(OnEvent &on_event) {
+        for (PendingPrefetch const &p : pending_) {
+            int row;
+            if (prefetchers_[p.level].buffered()) {
+                traffic_[p.level].words_read += levels_[p.level].blocksize();
+                prefetch_from(p.level + 1, p.address, on_event);
+            }
+            else if (!levels_[p.level].contains(p.address, row))
+                prefetch_from(p.level, p.address, on_event);
+        }
+        pending_.clear();
+    }
+
+    /*
+        Brings the block holding address into levels first and below,
+        tagged as prefetched, going down one level on every miss.
+    */
+    template <typename OnEvent>
+    void prefetch_from(size_t first, unsigned address, OnEvent &on_event) {
+        for (size_t i = first; i < levels_.size(); i++) {
+            int row;
+            Eviction evicted;
+            if (access_level(i, address, row, evicted, true, false, true))
+                break;
+            on_event(i, EVENT_PREFETCH, row, address);
+            prefetchers_[i].filled(address, now_);
+            if (evicted.dirty)
+                write_back(i, evicted.address, levels_[i].blocksize(), on_event);
+            traffic_[i].words_read += levels_[i].blocksize();
+        }
+    }
+
+    /*
+        Accesses one level for a demand access, letting its prefetcher
+        see it and queue prefetches. A block taken from the level's
+        stream buffers counts as a hit.
+
+        @return true on a hit
+    */
+    bool demand_level(size_t i, unsigned pc, unsigned address, int &row, Eviction &evicted, bool allocate, bool dirty) {
+        if (prefetchers_.empty())
+            return access_level(i, address, row, evicted, allocate, dirty);
+        bool first_use = false;
+        bool hit = access_level(i, address, row, evicted, allocate, dirty, false, &first_use);
+        int shadow_row;
+        Eviction shadow_evicted;
+        bool shadow_hit = shadows_[i].access(address, shadow_row, shadow_evicted, allocate);
+        return prefetchers_[i].demand(pc, address, hit, shadow_hit, allocate, first_use, now_, [&](unsigned block) {
+            pending_.push_back(PendingPrefetch{i, block});
+        });
+    }
+
+    /*
+        Accesses one level. When inclusive, its eviction is also
+        invalidated in every level above, and counts as dirty if any of
+        those copies was.
+
+        @param prefetch Whether the access is a prefetch
+        @param first_use See TagStore::access
+        @return true on a hit
+    */
+    bool access_level(size_t i, unsigned address, int &row, Eviction &evicted, bool allocate, bool dirty,
+                      bool prefetch = false, bool *first_use = nullptr) {
+        bool hit = levels_[i].access(address, row, evicted, allocate, dirty, prefetch, first_use);
+        if (!classifiers_.empty())
+            classes_[i] = classifiers_[i].access(address, allocate);
+        if (evicted.prefetched)
+            prefetchers_[i].evicted_unused(evicted.address);
+        if (Mode == INCLUSIVE && evicted.address >= 0 && i > 0) {
+            unsigned first = evicted.address;
+            unsigned end = first + levels_[i].blocksize();
+            for (size_t above = 0; above < i; above++)
+                for (unsigned a = first; a < end; a += levels_[above].blocksize()) {
+                    bool was_dirty;
+                    levels_[above].invalidate(a, &was_dirty);
+                    evicted.dirty |= was_dirty;
+                }
+        }
+        return hit;
+    }
+
+    /*
+        Finds the block in the first level holding it, moves it into
+        L1 and pushes the evicted blocks down one level each. Every
+        level has the same block size, and only L1's write policy
+        matters since stores never reach the other levels.
+    */
+    template <typename OnEvent>
+    void access_exclusive(unsigned address, bool is_store, OnEvent &on_event) {
+        size_t found = levels_.size();
+        for (size_t i = 0; i < levels_.size(); i++) {
+            int row;
+            bool hit = levels_[i].contains(address, row);
+            on_event(i, is_store ? EVENT_SW : hit ? EVENT_HIT : EVENT_MISS, row, address);
+            if (hit) {
+                found = i;
+                break;
+            }
+        }
+        unsigned blocksize = levels_[0].blocksize();
+        for (size_t i = 0; i < found; i++)
+            traffic_[i].words_read += blocksize;
+
+        bool dirty = false;
+        if (found > 0 && found < levels_.size())
+            levels_[found].invalidate(address, &dirty);
+        if (is_store) {
+            if (write_[0].write_back)
+                dirty = true;
+            else
+                for (LevelTraffic &t : traffic_)
+                    t.words_written++;
+        }
+
+        // A demand access, so the block isn't an unused prefetch
+        Eviction moving = {(long)address, dirty, false};
+        for (size_t i = 0; i < levels_.size() && moving.address >= 0; i++) {
+            int row;
+            Eviction evicted;
+            levels_[i].access(moving.address, row, evicted, true, moving.dirty);
+            // Victims always move down a level, but only dirty ones are
+            // written back to memory
+            if (evicted.address >= 0 && (i + 1 < levels_.size() || evicted.dirty))
+                traffic_[i].words_written += blocksize;
+            moving = evicted;
+        }
+    }
+
+    std::vector<TagStore<Policy>> levels_;
+    std::vector<WritePolicy> write_;
+    std::vector<LevelTraffic> traffic_;
+    // One each per level when prefetching, otherwise none.
+    std::vector<Prefetcher> prefetchers_;
+    std::vector<TagStore<Policy>> shadows_;
+    std::vector<PendingPrefetch> pending_;
+    // One per level when classifying misses, otherwise none, and the
+    // class of each level's last access.
+    std::vector<MissClassifier> classifiers_;
+    std::vector<MissClass> classes_;
+    // Demand accesses so far, the clock of prefetch timeliness.
+    unsigned long long now_;
+};
+
+/*
+    Names an inclusion mode for with_inclusion.
+*/
+template <Inclusion Mode>
+struct InclusionTag {
+    static constexpr Inclusion value = Mode;
+};
+
+/*
+    Calls f with the InclusionTag of inclusion, so that f (usually a
+    generic lambda) is instantiated once per mode.
+
+    @return What f returns
+*/
+template <typename F>
+auto with_inclusion(Inclusion inclusion, F &&f) -> decltype(f(InclusionTag<NON_INCLUSIVE>())) {
+    switch (inclusion) {
+    case INCLUSIVE: return f(InclusionTag<INCLUSIVE>());
+    case EXCLUSIVE: return f(InclusionTag<EXCLUSIVE>());
+    case NON_INCLUSIVE:
+    default:        return f(InclusionTag<NON_INCLUSIVE>());
+    }
+}
+
+/*
+    Names a CacheHierarchy type for with_cache_hierarchy.
+*/
+template <typename Policy, Inclusion Mode>
+struct HierarchyTag {
+    typedef CacheHierarchy<Policy, Mode> type;
+};
+
+/*
+    Calls f with the HierarchyTag of a replacement policy and inclusion
+    mode, so that f is instantiated once per combination.
+
+    @return What f returns
+*/
+template <typename F>
+auto with_cache_hierarchy(ReplacementPolicy policy, Inclusion inclusion, F &&f)
+        -> decltype(f(HierarchyTag<LruPolicy, NON_INCLUSIVE>())) {
+    return with_replacement_policy(policy, [&](auto policy_tag) {
+        return with_inclusion(inclusion, [&](auto inclusion_tag) {
+            typedef typename decltype(policy_tag)::type Policy;
+            return f(HierarchyTag<Policy, decltype(inclusion_tag)::value>());
+        });
+    });
+}
+
+#endif
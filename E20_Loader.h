@@ -0,0 +1,379 @@
+#ifndef E20_LOADER_H
+#define E20_LOADER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define E20_LOADER_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+    Loading of E20 programs, shared by E20_Processor and E20_Cache.
+
+    Two file formats are accepted:
+
+    - The text machine code format produced by the assembler, one
+      `ram[N] = 16'b...;` line per word, addresses starting at 0 and
+      in sequence.
+
+    - A binary image: a 16-byte header followed by the words, all
+      little-endian.
+
+          offset  size  field
+               0     4  magic "E20I"
+               4     2  format version (E20_IMAGE_VERSION)
+               6     2  reserved, 0
+               8     4  number of words that follow
+              12     4  FNV-1a checksum of the word bytes
+
+    load_program tells the two apart by the magic, so an image can be
+    passed anywhere a .bin file is expected. Assembly source is read by
+    E20_Assembler.h.
+*/
+
+/*
+    Thrown when a program can't be opened or parsed. what() is the
+    message the simulators print before exiting with status 1.
+*/
+class LoadError : public std::runtime_error {
+public:
+    explicit LoadError(std::string const &message) : std::runtime_error(message) {}
+};
+
+char const static E20_IMAGE_MAGIC[4] = {'E', '2', '0', 'I'};
+unsigned const static E20_IMAGE_VERSION = 1;
+size_t const static E20_IMAGE_HEADER_SIZE = 16;
+
+/*
+    A read-only view of a whole file. Uses mmap where available and
+    falls back to reading the file into a buffer.
+*/
+class MappedFile {
+public:
+    MappedFile() : data_(nullptr), size_(0), mapped_(false) {}
+    ~MappedFile() { close(); }
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    /*
+        @param filename The file to open
+        @return false if the file can't be opened
+    */
+    bool open(char const *filename) {
+        close();
+#ifdef E20_LOADER_MMAP
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<char const *>(p);
+                mapped_ = true;
+            }
+        }
+        ::close(fd);
+        if (mapped_ || size_ == 0)
+            return true;
+#endif
+        std::ifstream f(filename, std::ios::binary);
+        if (!f.is_open())
+            return false;
+        buffer_.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        return true;
+    }
+
+    void close() {
+#ifdef E20_LOADER_MMAP
+        if (mapped_)
+            munmap(const_cast<char *>(data_), size_);
+#endif
+        buffer_.clear();
+        data_ = nullptr;
+        size_ = 0;
+        mapped_ = false;
+    }
+
+    char const *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    char const *data_;
+    size_t size_;
+    bool mapped_;
+    std::vector<char> buffer_;
+};
+
+inline uint32_t e20_fnv1a(unsigned char const *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+inline uint32_t e20_read32(char const *p) {
+    unsigned char const *u = reinterpret_cast<unsigned char const *>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+inline void e20_write32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/*
+    Checks whether a buffer starts with the binary image magic.
+*/
+inline bool is_program_image(char const *data, size_t size) {
+    return size >= sizeof(E20_IMAGE_MAGIC) && memcmp(data, E20_IMAGE_MAGIC, sizeof(E20_IMAGE_MAGIC)) == 0;
+}
+
+/*
+    Parses E20 text machine code into mem. Each line must look like
+    `ram[N] = 16'b<binary>;` optionally followed by anything (usually
+    a comment). Errors are thrown as LoadError.
+
+    @param data The file contents
+    @param size The length of data in bytes
+    @param mem Array representing memory into which to read program
+    @param mem_size Number of words in mem
+    @return The number of words loaded
+*/
+inline size_t parse_machine_code(char const *data, size_t size, unsigned short mem[], size_t mem_size) {
+    char const *p = data;
+    char const *end = data + size;
+    size_t expectedaddr = 0;
+    while (p < end) {
+        char const *line = p;
+        char const *eol = static_cast<char const *>(memchr(p, '\n', end - p));
+        if (eol == nullptr)
+            eol = end;
+        p = eol + 1;
+
+        char const *q = line;
+        bool ok = eol - q > 4 && memcmp(q, "ram[", 4) == 0;
+        size_t addr = 0;
+        unsigned instr = 0;
+        if (ok) {
+            q += 4;
+            char const *digits = q;
+            while (q < eol && *q >= '0' && *q <= '9') {
+                if (addr < 100000000)
+                    addr = addr * 10 + (*q - '0');
+                q++;
+            }
+            ok = q > digits && eol - q > 8 && memcmp(q, "] = 16'b", 8) == 0;
+        }
+        if (ok) {
+            q += 8;
+            char const *digits = q;
+            while (q < eol && (*q == '0' || *q == '1')) {
+                instr = (instr << 1 | (*q - '0')) & 0xffff;
+                q++;
+            }
+            ok = q > digits && q < eol && *q == ';';
+        }
+        if (!ok) {
+            std::string text(line, eol);
+            if (!text.empty() && text.back() == '\r')
+                text.pop_back();
+            throw LoadError("Can't parse line: " + text);
+        }
+        if (addr != expectedaddr)
+            throw LoadError("Memory addresses encountered out of sequence: " + std::to_string(addr));
+        if (addr >= mem_size)
+            throw LoadError("Program too big for memory");
+        expectedaddr ++;
+        mem[addr] = instr;
+    }
+    return expectedaddr;
+}
+
+/*
+    Copies a binary program image into mem after validating its
+    header and checksum. Errors are thrown as LoadError.
+
+    @param data The file contents
+    @param size The length of data in bytes
+    @param mem Array representing memory into which to read program
+    @param mem_size Number of words in mem
+    @return The number of words loaded
+*/
+inline size_t load_program_image(char const *data, size_t size, unsigned short mem[], size_t mem_size) {
+    if (size < E20_IMAGE_HEADER_SIZE || (e20_read32(data + 4) & 0xffff) != E20_IMAGE_VERSION)
+        throw LoadError("Unsupported program image");
+    size_t count = e20_read32(data + 8);
+    if (count > mem_size)
+        throw LoadError("Program too big for memory");
+    unsigned char const *words = reinterpret_cast<unsigned char const *>(data + E20_IMAGE_HEADER_SIZE);
+    if (size - E20_IMAGE_HEADER_SIZE != count * 2 || e20_fnv1a(words, count * 2) != e20_read32(data + 12))
+        throw LoadError("Program image is corrupt");
+    for (size_t i = 0; i < count; i++)
+        mem[i] = words[2*i] | (words[2*i+1] << 8);
+    return count;
+}
+
+/*
+    Writes a file under a temporary name and renames it into place, so
+    that concurrent runs never see it half-written. The temporary name
+    is unique to this process and call, so that runs writing the same
+    file at once (e.g. --batch jobs) don't clobber each other's.
+
+    @param filename The file to create
+    @param bytes The contents
+    @return false if the file can't be written
+*/
+inline bool e20_write_file(std::string const &filename, std::vector<unsigned char> const &bytes) {
+    static std::atomic<unsigned long> serial(0);
+#ifdef E20_LOADER_MMAP
+    long pid = getpid();
+#else
+    long pid = 0;
+#endif
+    std::string tmp = filename + ".tmp." + std::to_string(pid) + "." + std::to_string(serial++);
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f.is_open())
+        return false;
+    f.write(reinterpret_cast<char const *>(bytes.data()), bytes.size());
+    f.close();
+    if (!f || rename(tmp.c_str(), filename.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+    Writes the first count words of mem as a binary program image.
+
+    @param filename The file to create
+    @param mem Memory holding the program
+    @param count Number of words to write
+    @return false if the file can't be written
+*/
+inline bool write_program_image(std::string const &filename, unsigned short const mem[], size_t count) {
+    std::vector<unsigned char> bytes(E20_IMAGE_HEADER_SIZE + count * 2);
+    memcpy(bytes.data(), E20_IMAGE_MAGIC, sizeof(E20_IMAGE_MAGIC));
+    e20_write32(bytes.data() + 4, E20_IMAGE_VERSION);
+    e20_write32(bytes.data() + 8, count);
+    unsigned char *words = bytes.data() + E20_IMAGE_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        words[2*i] = mem[i];
+        words[2*i+1] = mem[i] >> 8;
+    }
+    e20_write32(bytes.data() + 12, e20_fnv1a(words, count * 2));
+    return e20_write_file(filename, bytes);
+}
+
+/*
+    Writes the first count words of mem as text machine code, in the
+    format parse_machine_code reads.
+
+    @param filename The file to create
+    @param mem Memory holding the program
+    @param count Number of words to write
+    @param comments If not empty, the text to end each word's line
+        with, as a // comment (usually the source of the word)
+    @return false if the file can't be written
+*/
+inline bool write_machine_code(std::string const &filename, unsigned short const mem[], size_t count,
+                               std::vector<std::string> const &comments = std::vector<std::string>()) {
+    std::string text;
+    for (size_t i = 0; i < count; i++) {
+        text += "ram[" + std::to_string(i) + "] = 16'b";
+        for (int bit = 15; bit >= 0; bit--)
+            text.push_back('0' + (mem[i] >> bit & 1));
+        text.push_back(';');
+        if (i < comments.size())
+            text += "\t\t// " + comments[i];
+        text.push_back('\n');
+    }
+    std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+    if (!f.is_open())
+        return false;
+    f.write(text.data(), text.size());
+    f.close();
+    return bool(f);
+}
+
+/*
+    @return The name of the image --image-cache keeps for a text program
+*/
+inline std::string program_image_name(std::string const &filename) {
+    return filename + ".img";
+}
+
+/*
+    Loads an E20 program, either text machine code or a binary image,
+    into mem. Errors are thrown as LoadError.
+
+    With use_image_cache, a text program is loaded from the image
+    `<filename>.img` when that image is newer than the text file, and
+    the image is (re)written after parsing otherwise. An image that
+    fails validation (truncated, bad checksum, older format) is ignored
+    and rebuilt from the text file. Failing to write the image doesn't
+    fail the load, but is reported to the caller.
+
+    @param filename The program file
+    @param mem Array representing memory into which to read program
+    @param mem_size Number of words in mem
+    @param use_image_cache Whether to use and maintain `<filename>.img`
+    @return false if the image should have been written but couldn't be
+*/
+inline bool load_program(char const *filename, unsigned short mem[], size_t mem_size, bool use_image_cache = false) {
+    MappedFile file;
+    if (!file.open(filename))
+        throw LoadError(std::string("Can't open file ") + filename);
+    if (is_program_image(file.data(), file.size())) {
+        load_program_image(file.data(), file.size(), mem, mem_size);
+        return true;
+    }
+
+    std::string image_name = program_image_name(filename);
+#ifdef E20_LOADER_MMAP
+    if (use_image_cache) {
+        struct stat src, img;
+        MappedFile image;
+        if (stat(filename, &src) == 0 && stat(image_name.c_str(), &img) == 0 &&
+                img.st_mtime > src.st_mtime && image.open(image_name.c_str()) &&
+                is_program_image(image.data(), image.size())) {
+            try {
+                load_program_image(image.data(), image.size(), mem, mem_size);
+                return true;
+            } catch (LoadError const &) {
+                // load_program_image validates before touching mem, so
+                // just fall through and rebuild the image
+            }
+        }
+    }
+#endif
+    size_t count = parse_machine_code(file.data(), file.size(), mem, mem_size);
+    return !use_image_cache || write_program_image(image_name, mem, count);
+}
+
+#endif
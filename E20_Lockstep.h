@@ -0,0 +1,248 @@
+#ifndef E20_LOCKSTEP_H
+#define E20_LOCKSTEP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "E20_Checkpoint.h"
+#include "E20_Machine.h"
+
+/*
+    Lock-step execution of many E20 machines at once, for running one
+    program on many different memory images (E20_Processor --lockstep).
+
+    The machines are the lanes of vectors of 16-bit words, one vector
+    per register, for the pcs and for every memory address (structure
+    of arrays). All of E20 is 16 bits wide, so one vector instruction
+    does the work of an instruction in every machine. The vectors use
+    the compiler's generic vector extension and are as wide as the
+    target's registers: 16 lanes with AVX2 or AVX-512, 8 with SSE2.
+
+    Each step executes one instruction for a group of lanes: those at
+    the lowest pc of all running lanes that hold the same instruction
+    word there. Other lanes are masked off. Lanes that branch apart
+    thus run separately, the ones behind first, and regroup once they
+    reach the same pc again; lanes whose code differs (self-modifying
+    programs) never share a step. Loads and stores gather and scatter
+    per lane, unless every lane of the group uses the same address.
+
+    Every lane ends in exactly the state a scalar run of its image
+    reaches, with the same instruction count.
+*/
+class Lockstep {
+public:
+#if defined(__AVX2__)
+    static constexpr size_t LANES = 16;
+#else
+    static constexpr size_t LANES = 8;
+#endif
+
+    Lockstep() : memory_(MEM_SIZE * LANES, 0), decoded_(MEM_SIZE), counts_(LANES, 0) {
+        for (size_t i = 0; i < MEM_SIZE; i++)
+            decoded_[i].op = OP_UNDECODED;
+        for (size_t r = 0; r < NUM_REGS; r++)
+            regs_[r] = Lanes{};
+        pcs_ = Lanes{};
+        halted_ = ~Lanes{};
+        recent_ = Lanes{};
+    }
+
+    /*
+        Puts a machine's state into a lane; lanes that get none stay
+        halted.
+
+        @param lane 0..LANES-1
+    */
+    void load(size_t lane, Machine const &machine) {
+        for (size_t i = 0; i < MEM_SIZE; i++)
+            memory_[i * LANES + lane] = machine.memory()[i];
+        for (size_t r = 0; r < NUM_REGS; r++)
+            regs_[r][lane] = machine.reg(r);
+        pcs_[lane] = machine.pc();
+        halted_[lane] = machine.halted() ? 0xffff : 0;
+        counts_[lane] = machine.instructions();
+    }
+
+    /*
+        Saves the state of a lane, e.g. to restore() a Machine from it.
+    */
+    void save(size_t lane, Checkpoint &checkpoint) const {
+        checkpoint.instructions = counts_[lane];
+        checkpoint.pc = pcs_[lane];
+        for (size_t r = 0; r < NUM_REGS; r++)
+            checkpoint.registers[r] = regs_[r][lane];
+        for (size_t i = 0; i < MEM_SIZE; i++)
+            checkpoint.memory[i] = memory_[i * LANES + lane];
+    }
+
+    bool halted(size_t lane) const { return halted_[lane] != 0; }
+    unsigned long long instructions(size_t lane) const { return counts_[lane]; }
+
+    /*
+        Runs until every lane has halted.
+
+        @return The number of steps, i.e. vector instructions, executed
+    */
+    unsigned long long run() {
+        unsigned long long steps = 0;
+        // Whether all running lanes are known to be at the leader's pc,
+        // which saves looking for the lowest one
+        bool together = false;
+        size_t leader = 0;
+        while (true) {
+            Lanes running = ~halted_;
+            if (!together) {
+                // The lowest pc of a running lane goes next
+                unsigned lowest = 0xffff;
+                for (size_t lane = 0; lane < LANES; lane++)
+                    if (running[lane] && pcs_[lane] < lowest) {
+                        lowest = pcs_[lane];
+                        leader = lane;
+                    }
+                if (lowest == 0xffff)
+                    break;
+            }
+            unsigned pc = pcs_[leader];
+            Lanes words = row(pc);
+            unsigned short word = words[leader];
+            Lanes mask = (Lanes)(pcs_ == (unsigned short)pc) & (Lanes)(words == word) & running;
+            DecodedInstr &d = decoded_[pc];
+            if (d.op == OP_UNDECODED || decoded_word_[pc] != word) {
+                d = decode_instruction(word, pc);
+                decoded_word_[pc] = word;
+            }
+            execute(d, pc, mask, leader);
+            together = none(mask ^ running) && d.op != OP_HALT &&
+                ((d.op != OP_JEQ && d.op != OP_JR) || none((Lanes)(pcs_ != pcs_[leader]) & mask));
+
+            // Count in 16 bits, and move the counts to counts_ before
+            // they can overflow
+            recent_ -= mask;
+            if (++steps % 0xffff == 0)
+                flush_counts();
+        }
+        flush_counts();
+        return steps;
+    }
+
+private:
+    typedef unsigned short Lanes __attribute__((vector_size(2 * LANES)));
+
+    static Lanes broadcast(unsigned short value) { return Lanes{} + value; }
+    static Lanes select(Lanes mask, Lanes yes, Lanes no) { return (yes & mask) | (no & ~mask); }
+
+    static bool none(Lanes v) {
+        uint64_t parts[sizeof(Lanes) / sizeof(uint64_t)];
+        memcpy(parts, &v, sizeof(v));
+        uint64_t any = 0;
+        for (size_t i = 0; i < sizeof(Lanes) / sizeof(uint64_t); i++)
+            any |= parts[i];
+        return any == 0;
+    }
+
+    void flush_counts() {
+        for (size_t lane = 0; lane < LANES; lane++)
+            counts_[lane] += recent_[lane];
+        recent_ = Lanes{};
+    }
+
+    Lanes row(unsigned address) const {
+        Lanes v;
+        memcpy(&v, &memory_[address * LANES], sizeof(v));
+        return v;
+    }
+
+    /*
+        Executes d, the instruction at pc, in the lanes of mask.
+
+        @param leader A lane in mask
+    */
+    void execute(DecodedInstr const &d, unsigned pc, Lanes mask, size_t leader) {
+        Lanes a = regs_[d.srcA];
+        Lanes b = regs_[d.srcB];
+        Lanes imm = broadcast(d.imm);
+        Lanes next = broadcast((pc + 1) % MEM_SIZE);
+        Lanes &dst = regs_[d.dst];
+        switch (d.op) {
+        case OP_UNDECODED:
+        case OP_NOP:
+            break;
+        case OP_ADD:
+            dst = select(mask, a + b, dst);
+            break;
+        case OP_SUB:
+            dst = select(mask, a - b, dst);
+            break;
+        case OP_OR:
+            dst = select(mask, a | b, dst);
+            break;
+        case OP_AND:
+            dst = select(mask, a & b, dst);
+            break;
+        case OP_SLT:
+            dst = select(mask, (Lanes)(a < b) & 1, dst);
+            break;
+        case OP_SLTI:
+            dst = select(mask, (Lanes)(a < imm) & 1, dst);
+            break;
+        case OP_ADDI:
+            dst = select(mask, a + imm, dst);
+            break;
+        case OP_LW:
+        case OP_SW: {
+            Lanes address = (a + imm) & (MEM_SIZE - 1);
+            unsigned shared = address[leader];
+            bool same = none((Lanes)(address != (unsigned short)shared) & mask);
+            unsigned short *cells = &memory_[0];
+            if (same && d.op == OP_LW) {
+                dst = select(mask, row(shared), dst);
+            } else if (same) {
+                Lanes stored = select(mask, b, row(shared));
+                memcpy(&cells[shared * LANES], &stored, sizeof(stored));
+            } else {
+                for (size_t lane = 0; lane < LANES; lane++)
+                    if (mask[lane]) {
+                        if (d.op == OP_LW)
+                            dst[lane] = cells[address[lane] * LANES + lane];
+                        else
+                            cells[address[lane] * LANES + lane] = b[lane];
+                    }
+            }
+            break;
+        }
+        case OP_JEQ:
+            pcs_ = select(mask, select((Lanes)(a == b), imm, next), pcs_);
+            return;
+        case OP_J:
+            pcs_ = select(mask, imm, pcs_);
+            return;
+        case OP_JAL:
+            regs_[7] = select(mask, broadcast(pc + 1), regs_[7]);
+            pcs_ = select(mask, imm, pcs_);
+            return;
+        case OP_JR:
+            pcs_ = select(mask, a & (MEM_SIZE - 1), pcs_);
+            return;
+        case OP_HALT:
+            halted_ |= mask;
+            return;
+        }
+        pcs_ = select(mask, next, pcs_);
+    }
+
+    // Word i of lane l is memory_[i * LANES + l].
+    std::vector<unsigned short> memory_;
+    // The decoded instruction at each pc, for the word in decoded_word_.
+    std::vector<DecodedInstr> decoded_;
+    unsigned short decoded_word_[MEM_SIZE];
+    std::vector<unsigned long long> counts_;
+    Lanes regs_[NUM_REGS];
+    Lanes pcs_;
+    // 0xffff in every lane that has halted or holds no machine.
+    Lanes halted_;
+    // Instructions executed since the last flush_counts().
+    Lanes recent_;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef E20_LOG_H
+#define E20_LOG_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Logging support shared by E20_Processor and E20_Cache: iostream-free
+    formatting helpers that reproduce the setw-based output formats, and
+    an asynchronous sink that moves formatting and writing off the
+    simulation thread.
+*/
+
+/*
+    Appends value in decimal, right-aligned in a field of width
+    characters padded with spaces (like setw(width) << value).
+*/
+inline void log_append_right(std::string &buf, unsigned long value, size_t width) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    if (n < width)
+        buf.append(width - n, ' ');
+    while (n > 0)
+        buf.push_back(digits[--n]);
+}
+
+/*
+    Appends value as four lowercase hex digits (like
+    hex << setfill('0') << setw(4) << value).
+*/
+inline void log_append_hex4(std::string &buf, unsigned short value) {
+    static char const hexdigits[] = "0123456789abcdef";
+    for (int shift = 12; shift >= 0; shift -= 4)
+        buf.push_back(hexdigits[(value >> shift) & 15]);
+}
+
+/*
+    A log sink that takes fixed-size binary records from one producer
+    thread and hands them to a background writer thread.
+
+    Records are collected into blocks of a preallocated ring. A full
+    block is passed to the writer, which formats the whole block and
+    writes it to the output stream, then returns the block to the ring.
+    The producer only waits when every block is still queued, i.e. when
+    the output can't keep up at all.
+
+    The stream must not be written to by anyone else between the first
+    push and close().
+*/
+template <typename Record>
+class AsyncLogSink {
+public:
+    /*
+        Writes count records to out. Called on the writer thread.
+    */
+    typedef std::function<void(Record const *records, size_t count, std::ostream &out)> Writer;
+
+    /*
+        @param out Where the writer writes
+        @param writer Formats and writes one block of records
+        @param block_records Number of records per block
+        @param blocks Number of blocks in the ring
+    */
+    AsyncLogSink(std::ostream &out, Writer writer, size_t block_records = 4096, size_t blocks = 8)
+            : out_(out), writer_(writer), block_records_(block_records), blocks_(blocks),
+              records_(block_records * blocks), counts_(blocks, 0), fill_(0), head_(0), tail_(0),
+              closing_(false), thread_(&AsyncLogSink::write_loop, this) {}
+
+    ~AsyncLogSink() { close(); }
+
+    AsyncLogSink(AsyncLogSink const &) = delete;
+    AsyncLogSink &operator=(AsyncLogSink const &) = delete;
+
+    void push(Record const &record) {
+        records_[(head_ % blocks_) * block_records_ + fill_++] = record;
+        if (fill_ == block_records_)
+            submit();
+    }
+
+    /*
+        Writes out everything pushed so far, stops the writer thread
+        and flushes the stream. Safe to call more than once.
+    */
+    void close() {
+        if (!thread_.joinable())
+            return;
+        if (fill_ > 0)
+            submit();
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            closing_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+        out_.flush();
+    }
+
+private:
+    /*
+        Queues the block being filled and waits for a free one.
+    */
+    void submit() {
+        std::unique_lock<std::mutex> guard(lock_);
+        counts_[head_ % blocks_] = fill_;
+        head_++;
+        fill_ = 0;
+        changed_.notify_all();
+        changed_.wait(guard, [this] { return head_ - tail_ < blocks_; });
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> guard(lock_);
+        while (true) {
+            changed_.wait(guard, [this] { return tail_ < head_ || closing_; });
+            if (tail_ == head_)
+                return;
+            size_t block = tail_ % blocks_;
+            guard.unlock();
+            writer_(&records_[block * block_records_], counts_[block], out_);
+            guard.lock();
+            tail_++;
+            changed_.notify_all();
+        }
+    }
+
+    std::ostream &out_;
+    Writer writer_;
+    size_t block_records_;
+    size_t blocks_;
+    std::vector<Record> records_;
+    std::vector<size_t> counts_;
+    // Records in the block being filled; only touched by the producer.
+    size_t fill_;
+    // Blocks submitted and blocks written, guarded by lock_.
+    size_t head_;
+    size_t tail_;
+    bool closing_;
+    std::mutex lock_;
+    std::condition_variable changed_;
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,1113 @@
+#ifndef E20_MACHINE_H
+#define E20_MACHINE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "E20_Assembler.h"
+#include "E20_Loader.h"
+#include "E20_Checkpoint.h"
+
+/*
+    The E20 machine (libe20): decoder, interpreter and machine state,
+    shared by E20_Processor and E20_Cache and meant to be embedded in
+    other programs too.
+
+    A Machine is loaded from a program file, a block of words or a
+    checkpoint, and then driven with step() or run(). Nothing here
+    prints or exits: load errors are thrown as LoadError, and whether
+    the program halted is part of the machine state. Observers are
+    template parameters, so a run without one costs nothing and a run
+    with one gets it inlined:
+
+        Machine machine;
+        machine.load("loop.bin");
+        machine.run(1000000, [&](unsigned pc, unsigned address, bool is_store) { ... });
+        if (machine.halted()) ...
+
+    A Machine is cheap to reload, so one object can run any number of
+    short simulations in a row.
+*/
+
+size_t const static NUM_REGS = 8;
+size_t const static MEM_SIZE = 1<<13;
+
+#if defined(__GNUC__)
+#define E20_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define E20_ALWAYS_INLINE inline
+#endif
+
+inline unsigned signExtender7B(unsigned imm){
+    if ((imm & 64) == 64){
+        return imm | 65408; 
+    }
+    return imm; 
+}
+
+/*
+    Operation kinds of a predecoded instruction. OP_UNDECODED marks
+    a memory word that has not been decoded yet, or whose decoded form
+    was invalidated by a store.
+*/
+enum DecodedOp : unsigned char {
+    OP_UNDECODED,
+    OP_NOP,
+    OP_ADD,
+    OP_SUB,
+    OP_OR,
+    OP_AND,
+    OP_SLT,
+    OP_JR,
+    OP_SLTI,
+    OP_LW,
+    OP_SW,
+    OP_JEQ,
+    OP_ADDI,
+    OP_J,
+    OP_JAL,
+    OP_HALT
+};
+
+/*
+    One predecoded memory word. Register fields and the sign-extended
+    immediate are resolved once, so the interpreter never looks at the
+    raw instruction bits again.
+
+    For jeq, imm holds the already-wrapped branch target; for j and jal
+    it holds the 13-bit jump target.
+*/
+struct DecodedInstr {
+    DecodedOp op;
+    unsigned char dst;
+    unsigned char srcA;
+    unsigned char srcB;
+    unsigned short imm;
+};
+
+/*
+    Decodes a single instruction word.
+
+    Instructions that can't change any state (writes to $0, unused
+    function codes) decode to OP_NOP. A j to its own address decodes to
+    OP_HALT.
+
+    @param instr The instruction word
+    @param addr The address the instruction was fetched from
+    @return The decoded form of instr
+*/
+inline DecodedInstr decode_instruction(unsigned short instr, unsigned short addr) {
+    DecodedInstr d = {OP_NOP, 0, 0, 0, 0};
+    unsigned short opcode = instr>>13;
+    d.srcA = instr>>10 & 7;
+    if (opcode == 0){
+        d.srcB = instr>>7 & 7;
+        d.dst = instr>>4 & 7;
+        unsigned short func = instr & 15;
+        if (func == 8)
+            d.op = OP_JR;
+        else if (d.dst != 0 && func <= 4){
+            static DecodedOp const alu_ops[] = {OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT};
+            d.op = alu_ops[func];
+        }
+        return d;
+    }
+    d.imm = signExtender7B(instr & 127);
+    if (opcode == 7){
+        d.dst = instr>>7 & 7;
+        if (d.dst != 0)
+            d.op = OP_SLTI;
+    }
+    else if (opcode == 4){
+        d.dst = instr>>7 & 7;
+        if (d.dst != 0)
+            d.op = OP_LW;
+    }
+    else if (opcode == 5){
+        d.srcB = instr>>7 & 7;
+        d.op = OP_SW;
+    }
+    else if (opcode == 6){
+        d.srcB = instr>>7 & 7;
+        d.imm = (addr + d.imm + 1) % MEM_SIZE;
+        d.op = OP_JEQ;
+    }
+    else if (opcode == 1){
+        d.dst = instr>>7 & 7;
+        if (d.dst != 0)
+            d.op = OP_ADDI;
+    }
+    else if (opcode == 2){
+        d.imm = instr & 8191;
+        d.op = d.imm == addr ? OP_HALT : OP_J;
+    }
+    else if (opcode == 3){
+        d.imm = instr & 8191;
+        d.op = OP_JAL;
+    }
+    return d;
+}
+
+/*
+    Executes one predecoded instruction and advances pc. A sw also
+    drops the decoded form of the word it overwrites. The caller
+    decodes OP_UNDECODED words before executing them.
+
+    Memory addresses use the low 13 bits of the computed address.
+
+    @param d The decoded instruction at pc
+    @param pc The program counter, updated in place
+    @param regs The registers
+    @param memory The memory
+    @param decoded The predecoded copy of memory
+    @return false if the instruction halts the machine, true otherwise
+*/
+E20_ALWAYS_INLINE bool execute_instruction(DecodedInstr const &d, unsigned &pc, unsigned short regs[], unsigned short memory[], DecodedInstr decoded[]) {
+    switch (d.op){
+    case OP_UNDECODED:
+    case OP_NOP:
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_ADD:
+        regs[d.dst] = regs[d.srcA] + regs[d.srcB];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_SUB:
+        regs[d.dst] = regs[d.srcA] - regs[d.srcB];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_OR:
+        regs[d.dst] = regs[d.srcA] | regs[d.srcB];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_AND:
+        regs[d.dst] = regs[d.srcA] & regs[d.srcB];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_SLT:
+        regs[d.dst] = regs[d.srcA] < regs[d.srcB];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_JR:
+        pc = regs[d.srcA] % MEM_SIZE;
+        break;
+    case OP_SLTI:
+        regs[d.dst] = regs[d.srcA] < d.imm;
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_LW:
+        regs[d.dst] = memory[(regs[d.srcA] + d.imm) % MEM_SIZE];
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_SW: {
+        unsigned short address = (regs[d.srcA] + d.imm) % MEM_SIZE;
+        memory[address] = regs[d.srcB];
+        decoded[address].op = OP_UNDECODED;
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    }
+    case OP_JEQ:
+        if (regs[d.srcA] == regs[d.srcB])
+            pc = d.imm;
+        else
+            pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_ADDI:
+        regs[d.dst] = regs[d.srcA] + d.imm;
+        pc = (pc + 1) % MEM_SIZE;
+        break;
+    case OP_J:
+        pc = d.imm;
+        break;
+    case OP_JAL:
+        regs[7] = pc + 1;
+        pc = d.imm;
+        break;
+    case OP_HALT:
+        return false;
+    }
+    return true;
+}
+
+/*
+    Checks whether an instruction, just executed, ran pc off either end
+    of memory: fell through the last word, took a jeq whose offset
+    crosses an end, or did a jr to an address past the end.
+    execute_instruction wraps pc around instead.
+
+    @param d The decoded instruction
+    @param op The operation of d when it executed (d.op may since have
+        been dropped by a sw to its own word)
+    @param at The address d was fetched from
+    @param regs The registers after d executed
+    @return Whether pc left memory
+*/
+E20_ALWAYS_INLINE bool left_memory(DecodedInstr const &d, DecodedOp op, unsigned at, unsigned short const regs[]) {
+    switch (op){
+    case OP_JR:
+        return regs[d.srcA] >= MEM_SIZE;
+    case OP_JEQ:
+        if (regs[d.srcA] == regs[d.srcB]) {
+            // d.imm is the wrapped target; the offset is -64 to 63
+            int offset = (int)d.imm - (int)(at + 1);
+            return offset < -64 || offset > 63;
+        }
+        return at == MEM_SIZE - 1;
+    case OP_J:
+    case OP_JAL:
+    case OP_HALT:
+        return false;
+    default:
+        return at == MEM_SIZE - 1;
+    }
+}
+
+/*
+    Fast-forwards counted loops that only touch registers.
+
+    A candidate loop is a straight-line body from head to a `j head`,
+    holding exactly one jeq that leaves the loop and otherwise only
+    add, sub, or, and, slt, slti, addi and nops. One symbolic pass over
+    the body expresses every register, at the jeq and at the end of the
+    body, as a linear form (constant plus multiples of the registers'
+    values at the head) where it can. That classifies the registers
+    the body writes:
+
+    - induction: gains a constant every iteration (addi $1, $1, 1)
+    - accumulator: gains a linear form of induction and unchanged
+      registers (add $3, $3, $2), so its value is quadratic in the
+      iteration count
+    - temporary: written before it is read in the body, so every
+      iteration recomputes it from scratch
+
+    Anything else (e.g. a register that feeds into itself through or)
+    makes the loop unskippable. The exit jeq must compare two linear
+    forms, or the result of an slt/slti with one side fixed against a
+    fixed value, over induction and unchanged registers. Then its
+    operands are affine in the iteration number k, modulo 2^16, and the
+    first exiting iteration follows in closed form.
+
+    skip() moves the registers forward over whole iterations, but
+    always leaves the last complete iteration before the exit, and one
+    complete iteration within the instruction limit, to the
+    interpreter. That iteration recomputes the temporaries, so the
+    state afterwards is exactly what step-by-step execution leaves.
+*/
+class LoopSkipper {
+public:
+    LoopSkipper() : index_(MEM_SIZE, -1), skipped_(0) {}
+
+    /*
+        Called right after the j at jump_pc went back to head.
+
+        @param regs The registers, at the start of an iteration
+        @param memory The memory holding the loop
+        @param budget The most instructions that may be skipped
+        @return The number of instructions skipped, 0 if none
+    */
+    unsigned long long skip(unsigned head, unsigned jump_pc, unsigned short regs[], unsigned short const memory[],
+                            unsigned long long budget) {
+        Loop const &loop = loop_at(head, jump_pc, memory);
+        if (!loop.skippable)
+            return 0;
+        unsigned long long length = jump_pc - head + 1;
+        unsigned long long exit = first_exit(loop, regs);
+        if (exit == NEVER || exit < 2 || budget / length < 2)
+            return 0;
+        unsigned long long iterations = std::min(exit - 1, budget / length - 1);
+
+        unsigned short start[NUM_REGS];
+        std::copy(regs, regs + NUM_REGS, start);
+        // iterations * (iterations - 1) / 2, without overflowing
+        unsigned long long triangle = iterations % 2 ? iterations * ((iterations - 1) / 2)
+                                                     : iterations / 2 * (iterations - 1);
+        for (Update const &u : loop.updates) {
+            unsigned long long linear = u.step;
+            unsigned long long quadratic = 0;
+            for (unsigned j = 1; j < NUM_REGS; j++) {
+                linear += (unsigned long long)u.form.coef[j] * start[j];
+                quadratic += (unsigned long long)u.form.coef[j] * loop.step[j];
+            }
+            regs[u.reg] = start[u.reg] + iterations * (linear & 0xffff) + (triangle & 0xffff) * (quadratic & 0xffff);
+        }
+        skipped_ += iterations * length;
+        return iterations * length;
+    }
+
+    /*
+        @return The instructions skipped so far
+    */
+    unsigned long long skipped() const { return skipped_; }
+
+    /*
+        Forgets all loops and the skipped count, for a new program.
+    */
+    void clear() {
+        std::fill(index_.begin(), index_.end(), -1);
+        loops_.clear();
+        skipped_ = 0;
+    }
+
+private:
+    static constexpr unsigned MAX_BODY = 64;
+    static constexpr unsigned long long NEVER = ~0ull;
+
+    /*
+        A linear form: constant plus coef[j] times register j at the
+        head, all modulo 2^16.
+    */
+    struct Linear {
+        unsigned short constant;
+        unsigned short coef[NUM_REGS];
+
+        bool fixed() const {
+            for (unsigned j = 1; j < NUM_REGS; j++)
+                if (coef[j])
+                    return false;
+            return true;
+        }
+    };
+
+    /*
+        A symbolic register value: a linear form, the result of
+        slt(a, b) of two linear forms, or unknown.
+    */
+    struct Value {
+        enum { LINEAR, LESS, UNKNOWN } kind;
+        Linear a;
+        Linear b;
+    };
+
+    /*
+        Accumulators and induction registers gain step plus form
+        every iteration; the form is empty for induction registers.
+    */
+    struct Update {
+        unsigned reg;
+        unsigned short step;
+        Linear form;
+    };
+
+    struct Loop {
+        unsigned head;
+        bool skippable;
+        std::vector<unsigned short> words;
+        std::vector<Update> updates;
+        // What each register gains per iteration (0 if unchanged).
+        unsigned short step[NUM_REGS];
+        // The operands of the exit jeq.
+        Value left;
+        Value right;
+    };
+
+    /*
+        @return The analysis of the loop, reusing the cached one if
+            the loop's code hasn't changed
+    */
+    Loop const &loop_at(unsigned head, unsigned jump_pc, unsigned short const memory[]) {
+        int i = index_[jump_pc];
+        if (i >= 0) {
+            Loop const &loop = loops_[i];
+            if (loop.head == head && (!loop.skippable || std::equal(loop.words.begin(), loop.words.end(), memory + head)))
+                return loop;
+        } else {
+            i = loops_.size();
+            index_[jump_pc] = i;
+            loops_.emplace_back();
+        }
+        loops_[i] = analyze(head, jump_pc, memory);
+        return loops_[i];
+    }
+
+    static Linear register_form(unsigned reg) {
+        Linear l = {0, {0}};
+        if (reg != 0)
+            l.coef[reg] = 1;
+        return l;
+    }
+
+    static Linear combine(Linear const &x, Linear const &y, int sign) {
+        Linear l;
+        l.constant = x.constant + sign * y.constant;
+        for (unsigned j = 0; j < NUM_REGS; j++)
+            l.coef[j] = x.coef[j] + sign * y.coef[j];
+        return l;
+    }
+
+    static Value linear(Linear const &l) { return Value{Value::LINEAR, l, l}; }
+    static Value unknown() { return Value{Value::UNKNOWN, Linear(), Linear()}; }
+
+    /*
+        @return v as a fixed value, folding fixed comparisons, or -1
+    */
+    static long fixed_value(Value const &v) {
+        if (v.kind == Value::LINEAR && v.a.fixed())
+            return v.a.constant;
+        if (v.kind == Value::LESS && v.a.fixed() && v.b.fixed())
+            return v.a.constant < v.b.constant;
+        return -1;
+    }
+
+    static Loop analyze(unsigned head, unsigned jump_pc, unsigned short const memory[]) {
+        Loop loop;
+        loop.head = head;
+        loop.skippable = false;
+        if (jump_pc - head + 1 > MAX_BODY)
+            return loop;
+        loop.words.assign(memory + head, memory + jump_pc + 1);
+
+        Value values[NUM_REGS];
+        bool written[NUM_REGS] = {false};
+        bool live_in[NUM_REGS] = {false};
+        for (unsigned r = 0; r < NUM_REGS; r++)
+            values[r] = linear(register_form(r));
+        auto read = [&](unsigned r) -> Value const & {
+            if (!written[r])
+                live_in[r] = true;
+            return values[r];
+        };
+        bool found_exit = false;
+        for (unsigned at = head; at < jump_pc; at++) {
+            DecodedInstr d = decode_instruction(memory[at], at);
+            Value result = unknown();
+            switch (d.op) {
+            case OP_NOP:
+                continue;
+            case OP_ADD:
+            case OP_SUB: {
+                Value const &x = read(d.srcA);
+                Value const &y = read(d.srcB);
+                long fx = fixed_value(x), fy = fixed_value(y);
+                if ((x.kind == Value::LINEAR || fx >= 0) && (y.kind == Value::LINEAR || fy >= 0)) {
+                    Linear lx = fx >= 0 ? Linear{(unsigned short)fx, {0}} : x.a;
+                    Linear ly = fy >= 0 ? Linear{(unsigned short)fy, {0}} : y.a;
+                    result = linear(combine(lx, ly, d.op == OP_ADD ? 1 : -1));
+                }
+                break;
+            }
+            case OP_OR:
+            case OP_AND: {
+                long fx = fixed_value(read(d.srcA)), fy = fixed_value(read(d.srcB));
+                if (fx >= 0 && fy >= 0)
+                    result = linear(Linear{(unsigned short)(d.op == OP_OR ? fx | fy : fx & fy), {0}});
+                break;
+            }
+            case OP_SLT: {
+                Value const &x = read(d.srcA);
+                Value const &y = read(d.srcB);
+                if (x.kind == Value::LINEAR && y.kind == Value::LINEAR)
+                    result = Value{Value::LESS, x.a, y.a};
+                break;
+            }
+            case OP_SLTI: {
+                Value const &x = read(d.srcA);
+                if (x.kind == Value::LINEAR)
+                    result = Value{Value::LESS, x.a, Linear{d.imm, {0}}};
+                break;
+            }
+            case OP_ADDI: {
+                Value const &x = read(d.srcA);
+                long fx = fixed_value(x);
+                if (x.kind == Value::LINEAR || fx >= 0) {
+                    Linear lx = fx >= 0 ? Linear{(unsigned short)fx, {0}} : x.a;
+                    result = linear(combine(lx, Linear{d.imm, {0}}, 1));
+                }
+                break;
+            }
+            case OP_JEQ:
+                if (found_exit || (d.imm >= head && d.imm <= jump_pc))
+                    return loop;
+                found_exit = true;
+                loop.left = read(d.srcA);
+                loop.right = read(d.srcB);
+                continue;
+            default:
+                return loop;
+            }
+            values[d.dst] = result;
+            written[d.dst] = true;
+        }
+        DecodedInstr back = decode_instruction(memory[jump_pc], jump_pc);
+        if (!found_exit || back.op != OP_J || back.imm != head)
+            return loop;
+
+        // Classify what the body does to every register it writes
+        bool induction[NUM_REGS] = {true};
+        for (unsigned r = 1; r < NUM_REGS; r++) {
+            Value const &v = values[r];
+            loop.step[r] = 0;
+            induction[r] = !written[r];
+            if (!written[r] || !live_in[r])
+                continue;
+            if (v.kind != Value::LINEAR || v.a.coef[r] != 1)
+                return loop;
+            Linear gain = v.a;
+            gain.coef[r] = 0;
+            if (gain.fixed()) {
+                induction[r] = true;
+                loop.step[r] = gain.constant;
+            }
+        }
+        for (unsigned r = 1; r < NUM_REGS; r++) {
+            if (!written[r] || !live_in[r])
+                continue;
+            Linear gain = values[r].a;
+            gain.coef[r] = 0;
+            unsigned short step = gain.constant;
+            gain.constant = 0;
+            for (unsigned j = 1; j < NUM_REGS; j++)
+                if (gain.coef[j] && (!induction[j] || !live_in[j]))
+                    return loop;
+            loop.updates.push_back(Update{r, step, gain});
+        }
+
+        // The exit may only look at induction and unchanged registers
+        // (and temporaries, which are linear forms of those by now)
+        for (Value const *v : {&loop.left, &loop.right}) {
+            if (v->kind == Value::UNKNOWN)
+                return loop;
+            for (Linear const *l : {&v->a, &v->b})
+                for (unsigned j = 1; j < NUM_REGS; j++)
+                    if (l->coef[j] && !induction[j])
+                        return loop;
+        }
+        loop.skippable = true;
+        return loop;
+    }
+
+    /*
+        Evaluates l in the iteration about to start and finds how much
+        it changes per iteration.
+    */
+    static void affine(Linear const &l, unsigned short const regs[], unsigned short const step[],
+                       unsigned short &value, unsigned short &slope) {
+        value = l.constant;
+        slope = 0;
+        for (unsigned j = 1; j < NUM_REGS; j++) {
+            value += l.coef[j] * regs[j];
+            slope += l.coef[j] * step[j];
+        }
+    }
+
+    /*
+        @return The first iteration, counting the one about to start as
+            0, in which the exit jeq is taken, or NEVER if it isn't (or
+            can't be worked out)
+    */
+    static unsigned long long first_exit(Loop const &loop, unsigned short const regs[]) {
+        Value const *less = &loop.left, *other = &loop.right;
+        if (less->kind != Value::LESS)
+            std::swap(less, other);
+        unsigned short p, q;
+        if (less->kind == Value::LINEAR) {
+            // Both linear: the difference has to reach 0
+            unsigned short p1, q1, p2, q2;
+            affine(loop.left.a, regs, loop.step, p1, q1);
+            affine(loop.right.a, regs, loop.step, p2, q2);
+            return solve_equal(p1 - p2, q1 - q2);
+        }
+        if (other->kind != Value::LINEAR)
+            return NEVER;
+        unsigned short want, want_slope;
+        affine(other->a, regs, loop.step, want, want_slope);
+        if (want_slope != 0)
+            return NEVER;
+        if (want > 1)
+            return NEVER;
+        unsigned short pa, qa, pb, qb;
+        affine(less->a, regs, loop.step, pa, qa);
+        affine(less->b, regs, loop.step, pb, qb);
+        if (qa == 0 && qb == 0)
+            return (pa < pb) == want ? 0 : NEVER;
+        if (qa != 0 && qb != 0)
+            return NEVER;
+        // The varying side has to get into an interval
+        long lo, hi;
+        if (qb == 0) {
+            p = pa, q = qa;
+            lo = want ? 0 : pb;
+            hi = want ? (long)pb - 1 : 0xffff;
+        } else {
+            p = pb, q = qb;
+            lo = want ? (long)pa + 1 : 0;
+            hi = want ? 0xffff : pa;
+        }
+        if (lo > hi)
+            return NEVER;
+        return solve_range(p, q, lo, hi);
+    }
+
+    /*
+        @return The smallest k >= 0 with p + q*k = 0 modulo 2^16
+    */
+    static unsigned long long solve_equal(unsigned short p, unsigned short q) {
+        if (p == 0)
+            return 0;
+        if (q == 0)
+            return NEVER;
+        unsigned shift = __builtin_ctz(q);
+        unsigned target = (0x10000 - p) & 0xffff;
+        if (target & ((1u << shift) - 1))
+            return NEVER;
+        unsigned mask = (0x10000 >> shift) - 1;
+        unsigned odd = q >> shift;
+        unsigned inverse = odd;
+        for (int i = 0; i < 4; i++)
+            inverse *= 2 - odd * inverse;
+        return ((target >> shift) * inverse) & mask;
+    }
+
+    /*
+        @return The smallest k >= 0 with (p + q*k) modulo 2^16 in
+            [lo, hi], or NEVER. Moves from one crossing of the interval
+            to the next, and gives up after a bounded number of them.
+    */
+    static unsigned long long solve_range(unsigned short p, unsigned short q, long lo, long hi) {
+        long d = q < 0x8000 ? (long)q : (long)q - 0x10000;
+        unsigned long long k = 0;
+        for (int laps = 0; laps < 1 << 16; laps++) {
+            long x = (unsigned short)(p + q * k);
+            if (x >= lo && x <= hi)
+                return k;
+            if (k > 1 << 17)
+                break;
+            // Steps until x reaches the interval, wrapping if needed
+            long distance = d > 0 ? (x < lo ? lo - x : lo + 0x10000 - x) : (x > hi ? x - hi : x + 0x10000 - hi);
+            long stride = d > 0 ? d : -d;
+            k += (distance + stride - 1) / stride;
+        }
+        return NEVER;
+    }
+
+    // Index into loops_ of the loop closed by the j at each address.
+    std::vector<int> index_;
+    std::vector<Loop> loops_;
+    unsigned long long skipped_;
+};
+
+/*
+    Detects programs that will never halt.
+
+    E20 programs read no input, so a program that comes back to a state
+    (pc, registers and memory) it was in before will go round the same
+    instructions forever. The detector checks the state after every
+    backward transfer of control (an instruction after which pc is not
+    ahead of it), since every loop closes with one, against a saved
+    state, which is replaced by the current one at the 1st, 2nd, 4th,
+    8th, ... check (Brent's cycle finding): states that repeat every L
+    checks from check P on are caught by about check 2 max(P, L) + L,
+    with one saved state.
+
+    pc and the registers are compared directly. Memory is compared by a
+    hash, a sum of one mixed term per word that every sw updates in
+    place, and only a matching hash is confirmed against the saved copy
+    of memory, so a check usually costs a few compares and a reported
+    loop is never a collision.
+*/
+class LoopDetector {
+public:
+    LoopDetector() : watching_(false) {}
+
+    /*
+        Starts watching from the current state, unless already watching.
+
+        @param memory The memory of the machine
+    */
+    void start(unsigned short const memory[]) {
+        if (watching_)
+            return;
+        memory_hash_ = 0;
+        for (unsigned address = 0; address < MEM_SIZE; address++)
+            memory_hash_ += word_hash(address, memory[address]);
+        checks_ = 0;
+        next_save_ = 1;
+        saved_pc_ = MEM_SIZE;
+        watching_ = true;
+    }
+
+    /*
+        Forgets the states seen so far, once the machine state changes
+        other than by running.
+    */
+    void forget() { watching_ = false; }
+
+    /*
+        Accounts for a sw that replaced old_value at address.
+    */
+    E20_ALWAYS_INLINE void stored(unsigned address, unsigned short old_value, unsigned short new_value) {
+        memory_hash_ += word_hash(address, new_value) - word_hash(address, old_value);
+    }
+
+    /*
+        Checks the state after a backward transfer of control.
+
+        @return true if the state is one seen before, so the program
+            will never halt
+    */
+    E20_ALWAYS_INLINE bool repeated(unsigned pc, unsigned short const regs[], unsigned short const memory[]) {
+        if (pc == saved_pc_ && memory_hash_ == saved_hash_ && same_as_saved(regs, memory))
+            return true;
+        if (++checks_ == next_save_)
+            save(pc, regs, memory);
+        return false;
+    }
+
+private:
+    // SplitMix64's finalizer.
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    bool same_as_saved(unsigned short const regs[], unsigned short const memory[]) const {
+        return std::equal(regs, regs + NUM_REGS, saved_regs_) &&
+            std::equal(memory, memory + MEM_SIZE, saved_memory_.begin());
+    }
+
+    void save(unsigned pc, unsigned short const regs[], unsigned short const memory[]) {
+        saved_hash_ = memory_hash_;
+        saved_pc_ = pc;
+        std::copy(regs, regs + NUM_REGS, saved_regs_);
+        saved_memory_.assign(memory, memory + MEM_SIZE);
+        next_save_ *= 2;
+    }
+
+    static uint64_t word_hash(unsigned address, unsigned short value) { return mix((uint64_t)address << 16 | value); }
+
+    bool watching_;
+    uint64_t memory_hash_;
+    unsigned long long checks_;
+    unsigned long long next_save_;
+    // The state last saved, at check next_save_ / 2; saved_pc_ is
+    // MEM_SIZE before the first.
+    unsigned saved_pc_;
+    uint64_t saved_hash_;
+    unsigned short saved_regs_[NUM_REGS];
+    std::vector<unsigned short> saved_memory_;
+};
+
+/*
+    Exit statuses of E20_Processor and E20_Cache for a run stopped by
+    --max-instructions, or by --detect-loops finding that the program
+    will never halt. Errors exit with 1.
+*/
+int const static EXIT_INSTRUCTION_LIMIT = 2;
+int const static EXIT_NEVER_HALTS = 3;
+
+/*
+    An E20 machine: pc, registers, memory and the number of
+    instructions executed, with a predecoded copy of memory that
+    survives from one step() or run() to the next.
+*/
+class Machine {
+public:
+    Machine() : memory_(MEM_SIZE, 0), decoded_(MEM_SIZE, DecodedInstr{OP_UNDECODED, 0, 0, 0, 0}), pc_(0), regs_{0}, instructions_(0),
+                halted_(false), looping_(false), loop_skipping_(true), loop_detection_(false), stop_at_end_(false) {}
+
+    /*
+        Loads a program file (machine code or binary image, see
+        E20_Loader.h, or assembly source ending in .s, see
+        E20_Assembler.h) and resets the machine to run it from the
+        start. On error the machine is left as it was.
+
+        @param filename The program file
+        @param use_image_cache As for load_program; source is always
+            assembled
+        @return false if the program image (see program_image_name)
+            couldn't be written; the program is loaded all the same
+        @throws LoadError if the program can't be read
+    */
+    bool load(std::string const &filename, bool use_image_cache = false) {
+        std::vector<unsigned short> memory(MEM_SIZE, 0);
+        bool image_written = true;
+        if (is_assembly_source(filename))
+            assemble_file(filename, memory.data(), MEM_SIZE);
+        else
+            image_written = load_program(filename.c_str(), memory.data(), MEM_SIZE, use_image_cache);
+        load(memory.data(), memory.size());
+        return image_written;
+    }
+
+    /*
+        Resets the machine with words at the start of memory and zeros
+        after them.
+
+        @param words The program, starting at address 0
+        @param count Number of words, at most MEM_SIZE
+        @throws LoadError if count is larger than memory
+    */
+    void load(unsigned short const words[], size_t count) {
+        if (count > MEM_SIZE)
+            throw LoadError("Program too big for memory");
+        std::fill(std::copy(words, words + count, memory_.begin()), memory_.end(), 0);
+        reset(0, nullptr, 0);
+    }
+
+    /*
+        Resets the machine to the state saved in a checkpoint.
+    */
+    void restore(Checkpoint const &checkpoint) {
+        std::copy(checkpoint.memory.begin(), checkpoint.memory.begin() + MEM_SIZE, memory_.begin());
+        reset(checkpoint.pc, checkpoint.registers, checkpoint.instructions);
+    }
+
+    /*
+        Takes over the state another engine (such as a JIT) reached by
+        running on from this machine's state: pc, registers and memory
+        from state, with count added to the instructions executed.
+
+        @param state The state the engine stopped in; its instruction
+            count is ignored
+        @param count Instructions the engine executed
+        @param halted Whether the program halted
+    */
+    void resume(Checkpoint const &state, unsigned long long count, bool halted) {
+        std::copy(state.memory.begin(), state.memory.begin() + MEM_SIZE, memory_.begin());
+        reset(state.pc, state.registers, instructions_ + count);
+        halted_ = halted;
+    }
+
+    /*
+        Saves the machine state into a checkpoint, leaving its cache
+        fields alone.
+    */
+    void save(Checkpoint &checkpoint) const {
+        checkpoint.instructions = instructions_;
+        checkpoint.pc = pc_;
+        std::copy(regs_, regs_ + NUM_REGS, checkpoint.registers);
+        std::copy(memory_.begin(), memory_.end(), checkpoint.memory.begin());
+    }
+
+    /*
+        Executes one instruction, unless the machine has halted or been
+        found looping.
+
+        @return false if the machine has halted or been found looping,
+            by this instruction or before
+    */
+    bool step() {
+        execute(1, IgnoreInstruction(), IgnoreAccess(), false);
+        return !halted_ && !looping_;
+    }
+
+    /*
+        Runs until the program halts, is found looping (with loop
+        detection on) or has executed max_instructions instructions,
+        fast-forwarding counted loops unless that is turned off (see
+        LoopSkipper).
+
+        @param max_instructions The most instructions to execute
+        @param on_access Called as on_access(pc, address, is_store)
+            after every lw and sw
+        @return The number of instructions executed, including a final
+            halt
+    */
+    template <typename OnAccess>
+    unsigned long long run(unsigned long long max_instructions, OnAccess &&on_access) {
+        return execute(max_instructions, IgnoreInstruction(), on_access, loop_skipping_);
+    }
+
+    unsigned long long run(unsigned long long max_instructions = std::numeric_limits<unsigned long long>::max()) {
+        return run(max_instructions, IgnoreAccess());
+    }
+
+    /*
+        Like run(), but calls on_instr(d, pc, regs) before every
+        instruction with its decoded form and the registers. Never
+        skips loops, since on_instr must see every instruction.
+    */
+    template <typename OnInstr>
+    unsigned long long trace(unsigned long long max_instructions, OnInstr &&on_instr) {
+        return execute(max_instructions, on_instr, IgnoreAccess(), false);
+    }
+
+    /*
+        Like trace(), also calling on_access(pc, address, is_store) after
+        every lw and sw, as run() does.
+    */
+    template <typename OnInstr, typename OnAccess>
+    unsigned long long trace(unsigned long long max_instructions, OnInstr &&on_instr, OnAccess &&on_access) {
+        return execute(max_instructions, on_instr, on_access, false);
+    }
+
+    unsigned short pc() const { return pc_; }
+    unsigned short reg(size_t i) const { return regs_[i]; }
+    unsigned short const *registers() const { return regs_; }
+    unsigned short const *memory() const { return memory_.data(); }
+    unsigned long long instructions() const { return instructions_; }
+    bool halted() const { return halted_; }
+
+    /*
+        @return Whether loop detection stopped a run because the program
+            came back to an earlier state, so it will never halt
+    */
+    bool looping() const { return looping_; }
+
+    void set_pc(unsigned short pc) {
+        pc_ = pc % MEM_SIZE;
+        halted_ = false;
+        changed();
+    }
+
+    void set_reg(size_t i, unsigned short value) {
+        if (i != 0)
+            regs_[i] = value;
+        changed();
+    }
+
+    /*
+        Writes a word of memory, as a sw would.
+    */
+    void write(unsigned short address, unsigned short value) {
+        address %= MEM_SIZE;
+        memory_[address] = value;
+        decoded_[address].op = OP_UNDECODED;
+        changed();
+    }
+
+    /*
+        Turns loop fast-forwarding in run() on (the default) or off.
+    */
+    void set_loop_skipping(bool on) { loop_skipping_ = on; }
+
+    /*
+        Turns detection of programs that will never halt in step(),
+        run() and trace() on or off (the default, see LoopDetector).
+    */
+    void set_loop_detection(bool on) { loop_detection_ = on; }
+
+    /*
+        Makes the machine halt when pc runs off either end of memory
+        (see left_memory) instead of wrapping around, as E20_Cache
+        always has. Off by default.
+    */
+    void set_stop_at_end(bool on) { stop_at_end_ = on; }
+
+    /*
+        @return The instructions run() skipped in counted loops since
+            the last load or restore
+    */
+    unsigned long long skipped() const { return skipper_.skipped(); }
+
+private:
+    // Observers that do nothing, as types so that they compile away.
+    struct IgnoreInstruction {
+        void operator()(DecodedInstr const &, unsigned, unsigned short const *) const {}
+    };
+    struct IgnoreAccess {
+        void operator()(unsigned, unsigned, bool) const {}
+    };
+
+    void reset(unsigned short pc, unsigned short const regs[], unsigned long long instructions) {
+        std::fill(decoded_.begin(), decoded_.end(), DecodedInstr{OP_UNDECODED, 0, 0, 0, 0});
+        pc_ = pc % MEM_SIZE;
+        for (size_t i = 0; i < NUM_REGS; i++)
+            regs_[i] = regs && i != 0 ? regs[i] : 0;
+        instructions_ = instructions;
+        halted_ = false;
+        skipper_.clear();
+        changed();
+    }
+
+    /*
+        Called when the state changes other than by running: earlier
+        states no longer lead to this one.
+    */
+    void changed() {
+        looping_ = false;
+        detector_.forget();
+    }
+
+    // Runs interpret() with or without loop detection.
+    template <typename OnInstr, typename OnAccess>
+    E20_ALWAYS_INLINE unsigned long long execute(unsigned long long limit, OnInstr &&on_instr, OnAccess &&on_access, bool skip) {
+        if (loop_detection_)
+            return interpret<true>(limit, on_instr, on_access, skip);
+        return interpret<false>(limit, on_instr, on_access, skip);
+    }
+
+    /*
+        The interpreter loop behind step(), run() and trace(). Words are
+        decoded lazily on first fetch; a store drops the decoded form of
+        the word it overwrites, so self-modifying programs see their own
+        stores. Detect is a template parameter so that runs without loop
+        detection don't pay for it.
+    */
+    template <bool Detect, typename OnInstr, typename OnAccess>
+    E20_ALWAYS_INLINE unsigned long long interpret(unsigned long long limit, OnInstr &&on_instr, OnAccess &&on_access, bool skip) {
+        if (halted_ || looping_)
+            return 0;
+        // Work on local copies so that stores to memory don't force the
+        // compiler to reload the registers and pc on every instruction.
+        unsigned pc = pc_;
+        unsigned short regs[NUM_REGS];
+        std::copy(regs_, regs_ + NUM_REGS, regs);
+        unsigned short *memory = memory_.data();
+        DecodedInstr *decoded = decoded_.data();
+        LoopSkipper *skipper = skip ? &skipper_ : nullptr;
+        bool const stop_at_end = stop_at_end_;
+        bool const observe_access = !std::is_same<typename std::decay<OnAccess>::type, IgnoreAccess>::value;
+        if (Detect)
+            detector_.start(memory);
+
+        unsigned long long count = 0;
+        while (count < limit){
+            DecodedInstr const &d = decoded[pc];
+            if (d.op == OP_UNDECODED){
+                decoded[pc] = decode_instruction(memory[pc], pc);
+                continue;
+            }
+            count++;
+            on_instr(d, pc, static_cast<unsigned short const *>(regs));
+            unsigned at = pc;
+            DecodedOp op = d.op;
+            unsigned address = observe_access || Detect ? (regs[d.srcA] + d.imm) % MEM_SIZE : 0;
+            unsigned short old_value = Detect && op == OP_SW ? memory[address] : 0;
+            if (!execute_instruction(d, pc, regs, memory, decoded)){
+                halted_ = true;
+                break;
+            }
+            if (observe_access && (op == OP_LW || op == OP_SW))
+                on_access(at, address, op == OP_SW);
+            if (stop_at_end && left_memory(d, op, at, regs)){
+                halted_ = true;
+                break;
+            }
+            if (Detect) {
+                if (op == OP_SW)
+                    detector_.stored(address, old_value, memory[address]);
+                if (pc <= at && detector_.repeated(pc, regs, memory)) {
+                    looping_ = true;
+                    break;
+                }
+            }
+            if (op == OP_J && skipper && pc < at)
+                count += skipper->skip(pc, at, regs, memory, limit - count);
+        }
+        std::copy(regs, regs + NUM_REGS, regs_);
+        pc_ = pc;
+        instructions_ += count;
+        return count;
+    }
+
+    std::vector<unsigned short> memory_;
+    std::vector<DecodedInstr> decoded_;
+    unsigned short pc_;
+    unsigned short regs_[NUM_REGS];
+    unsigned long long instructions_;
+    bool halted_;
+    bool looping_;
+    bool loop_skipping_;
+    bool loop_detection_;
+    bool stop_at_end_;
+    LoopSkipper skipper_;
+    LoopDetector detector_;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef E20_MISSCLASS_H
+#define E20_MISSCLASS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+    Three-C classification of cache misses (Hill), for E20_Cache
+    --classify-misses. Every miss of a level is one of:
+
+    - compulsory: the first time the block comes into the level; it
+      would miss in any cache
+    - capacity: a fully associative LRU cache of the level's size would
+      miss too
+    - conflict: that fully associative cache would hit, so the miss is
+      down to the level's sets (or its replacement policy, or a block
+      invalidated by an inclusive level below)
+
+    A MissClassifier per level sees the same accesses as the level
+    itself, lw, sw, writebacks and prefetches alike. It marks every
+    block that comes into the level in a first-touch bitmap, indexed by
+    block number, and keeps the fully associative cache as a hash table
+    of its blocks over an intrusive list in recency order, so an access
+    costs a lookup and a few links whatever the size.
+*/
+
+enum MissClass { MISS_COMPULSORY, MISS_CAPACITY, MISS_CONFLICT };
+
+/*
+    The names of the miss classes, in MissClass order, as printed in
+    the summary and in tagged log lines.
+*/
+char const static *const MISS_CLASS_NAMES[] = {"compulsory", "capacity", "conflict"};
+
+/*
+    A fully associative LRU cache of blocks, that only tracks which
+    blocks it holds.
+*/
+class FullyAssociativeLru {
+public:
+    /*
+        @param capacity Number of blocks, at least 1
+    */
+    explicit FullyAssociativeLru(size_t capacity) : nodes_(capacity + 1), size_(0) {
+        size_t slots = 2;
+        shift_ = 63;
+        while (slots < 2 * capacity) {
+            slots *= 2;
+            shift_--;
+        }
+        slots_.assign(slots, 0);
+        mask_ = slots - 1;
+        nodes_[0].prev = nodes_[0].next = 0;
+    }
+
+    /*
+        Looks up a block and makes it the most recently used; a missing
+        block is brought in, evicting the least recently used one when
+        full, if allocate is set.
+
+        @return Whether the block was there
+    */
+    bool access(unsigned block, bool allocate) {
+        size_t slot = find(block);
+        if (slots_[slot] != 0) {
+            uint32_t node = slots_[slot];
+            unlink(node);
+            link_front(node);
+            return true;
+        }
+        if (!allocate)
+            return false;
+        uint32_t node;
+        if (size_ + 1 < nodes_.size())
+            node = ++size_;
+        else {
+            node = nodes_[0].prev;
+            unlink(node);
+            erase(find(nodes_[node].block));
+            slot = find(block);
+        }
+        nodes_[node].block = block;
+        slots_[slot] = node;
+        link_front(node);
+        return false;
+    }
+
+private:
+    struct Node {
+        unsigned block;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    size_t home(unsigned block) const { return (block * 0x9E3779B97F4A7C15ull) >> shift_; }
+
+    /*
+        @return The slot of block, or the empty slot where it would go
+    */
+    size_t find(unsigned block) const {
+        size_t slot = home(block);
+        while (slots_[slot] != 0 && nodes_[slots_[slot]].block != block)
+            slot = (slot + 1) & mask_;
+        return slot;
+    }
+
+    /*
+        Empties a slot, moving later entries of its probe run back so
+        that lookups never stop short of them.
+    */
+    void erase(size_t slot) {
+        slots_[slot] = 0;
+        for (size_t next = (slot + 1) & mask_; slots_[next] != 0; next = (next + 1) & mask_) {
+            size_t want = home(nodes_[slots_[next]].block);
+            // Entries whose home lies cyclically in (slot, next] stay
+            bool stays = slot < next ? want > slot && want <= next : want > slot || want <= next;
+            if (!stays) {
+                slots_[slot] = slots_[next];
+                slots_[next] = 0;
+                slot = next;
+            }
+        }
+    }
+
+    void unlink(uint32_t node) {
+        nodes_[nodes_[node].prev].next = nodes_[node].next;
+        nodes_[nodes_[node].next].prev = nodes_[node].prev;
+    }
+
+    void link_front(uint32_t node) {
+        nodes_[node].prev = 0;
+        nodes_[node].next = nodes_[0].next;
+        nodes_[nodes_[0].next].prev = node;
+        nodes_[0].next = node;
+    }
+
+    // nodes_[0] heads the circular list, most recently used first.
+    std::vector<Node> nodes_;
+    size_t size_;
+    // Node numbers by hash, 0 for empty, probed linearly.
+    std::vector<uint32_t> slots_;
+    size_t mask_;
+    int shift_;
+};
+
+/*
+    Classifies the misses of one cache level.
+*/
+class MissClassifier {
+public:
+    /*
+        @param blocks The level's capacity in blocks (rows * assoc)
+        @param blocksize The level's block size
+    */
+    MissClassifier(size_t blocks, unsigned blocksize) : blocksize_(blocksize), lru_(blocks) {}
+
+    /*
+        Records an access of the level.
+
+        @param allocate Whether a miss brings the block into the level
+        @return The class of the access if it missed; anything on a hit
+    */
+    MissClass access(unsigned address, bool allocate) {
+        unsigned block = address / blocksize_;
+        size_t word = block / 64;
+        uint64_t bit = uint64_t(1) << (block % 64);
+        if (word >= touched_.size())
+            touched_.resize(std::max(word + 1, 2 * touched_.size()), 0);
+        bool first = !(touched_[word] & bit);
+        bool lru_hit = lru_.access(block, allocate);
+        if (allocate)
+            touched_[word] |= bit;
+        return first ? MISS_COMPULSORY : lru_hit ? MISS_CONFLICT : MISS_CAPACITY;
+    }
+
+private:
+    unsigned blocksize_;
+    // One bit per block number, set once the block has been in the level.
+    std::vector<uint64_t> touched_;
+    FullyAssociativeLru lru_;
+};
+
+/*
+    Counts classified lw misses per pc and level, and prints them.
+*/
+class MissClassCounts {
+public:
+    /*
+        @param levels Number of cache levels
+        @param pcs Number of pcs to count separately; accesses without
+            a pc all count as pc 0
+    */
+    explicit MissClassCounts(size_t levels = 0, size_t pcs = 1)
+            : levels_(levels), pcs_(pcs), counts_(pcs * levels * 3, 0) {}
+
+    void count(unsigned pc, size_t level, MissClass c) { counts_[(pc * levels_ + level) * 3 + c]++; }
+
+    /*
+        Prints one line per level:
+
+            Misses L1: 12 compulsory (30.00%), 4 capacity (10.00%), 24 conflict (60.00%)
+    */
+    void write_levels(std::ostream &out) const {
+        for (size_t level = 0; level < levels_; level++) {
+            unsigned long long classes[3] = {0, 0, 0};
+            for (size_t pc = 0; pc < pcs_; pc++)
+                for (int c = 0; c < 3; c++)
+                    classes[c] += at(pc, level, c);
+            unsigned long long total = classes[0] + classes[1] + classes[2];
+            out << "Misses L" << level + 1 << ":";
+            for (int c = 0; c < 3; c++) {
+                out << (c ? ", " : " ") << classes[c] << " " << MISS_CLASS_NAMES[c] << " (";
+                if (total == 0)
+                    out << "n/a)";
+                else
+                    out << std::fixed << std::setprecision(2) << 100.0 * classes[c] / total << "%)";
+            }
+            out << std::endl;
+        }
+    }
+
+    /*
+        Prints a table of every pc that missed at any level, most L1
+        misses first.
+    */
+    void write_pcs(std::ostream &out) const {
+        std::vector<unsigned> pcs;
+        for (unsigned pc = 0; pc < pcs_; pc++)
+            if (misses(pc, levels_) > 0)
+                pcs.push_back(pc);
+        std::stable_sort(pcs.begin(), pcs.end(), [&](unsigned a, unsigned b) { return misses(a, 1) > misses(b, 1); });
+        out << "Misses by pc:" << std::endl << "   pc";
+        for (size_t level = 0; level < levels_; level++)
+            for (int c = 0; c < 3; c++)
+                out << std::setw(c == 0 ? 15 : 13) << "L" + std::to_string(level + 1) + " " + MISS_CLASS_NAMES[c];
+        out << std::endl;
+        for (unsigned pc : pcs) {
+            out << std::setw(5) << pc;
+            for (size_t level = 0; level < levels_; level++)
+                for (int c = 0; c < 3; c++)
+                    out << std::setw(c == 0 ? 15 : 13) << at(pc, level, c);
+            out << std::endl;
+        }
+    }
+
+private:
+    unsigned long long at(size_t pc, size_t level, int c) const { return counts_[(pc * levels_ + level) * 3 + c]; }
+
+    /*
+        @return The misses of pc in the first levels levels
+    */
+    unsigned long long misses(size_t pc, size_t levels) const {
+        unsigned long long total = 0;
+        for (size_t level = 0; level < levels; level++)
+            for (int c = 0; c < 3; c++)
+                total += at(pc, level, c);
+        return total;
+    }
+
+    size_t levels_;
+    size_t pcs_;
+    // Compulsory, capacity and conflict misses, pc after pc, level
+    // after level.
+    std::vector<unsigned long long> counts_;
+};
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef E20_PREFETCH_H
+#define E20_PREFETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Hardware prefetchers for the levels of a CacheHierarchy.
+
+    Each level has its own prefetcher, which watches the demand
+    accesses (lw and sw) reaching that level and asks for blocks it
+    expects to be needed soon:
+
+    - next-line: on a miss, or on the first use of a prefetched block
+      (tagged prefetching), the blocks distance, distance+1, ... ahead.
+    - stride: a reference prediction table of STRIDE_ENTRIES entries,
+      indexed and tagged by the pc of the access, that learns each
+      instruction's stride. Once the same stride has been seen twice in
+      a row, each access asks for the addresses distance, distance+1,
+      ... strides ahead. Strides smaller than a block move a block at
+      a time.
+    - stream: STREAM_BUFFERS stream buffers (Jouppi) of degree blocks
+      each, next to the level. A miss that a buffer holds takes the
+      block from there instead of from below (a hit), drops the blocks
+      before it, and the buffer fetches more to stay full. A miss that
+      continues a buffer's stream (the block after its last one, in the
+      same page) just moves the stream along; any other miss restarts
+      the least recently used buffer at the block distance ahead.
+
+    Degree is the number of blocks asked for at once, and prefetches
+    never leave the page (of PrefetchConfig::page cells) of the access
+    that caused them.
+
+    Prefetched blocks are tagged in the level (see TagStore) until
+    their first demand access, so each level counts:
+
+    - issued: blocks prefetched into it, or into its stream buffers
+    - useful: prefetched blocks used by a demand access
+    - late: useful blocks used fewer than PrefetchConfig::latency
+      demand accesses after they were prefetched, i.e. before a real
+      prefetch would have arrived
+    - unused: prefetched blocks evicted, or dropped from a stream
+      buffer, without ever being used
+    - pollution: demand misses that would have hit without prefetching,
+      in a shadow copy of the level that only sees the demand accesses
+
+    Accuracy is useful / issued, coverage is useful / (useful + demand
+    misses), and timeliness is (useful - late) / useful.
+*/
+
+enum PrefetcherKind { PREFETCH_NONE, PREFETCH_NEXT_LINE, PREFETCH_STRIDE, PREFETCH_STREAM };
+
+/*
+    The command-line names of the prefetchers, in PrefetcherKind order.
+*/
+char const static *const PREFETCHER_NAMES[] = {"none", "next-line", "stride", "stream"};
+
+/*
+    Parses a --prefetch argument: one prefetcher name per level,
+    comma-separated, or a single name for every level.
+
+    @param text The argument
+    @param depth Number of levels
+    @param kinds Receives one prefetcher per level
+    @return false if the text is malformed or has the wrong length
+*/
+inline bool parse_prefetchers(std::string const &text, size_t depth, std::vector<PrefetcherKind> &kinds) {
+    kinds.clear();
+    size_t start = 0;
+    while (true) {
+        size_t comma = text.find(',', start);
+        std::string name = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t i = 0;
+        while (i < 4 && name != PREFETCHER_NAMES[i])
+            i++;
+        if (i == 4)
+            return false;
+        kinds.push_back(PrefetcherKind(i));
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    if (kinds.size() == 1)
+        kinds.resize(depth, kinds[0]);
+    return kinds.size() == depth;
+}
+
+/*
+    How one level prefetches.
+*/
+struct PrefetchConfig {
+    PrefetcherKind kind;
+    unsigned degree;        // blocks asked for at once, or stream buffer depth
+    unsigned distance;      // how many blocks or strides ahead to start
+    unsigned latency;       // demand accesses a prefetch takes to arrive
+    unsigned long page;     // cells in a page; prefetches stay in theirs
+};
+
+/*
+    What the prefetches of one level achieved, as described at the top
+    of this file.
+*/
+struct PrefetchStats {
+    unsigned long long issued = 0;
+    unsigned long long useful = 0;
+    unsigned long long late = 0;
+    unsigned long long unused = 0;
+    unsigned long long pollution = 0;
+    unsigned long long misses = 0;     // demand misses
+};
+
+/*
+    The prefetcher of one cache level, and the bookkeeping behind its
+    PrefetchStats. CacheHierarchy calls demand() for every demand access
+    of the level, and filled() and evicted() as blocks come and go; the
+    blocks asked for are passed to an issue callback, for the hierarchy
+    to fetch.
+*/
+class Prefetcher {
+public:
+    static constexpr size_t STRIDE_ENTRIES = 256;
+    static constexpr size_t STREAM_BUFFERS = 4;
+
+    /*
+        @param config How to prefetch; degree and distance at least 1
+        @param blocksize The level's block size
+    */
+    Prefetcher(PrefetchConfig const &config, unsigned blocksize)
+            : config_(config), blocksize_(blocksize),
+              strides_(config.kind == PREFETCH_STRIDE ? STRIDE_ENTRIES : 0, StrideEntry{0, 0, 0, 0, false}),
+              streams_(config.kind == PREFETCH_STREAM ? STREAM_BUFFERS : 0, StreamBuffer{{}, 0, -1, 0, 0}) {}
+
+    PrefetcherKind kind() const { return config_.kind; }
+    PrefetchStats const &stats() const { return stats_; }
+
+    /*
+        @return Whether prefetches go into stream buffers rather than
+            into the level itself
+    */
+    bool buffered() const { return config_.kind == PREFETCH_STREAM; }
+
+    /*
+        Counts a demand access to the level and trains the prefetcher.
+
+        @param pc The pc of the lw or sw
+        @param hit Whether the level held the block
+        @param shadow_hit Whether the level would have held it without
+            prefetching
+        @param allocate Whether a miss brings the block into the level
+        @param first_use Whether the access was the first to use a
+            prefetched block
+        @param now The number of demand accesses to the hierarchy so far
+        @param issue Called as issue(address) with the first address of
+            every block to prefetch
+        @return Whether the access hit, counting a block taken from a
+            stream buffer as a hit
+    */
+    template <typename Issue>
+    bool demand(unsigned pc, unsigned address, bool hit, bool shadow_hit, bool allocate, bool first_use,
+                unsigned long long now, Issue &&issue) {
+        unsigned block = address - address % blocksize_;
+        if (first_use) {
+            auto it = fill_times_.find(block);
+            used(it == fill_times_.end() ? config_.latency : now - it->second);
+            if (it != fill_times_.end())
+                fill_times_.erase(it);
+        }
+        if (!hit && allocate && buffered() && take_buffered(block, now, issue))
+            return true;
+        if (!hit) {
+            stats_.misses++;
+            stats_.pollution += shadow_hit;
+        }
+
+        switch (config_.kind) {
+        case PREFETCH_NEXT_LINE:
+            if (!hit || first_use)
+                for (unsigned k = 0; k < config_.degree; k++)
+                    issue_in_page(block, (long long)block + (long long)(config_.distance + k) * blocksize_, issue);
+            break;
+        case PREFETCH_STRIDE:
+            train_stride(pc, address, issue);
+            break;
+        case PREFETCH_STREAM:
+            if (!hit && allocate && !follow_stream(block, now))
+                restart_stream(block, now, issue);
+            break;
+        case PREFETCH_NONE:
+            break;
+        }
+        return hit;
+    }
+
+    /*
+        Counts a block that a prefetch brought into the level.
+    */
+    void filled(unsigned block, unsigned long long now) {
+        stats_.issued++;
+        fill_times_[block] = now;
+    }
+
+    /*
+        Counts a prefetched block evicted from the level before it was
+        ever used.
+    */
+    void evicted_unused(unsigned block) {
+        stats_.unused++;
+        fill_times_.erase(block);
+    }
+
+private:
+    struct StrideEntry {
+        unsigned pc;
+        unsigned last;          // the last address accessed
+        long long stride;
+        unsigned char confidence;
+        bool valid;
+    };
+
+    struct StreamEntry {
+        unsigned block;
+        unsigned long long time;    // when it was prefetched
+    };
+
+    struct StreamBuffer {
+        std::vector<StreamEntry> entries;     // oldest first
+        long long next;                       // the block to fetch next
+        long long expected;                   // the block after the last miss
+        unsigned long page;
+        unsigned long long last_use;
+    };
+
+    /*
+        Counts the first use of a prefetched block, lead demand accesses
+        after it was prefetched.
+    */
+    void used(unsigned long long lead) {
+        stats_.useful++;
+        stats_.late += lead < config_.latency;
+    }
+
+    template <typename Issue>
+    void issue_in_page(unsigned from, long long target, Issue &issue) {
+        if (target >= 0 && (unsigned long long)target / config_.page == from / config_.page)
+            issue((unsigned)(target - target % blocksize_));
+    }
+
+    template <typename Issue>
+    void train_stride(unsigned pc, unsigned address, Issue &issue) {
+        StrideEntry &e = strides_[pc % STRIDE_ENTRIES];
+        if (!e.valid || e.pc != pc) {
+            e = StrideEntry{pc, address, 0, 0, true};
+            return;
+        }
+        long long stride = (long long)address - e.last;
+        if (stride == e.stride) {
+            if (e.confidence < 3)
+                e.confidence++;
+        }
+        else if (e.confidence > 0)
+            e.confidence--;
+        else
+            e.stride = stride;
+        e.last = address;
+        if (e.confidence == 0 || e.stride == 0)
+            return;
+        long long step = e.stride;
+        if (step > -(long long)blocksize_ && step < (long long)blocksize_)
+            step = step < 0 ? -(long long)blocksize_ : (long long)blocksize_;
+        for (unsigned k = 0; k < config_.degree; k++)
+            issue_in_page(address, (long long)address + step * (config_.distance + k), issue);
+    }
+
+    /*
+        Takes block out of the stream buffer holding it, if any, and
+        tops that buffer up.
+
+        @return false if no buffer holds block
+    */
+    template <typename Issue>
+    bool take_buffered(unsigned block, unsigned long long now, Issue &issue) {
+        for (StreamBuffer &s : streams_)
+            for (size_t k = 0; k < s.entries.size(); k++)
+                if (s.entries[k].block == block) {
+                    used(now - s.entries[k].time);
+                    stats_.unused += k;
+                    s.entries.erase(s.entries.begin(), s.entries.begin() + k + 1);
+                    s.expected = (long long)block + blocksize_;
+                    s.last_use = now;
+                    fill_stream(s, now, issue);
+                    return true;
+                }
+        return false;
+    }
+
+    /*
+        Moves along the stream buffer whose stream block continues.
+
+        @return false if none does
+    */
+    bool follow_stream(unsigned block, unsigned long long now) {
+        for (StreamBuffer &s : streams_)
+            if (s.expected == block && block / config_.page == s.page) {
+                s.expected += blocksize_;
+                s.last_use = now;
+                return true;
+            }
+        return false;
+    }
+
+    /*
+        Restarts the least recently used stream buffer after block.
+    */
+    template <typename Issue>
+    void restart_stream(unsigned block, unsigned long long now, Issue &issue) {
+        StreamBuffer *oldest = &streams_[0];
+        for (StreamBuffer &s : streams_)
+            if (s.last_use < oldest->last_use)
+                oldest = &s;
+        stats_.unused += oldest->entries.size();
+        oldest->entries.clear();
+        oldest->next = (long long)block + (long long)config_.distance * blocksize_;
+        oldest->expected = (long long)block + blocksize_;
+        oldest->page = block / config_.page;
+        oldest->last_use = now;
+        fill_stream(*oldest, now, issue);
+    }
+
+    template <typename Issue>
+    void fill_stream(StreamBuffer &s, unsigned long long now, Issue &issue) {
+        while (s.entries.size() < config_.degree && (unsigned long long)s.next / config_.page == s.page) {
+            s.entries.push_back(StreamEntry{(unsigned)s.next, now});
+            stats_.issued++;
+            issue((unsigned)s.next);
+            s.next += blocksize_;
+        }
+    }
+
+    PrefetchConfig config_;
+    unsigned blocksize_;
+    std::vector<StrideEntry> strides_;
+    std::vector<StreamBuffer> streams_;
+    PrefetchStats stats_;
+    // When each prefetched block of the level that is still unused
+    // came in.
+    std::unordered_map<unsigned, unsigned long long> fill_times_;
+};
+
+#endif
@@ -2,272 +2,971 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <fstream>
 #include <iomanip>
-#include <regex>
 #include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include "E20_Loader.h"
+#include "E20_Batch.h"
+#include "E20_Log.h"
+#include "E20_Hierarchy.h"
+#include "E20_Checkpoint.h"
+#include "E20_Machine.h"
+#include "E20_Lockstep.h"
 
 using namespace std;
 
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1<<13;
-size_t const static REG_SIZE = 1<<16;
-
-/*
-    Loads an E20 machine code file into the list
-    provided by mem. We assume that mem is
-    large enough to hold the values in the machine
-    code file.
-
-    @param f Open file to read from
-    @param mem Array represetnting memory into which to read program
-*/
-void load_machine_code(ifstream &f, unsigned short mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0; // IF WE CAN CHANGE THE CODE, MAKE THIS GLOBAL TO THE CODE 
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
-        }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
-        }
-        expectedaddr ++;
-        mem[addr] = instr;
-    }
-}
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define E20_JIT
+#include <sys/mman.h>
+#include <cstring>
+#endif
 
 /*
     Prints the current state of the simulator, including
     the current program counter, the current register values,
     and the first memquantity elements of memory.
 
+    @param out Where to print the state
     @param pc The final value of the program counter
     @param regs Final value of all registers
     @param memory Final value of memory
     @param memquantity How many words of memory to dump
 */
-void print_state(unsigned pc, unsigned short regs[], unsigned short memory[], size_t memquantity) {
-    cout << setfill(' ');
-    cout << "Final state:" << endl;
-    cout << "\tpc=" <<setw(5)<< pc << endl;
+void print_state(ostream &out, unsigned pc, unsigned short const regs[], unsigned short const memory[], size_t memquantity) {
+    string buf = "Final state:\n\tpc=";
+    buf.reserve(128 + memquantity * 5);
+    log_append_right(buf, pc, 5);
+    buf.push_back('\n');
 
-    for (size_t reg=0; reg<NUM_REGS; reg++)
-        cout << "\t$" << reg << "="<<setw(5)<<regs[reg]<<endl;
+    for (size_t reg=0; reg<NUM_REGS; reg++) {
+        buf.append("\t$");
+        log_append_right(buf, reg, 0);
+        buf.push_back('=');
+        log_append_right(buf, regs[reg], 5);
+        buf.push_back('\n');
+    }
 
-    cout << setfill('0');
     bool cr = false;
     for (size_t count=0; count<memquantity; count++) {
-        cout << hex << setw(4) << memory[count] << " ";
+        log_append_hex4(buf, memory[count]);
+        buf.push_back(' ');
         cr = true;
         if (count % 8 == 7) {
-            cout << endl;
+            buf.push_back('\n');
             cr = false;
         }
     }
     if (cr)
-        cout << endl;
+        buf.push_back('\n');
+    out.write(buf.data(), buf.size());
+    out.flush();
 }
 
-unsigned signExtender7B(unsigned imm){
-    if ((imm & 64) == 64){
-        return imm | 65408; 
+enum StallCause { STALL_LOAD_USE, STALL_BRANCH, STALL_JUMP, STALL_MEMORY, NUM_STALL_CAUSES };
+
+/*
+    The names of the stall causes in the --timing report, in
+    StallCause order.
+*/
+char const static *const STALL_CAUSE_NAMES[] = {"load-use", "branch", "jump", "memory"};
+
+/*
+    Timing model of a classic five-stage pipeline (IF, ID, EX, MEM, WB)
+    laid over the functional simulation: the instructions are executed
+    as usual and the model only counts the cycles they would take.
+
+    Every instruction takes one cycle per stage, overlapped with its
+    neighbours, plus the stalls it causes:
+
+    - Results are forwarded from EX and MEM to EX, so the only data
+      hazard is load-use: an instruction that needs the result of the
+      lw right before it in EX waits one cycle. A sw whose data (not
+      its address) comes from that lw gets it forwarded into MEM and
+      doesn't wait.
+    - Branches are predicted not taken. j and jal are resolved in ID
+      and flush one instruction; jr and taken jeq are resolved in EX
+      and flush two.
+    - lw and sw spend memory_cycles in MEM, stalling the whole pipeline
+      for all but the first.
+
+    The final halt drains the pipeline, which adds four cycles.
+*/
+class PipelineTiming {
+public:
+    /*
+        Accounts for one instruction, before it executes.
+
+        @param d The instruction
+        @param regs The registers before it executes
+        @param memory_cycles The cycles it spends in MEM; only used for
+            lw and sw
+    */
+    void issue(DecodedInstr const &d, unsigned short const regs[], unsigned memory_cycles) {
+        instructions_++;
+        if (load_dst_ != 0 && reads_in_ex(d, load_dst_))
+            stalls_[STALL_LOAD_USE]++;
+        load_dst_ = d.op == OP_LW ? d.dst : 0;
+
+        switch (d.op) {
+        case OP_J:
+        case OP_JAL:
+            stalls_[STALL_JUMP] += 1;
+            break;
+        case OP_JR:
+            stalls_[STALL_JUMP] += 2;
+            break;
+        case OP_JEQ:
+            if (regs[d.srcA] == regs[d.srcB])
+                stalls_[STALL_BRANCH] += 2;
+            break;
+        case OP_LW:
+        case OP_SW:
+            stalls_[STALL_MEMORY] += memory_cycles - 1;
+            break;
+        default:
+            break;
+        }
     }
-    return imm; 
+
+    unsigned long long instructions() const { return instructions_; }
+    unsigned long long stalls(StallCause cause) const { return stalls_[cause]; }
+
+    unsigned long long cycles() const {
+        if (instructions_ == 0)
+            return 0;
+        unsigned long long total = instructions_ + PIPELINE_DEPTH - 1;
+        for (unsigned long long stall : stalls_)
+            total += stall;
+        return total;
+    }
+
+    /*
+        Prints the cycle count, CPI and stall breakdown.
+    */
+    void print(ostream &out) const {
+        out << "Cycles: " << cycles() << " (" << instructions_ << " instructions, CPI "
+            << fixed << setprecision(3) << (instructions_ ? (double)cycles() / instructions_ : 0.0)
+            << defaultfloat << ")" << endl;
+        out << "Stalls:";
+        for (int cause = 0; cause < NUM_STALL_CAUSES; cause++)
+            out << (cause ? ", " : " ") << STALL_CAUSE_NAMES[cause] << " " << stalls_[cause];
+        out << endl;
+    }
+
+private:
+    static constexpr unsigned PIPELINE_DEPTH = 5;
+
+    /*
+        @return Whether d needs register reg in EX
+    */
+    static bool reads_in_ex(DecodedInstr const &d, unsigned reg) {
+        switch (d.op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_OR:
+        case OP_AND:
+        case OP_SLT:
+        case OP_JEQ:
+            return d.srcA == reg || d.srcB == reg;
+        case OP_JR:
+        case OP_SLTI:
+        case OP_LW:
+        case OP_SW:
+        case OP_ADDI:
+            return d.srcA == reg;
+        default:
+            return false;
+        }
+    }
+
+    unsigned long long instructions_ = 0;
+    unsigned long long stalls_[NUM_STALL_CAUSES] = {};
+    // Destination of the previous instruction if it was a lw, else 0
+    // (a lw to $0 decodes to a nop).
+    unsigned load_dst_ = 0;
+};
+
+/*
+    Parses a --latency argument: the cycles an access that is served by
+    L1, L2, ... and by memory spends in MEM, comma-separated.
+
+    @param text The argument
+    @param count Number of values expected: the cache levels plus one
+    @param latencies Receives the values
+    @return false if the text is malformed or has the wrong length
+*/
+bool parse_latencies(string const &text, size_t count, vector<unsigned> &latencies) {
+    latencies.clear();
+    size_t start = 0;
+    while (true) {
+        size_t comma = text.find(',', start);
+        string part = text.substr(start, comma == string::npos ? string::npos : comma - start);
+        char *end;
+        unsigned long value = strtoul(part.c_str(), &end, 10);
+        if (part.empty() || *end != '\0' || value < 1 || value > 1000000)
+            return false;
+        latencies.push_back(value);
+        if (comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    return latencies.size() == count;
 }
 
+#ifdef E20_JIT
+
 /*
-    Main function
-    Takes command-line args as documented below
+    Machine state shared between the JIT dispatcher and translated
+    code. Translated code addresses it through rbx.
 */
-int main(int argc, char *argv[]) {
+struct JitState {
+    unsigned short regs[NUM_REGS];
+    unsigned long long count;
+    unsigned short smc_addr;
+};
+
+/*
+    Flags or-ed into the pc returned by translated code.
+    JIT_HALT: the block ended in a halt.
+    JIT_SMC: a sw wrote into translated code; JitState::smc_addr holds
+    the address written.
+*/
+unsigned const static JIT_HALT = 1<<16;
+unsigned const static JIT_SMC = 1<<17;
 
-    //In command line, main takes the .bin file you add after the program 
-    char *filename = nullptr;
+size_t const static JIT_CODE_SIZE = 1<<22;
+size_t const static JIT_MAX_BLOCK = 64;
+size_t const static JIT_MAX_BLOCK_BYTES = JIT_MAX_BLOCK * 64;
+
+/*
+    Translates E20 basic blocks into x86-64 machine code and runs them.
+
+    A block runs until the first j, jal, jr or jeq (or JIT_MAX_BLOCK
+    instructions). Exits with a known target are patched to jump
+    straight into the target block once it has been translated; jr
+    looks its target up in the block table. E20 registers live in
+    JitState, memory is addressed through r12, the per-word
+    "is translated code" map through r13 and the block table through
+    r14.
+
+    A sw into translated code leaves the block, after which all
+    translations are dropped and the written word is only ever run by
+    the interpreter from then on.
+*/
+class Jit {
+public:
+    Jit();
+    ~Jit();
+
+    bool available() const { return code != nullptr; }
+
+    unsigned long long run(unsigned short &pc_inout, unsigned short regs_inout[], unsigned short memory[]);
+
+private:
+    typedef unsigned (*Entry)(JitState *, unsigned short *, unsigned char const *, unsigned char * const *, unsigned char *);
+
+    unsigned char *code;
+    unsigned char *cur;
+    unsigned char *epilogue;
+    unsigned char *first_block;
+    Entry entry;
+
+    vector<unsigned char *> blocks;
+    vector<unsigned char> code_map;
+    vector<unsigned char> self_modified;
+    vector<vector<unsigned char *>> pending;
+
+    void emit(std::initializer_list<unsigned char> bytes) {
+        for (unsigned char b : bytes)
+            *cur++ = b;
+    }
+    void emit16(unsigned v) {
+        emit({(unsigned char)v, (unsigned char)(v>>8)});
+    }
+    void emit32(unsigned v) {
+        emit({(unsigned char)v, (unsigned char)(v>>8), (unsigned char)(v>>16), (unsigned char)(v>>24)});
+    }
+    static void link(unsigned char *rel, unsigned char *target) {
+        int disp = (int)(target - (rel + 4));
+        memcpy(rel, &disp, 4);
+    }
+    unsigned char *emit_jump(unsigned char *target) {
+        emit({0xE9});
+        unsigned char *rel = cur;
+        emit32(0);
+        link(rel, target);
+        return rel;
+    }
+
+    // eax = zero-extended register value
+    void load_reg(unsigned reg) {
+        emit({0x0F, 0xB7, 0x43, (unsigned char)(2*reg)});
+    }
+    // register = ax or cx
+    void store_reg(unsigned reg, bool from_cx) {
+        emit({0x66, 0x89, (unsigned char)(from_cx ? 0x4B : 0x43), (unsigned char)(2*reg)});
+    }
+    // eax = (register + imm) % MEM_SIZE
+    void load_address(unsigned reg, unsigned short imm) {
+        load_reg(reg);
+        emit({0x05});
+        emit32(imm);
+        emit({0x25});
+        emit32(MEM_SIZE - 1);
+    }
+
+    void emit_exit(unsigned target, vector<pair<unsigned char *, unsigned>> &exits);
+    unsigned char *translate(unsigned pc, unsigned short memory[]);
+    void flush();
+};
+
+Jit::Jit() : code(nullptr), cur(nullptr), epilogue(nullptr), first_block(nullptr), entry(nullptr),
+        blocks(MEM_SIZE, nullptr), code_map(MEM_SIZE, 0), self_modified(MEM_SIZE, 0), pending(MEM_SIZE) {
+    void *mem = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return;
+    code = cur = static_cast<unsigned char *>(mem);
+
+    // unsigned entry(JitState *rdi, unsigned short *rsi, unsigned char const *rdx,
+    //                unsigned char * const *rcx, unsigned char *r8)
+    entry = reinterpret_cast<Entry>(cur);
+    emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56});   // push rbx, r12, r13, r14
+    emit({0x48, 0x89, 0xFB});                           // mov rbx, rdi
+    emit({0x49, 0x89, 0xF4});                           // mov r12, rsi
+    emit({0x49, 0x89, 0xD5});                           // mov r13, rdx
+    emit({0x49, 0x89, 0xCE});                           // mov r14, rcx
+    emit({0x41, 0xFF, 0xE0});                           // jmp r8
+
+    epilogue = cur;
+    emit({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B});   // pop r14, r13, r12, rbx
+    emit({0xC3});                                       // ret
+    first_block = cur;
+}
+
+Jit::~Jit() {
+    if (code)
+        munmap(code, JIT_CODE_SIZE);
+}
+
+/*
+    Drops every translated block.
+*/
+void Jit::flush() {
+    fill(blocks.begin(), blocks.end(), nullptr);
+    fill(code_map.begin(), code_map.end(), 0);
+    for (auto &sites : pending)
+        sites.clear();
+    cur = first_block;
+}
+
+/*
+    Emits an exit to a statically known pc: eax = target, then a jump
+    that starts out pointing at the epilogue and is later patched to
+    the target block.
+*/
+void Jit::emit_exit(unsigned target, vector<pair<unsigned char *, unsigned>> &exits) {
+    emit({0xB8});                                       // mov eax, target
+    emit32(target);
+    exits.push_back(make_pair(emit_jump(epilogue), target));
+}
+
+/*
+    Translates the basic block starting at pc and links it with the
+    blocks already translated.
+
+    @param pc Address of the first instruction of the block
+    @param memory The memory holding the program
+    @return The entry point of the new block
+*/
+unsigned char *Jit::translate(unsigned pc, unsigned short memory[]) {
+    struct SmcCheck {
+        unsigned char *rel;
+        unsigned next_pc;
+        size_t index;
+    };
+    vector<pair<unsigned char *, unsigned>> exits;
+    vector<SmcCheck> smc_checks;
+    unsigned char *start = cur;
+
+    emit({0x48, 0x81, 0x43, (unsigned char)offsetof(JitState, count)});   // add qword [rbx+count], n
+    unsigned char *count_imm = cur;
+    emit32(0);
+
+    unsigned addr = pc;
+    size_t n = 0;
+    bool ended = false;
+    while (!ended){
+        DecodedInstr d = decode_instruction(memory[addr], addr);
+        code_map[addr] = 1;
+        n++;
+        switch (d.op){
+        case OP_UNDECODED:
+        case OP_NOP:
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_OR:
+        case OP_AND: {
+            static unsigned char const alu_opcodes[] = {0x03, 0x2B, 0x0B, 0x23};
+            load_reg(d.srcA);
+            emit({0x66, alu_opcodes[d.op - OP_ADD], 0x43, (unsigned char)(2*d.srcB)});   // op ax, [srcB]
+            store_reg(d.dst, false);
+            break;
+        }
+        case OP_SLT:
+            load_reg(d.srcA);
+            emit({0x31, 0xC9});                                         // xor ecx, ecx
+            emit({0x66, 0x3B, 0x43, (unsigned char)(2*d.srcB)});        // cmp ax, [srcB]
+            emit({0x0F, 0x92, 0xC1});                                   // setb cl
+            store_reg(d.dst, true);
+            break;
+        case OP_SLTI:
+            load_reg(d.srcA);
+            emit({0x31, 0xC9});                                         // xor ecx, ecx
+            emit({0x66, 0x3D});                                         // cmp ax, imm
+            emit16(d.imm);
+            emit({0x0F, 0x92, 0xC1});                                   // setb cl
+            store_reg(d.dst, true);
+            break;
+        case OP_ADDI:
+            load_reg(d.srcA);
+            emit({0x66, 0x05});                                         // add ax, imm
+            emit16(d.imm);
+            store_reg(d.dst, false);
+            break;
+        case OP_LW:
+            load_address(d.srcA, d.imm);
+            emit({0x41, 0x0F, 0xB7, 0x04, 0x44});                       // movzx eax, word [r12+rax*2]
+            store_reg(d.dst, false);
+            break;
+        case OP_SW:
+            load_address(d.srcA, d.imm);
+            emit({0x0F, 0xB7, 0x4B, (unsigned char)(2*d.srcB)});        // movzx ecx, word [srcB]
+            emit({0x66, 0x41, 0x89, 0x0C, 0x44});                       // mov [r12+rax*2], cx
+            emit({0x41, 0x80, 0x7C, 0x05, 0x00, 0x00});                 // cmp byte [r13+rax], 0
+            emit({0x0F, 0x85});                                         // jne smc exit
+            smc_checks.push_back(SmcCheck{cur, (addr + 1) % (unsigned)MEM_SIZE, n});
+            emit32(0);
+            break;
+        case OP_JR:
+            load_reg(d.srcA);
+            emit({0x25});                                               // and eax, MEM_SIZE-1
+            emit32(MEM_SIZE - 1);
+            emit({0x49, 0x8B, 0x0C, 0xC6});                             // mov rcx, [r14+rax*8]
+            emit({0x48, 0x85, 0xC9});                                   // test rcx, rcx
+            emit({0x0F, 0x84});                                         // jz epilogue
+            emit32(0);
+            link(cur - 4, epilogue);
+            emit({0xFF, 0xE1});                                         // jmp rcx
+            ended = true;
+            break;
+        case OP_JEQ:
+            load_reg(d.srcA);
+            emit({0x66, 0x3B, 0x43, (unsigned char)(2*d.srcB)});        // cmp ax, [srcB]
+            emit({0x75, 0x0A});                                         // jne over the taken exit
+            emit_exit(d.imm, exits);
+            emit_exit((addr + 1) % MEM_SIZE, exits);
+            ended = true;
+            break;
+        case OP_J:
+            emit_exit(d.imm, exits);
+            ended = true;
+            break;
+        case OP_JAL:
+            emit({0x66, 0xC7, 0x43, 2*7});                              // mov word [$7], pc+1
+            emit16(addr + 1);
+            emit_exit(d.imm, exits);
+            ended = true;
+            break;
+        case OP_HALT:
+            emit({0xB8});                                               // mov eax, pc | JIT_HALT
+            emit32(addr | JIT_HALT);
+            emit_jump(epilogue);
+            ended = true;
+            break;
+        }
+        if (!ended){
+            addr++;
+            if (n == JIT_MAX_BLOCK || addr == MEM_SIZE || self_modified[addr]){
+                emit_exit(addr % MEM_SIZE, exits);
+                ended = true;
+            }
+        }
+    }
+    unsigned count = n;
+    memcpy(count_imm, &count, 4);
+
+    // Out-of-line exits for stores that hit translated code. The block
+    // charged all n instructions up front, so give back the ones after
+    // the store.
+    for (SmcCheck const &check : smc_checks){
+        link(check.rel, cur);
+        emit({0x66, 0x89, 0x43, (unsigned char)offsetof(JitState, smc_addr)});   // mov [smc_addr], ax
+        emit({0x48, 0x81, 0x6B, (unsigned char)offsetof(JitState, count)});      // sub qword [count], n-index
+        emit32(n - check.index);
+        emit({0xB8});                                                           // mov eax, next | JIT_SMC
+        emit32(check.next_pc | JIT_SMC);
+        emit_jump(epilogue);
+    }
+
+    blocks[pc] = start;
+    for (auto const &exit : exits){
+        if (blocks[exit.second])
+            link(exit.first, blocks[exit.second]);
+        else
+            pending[exit.second].push_back(exit.first);
+    }
+    for (unsigned char *rel : pending[pc])
+        link(rel, start);
+    pending[pc].clear();
+    return start;
+}
+
+/*
+    Runs the program in memory until it halts, using translated blocks
+    where possible.
+
+    @param pc_inout The program counter, updated in place
+    @param regs_inout The registers, updated in place
+    @param memory The memory, updated in place
+    @return The number of instructions executed, including the final halt
+*/
+unsigned long long Jit::run(unsigned short &pc_inout, unsigned short regs_inout[], unsigned short memory[]) {
+    JitState state;
+    copy(regs_inout, regs_inout + NUM_REGS, state.regs);
+    state.count = 0;
+    state.smc_addr = 0;
+    vector<DecodedInstr> decoded(MEM_SIZE, DecodedInstr{OP_UNDECODED, 0, 0, 0, 0});
+    unsigned pc = pc_inout % MEM_SIZE;
+
+    while (true){
+        if (self_modified[pc]){
+            DecodedInstr d = decode_instruction(memory[pc], pc);
+            unsigned address = (state.regs[d.srcA] + d.imm) % MEM_SIZE;
+            state.count++;
+            if (!execute_instruction(d, pc, state.regs, memory, decoded.data()))
+                break;
+            if (d.op == OP_SW && code_map[address]){
+                self_modified[address] = 1;
+                flush();
+            }
+            continue;
+        }
+        unsigned char *block = blocks[pc];
+        if (!block){
+            if (cur + JIT_MAX_BLOCK_BYTES > code + JIT_CODE_SIZE)
+                flush();
+            block = translate(pc, memory);
+        }
+        unsigned result = entry(&state, memory, code_map.data(), blocks.data(), block);
+        pc = result & 0xffff;
+        if (result & JIT_HALT)
+            break;
+        if (result & JIT_SMC){
+            self_modified[state.smc_addr] = 1;
+            flush();
+        }
+    }
+    copy(state.regs, state.regs + NUM_REGS, regs_inout);
+    pc_inout = pc;
+    return state.count;
+}
+
+#endif
+
+/*
+    Runs several programs to completion in lock step (see
+    E20_Lockstep.h), Lockstep::LANES at a time, and prints each one's
+    final state after a "==> filename" line.
+
+    @param filenames The programs, in output order
+    @param use_image_cache As for --image-cache
+    @param do_stats Whether to print instruction counts to err
+    @return The exit status of the run
+*/
+int run_lockstep(vector<string> const &filenames, bool use_image_cache, bool do_stats, ostream &out, ostream &err) {
+    vector<Machine> machines(filenames.size());
+    try {
+        for (size_t i = 0; i < filenames.size(); i++)
+            if (!machines[i].load(filenames[i], use_image_cache))
+                err << "Can't write program image " << program_image_name(filenames[i]) << endl;
+    } catch (LoadError const &e) {
+        err << e.what() << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    unsigned long long count = 0;
+    unsigned long long steps = 0;
+    for (size_t first = 0; first < machines.size(); first += Lockstep::LANES) {
+        size_t lanes = min(Lockstep::LANES, machines.size() - first);
+        Lockstep group;
+        for (size_t lane = 0; lane < lanes; lane++)
+            group.load(lane, machines[first + lane]);
+        steps += group.run();
+        Checkpoint state;
+        for (size_t lane = 0; lane < lanes; lane++) {
+            group.save(lane, state);
+            machines[first + lane].restore(state);
+            count += group.instructions(lane);
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    for (size_t i = 0; i < machines.size(); i++) {
+        out << "==> " << filenames[i] << endl;
+        print_state(out, machines[i].pc(), machines[i].registers(), machines[i].memory(), 128);
+    }
+    if (do_stats)
+        err << "Executed " << count << " instructions in " << steps << " lock steps, " << elapsed.count() <<
+            " s (" << count / elapsed.count() << " instructions/s)" << endl;
+    return 0;
+}
+
+/*
+    Runs one simulation.
+
+    @param progname The name to show in the usage message
+    @param args The command-line arguments, without the program name
+    @param out Where the final state goes
+    @param err Where the usage message, errors and statistics go
+    @return The exit status of the run
+*/
+int simulate(string const &progname, vector<string> const &args, ostream &out, ostream &err) {
+    string filename;
+    vector<string> lockstep_files;
+    bool do_lockstep = false;
     bool do_help = false;
     bool arg_error = false;
-    for (int i=1; i<argc; i++) {
-        string arg(argv[i]);
+    bool use_image_cache = false;
+    bool do_stats = false;
+    bool do_jit = false;
+    bool do_timing = false;
+    bool loop_skip = true;
+    bool detect_loops = false;
+    unsigned long long max_instructions = 0;
+    string cache_config;
+    string latency_config;
+    string write_policy;
+    ReplacementPolicy policy = POLICY_LRU;
+    Inclusion inclusion = NON_INCLUSIVE;
+    unsigned long long checkpoint_at = 0;
+    string checkpoint_file = "e20.ckpt";
+    string restore_file;
+    string emit_file;
+    for (size_t i=0; i<args.size(); i++) {
+        string const &arg = args[i];
         if (arg.rfind("-",0)==0) {
             if (arg== "-h" || arg == "--help")
                 do_help = true;
+            else if (arg == "--image-cache")
+                use_image_cache = true;
+            else if (arg == "--stats")
+                do_stats = true;
+            else if (arg == "--jit")
+                do_jit = true;
+            else if (arg == "--timing")
+                do_timing = true;
+            else if (arg == "--no-loop-skip")
+                loop_skip = false;
+            else if (arg == "--detect-loops")
+                detect_loops = true;
+            else if (arg == "--lockstep")
+                do_lockstep = true;
+            else if (arg=="--cache" || arg=="--latency" || arg=="--write-policy") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    (arg=="--cache" ? cache_config : arg=="--latency" ? latency_config : write_policy) = args[i];
+            }
+            else if (arg=="--checkpoint-file" || arg=="--restore" || arg=="--emit-bin") {
+                i++;
+                if (i>=args.size())
+                    arg_error = true;
+                else
+                    (arg=="--restore" ? restore_file : arg=="--emit-bin" ? emit_file : checkpoint_file) = args[i];
+            }
+            else if (arg=="--checkpoint-at" || arg=="--max-instructions") {
+                i++;
+                char *end;
+                if (i>=args.size())
+                    arg_error = true;
+                else {
+                    unsigned long long &n = arg=="--checkpoint-at" ? checkpoint_at : max_instructions;
+                    n = strtoull(args[i].c_str(), &end, 10);
+                    if (*end != '\0' || args[i].empty() || n == 0)
+                        arg_error = true;
+                }
+            }
+            else if (arg=="--policy") {
+                i++;
+                if (i>=args.size() || !parse_replacement_policy(args[i], policy))
+                    arg_error = true;
+            }
+            else if (arg=="--inclusion") {
+                i++;
+                if (i>=args.size() || !parse_inclusion(args[i], inclusion))
+                    arg_error = true;
+            }
             else
                 arg_error = true;
         } else {
-            if (filename == nullptr)
-                filename = argv[i];
-            else
-                arg_error = true;
+            lockstep_files.push_back(arg);
+            if (filename.empty())
+                filename = arg;
         }
     }
 
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] filename" << endl << endl;
-        cerr << "Simulate E20 machine" << endl << endl;
-        cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
-        cerr << "optional arguments:"<<endl;
-        cerr << "  -h, --help  show this help message and exit"<<endl;
+    bool cache_options = !cache_config.empty() || !latency_config.empty() || !write_policy.empty() ||
+        policy != POLICY_LRU || inclusion != NON_INCLUSIVE;
+    bool restoring = !restore_file.empty();
+    bool checkpointing = checkpoint_at > 0;
+    if (!do_lockstep && lockstep_files.size() > 1)
+        arg_error = true;
+    if (do_lockstep && (restoring || checkpointing || do_timing || do_jit || cache_options || !emit_file.empty() ||
+                        max_instructions > 0 || detect_loops))
+        arg_error = true;
+    if (!emit_file.empty() && !is_assembly_source(filename))
+        arg_error = true;
+    if (arg_error || do_help || filename.empty() == !restoring || (cache_options && !do_timing) ||
+            (checkpointing && do_timing)) {
+        err << "usage " << progname << " [-h] [--image-cache] [--stats] [--jit] [--no-loop-skip]" << endl;
+        err << "       [--max-instructions N] [--detect-loops]" << endl;
+        err << "       [--batch MANIFEST] [--batch-dir DIR] [--jobs N] [--timing [--cache CACHE] [--latency LATENCY]" << endl;
+        err << "       [--policy POLICY] [--inclusion INCLUSION] [--write-policy WRITE_POLICY]]" << endl;
+        err << "       [--checkpoint-at N [--checkpoint-file FILE]] [--emit-bin FILE]" << endl;
+        err << "       (filename | --restore FILE)" << endl;
+        err << "       " << progname << " [--image-cache] [--stats] --lockstep filename..." << endl << endl;
+        err << "Simulate E20 machine" << endl << endl;
+        err << "positional arguments:" << endl;
+        err << "  filename    The file containing machine code, typically with .bin suffix," << endl;
+        err << "              a binary program image, or assembly source with .s suffix" << endl<<endl;
+        err << "optional arguments:"<<endl;
+        err << "  -h, --help  show this help message and exit"<<endl;
+        err << "  --image-cache  load the program from filename.img when it is up to"<<endl;
+        err << "                 date, and write that binary image otherwise"<<endl;
+        err << "  --emit-bin FILE  also write the assembled .s program to FILE as machine"<<endl;
+        err << "                 code, in the .bin format"<<endl;
+        err << "  --stats     print the instruction count and instructions/s to stderr"<<endl;
+        err << "  --jit       translate the program to native code instead of interpreting it"<<endl;
+        err << "  --no-loop-skip  execute counted loops instruction by instruction instead"<<endl;
+        err << "                 of jumping to their exit state (for verification)"<<endl;
+        err << "  --max-instructions N  stop after N instructions if the program hasn't"<<endl;
+        err << "                 halted, print the state and exit with status "<<EXIT_INSTRUCTION_LIMIT<<endl;
+        err << "  --detect-loops  stop as soon as the program comes back to an earlier state"<<endl;
+        err << "                 (pc, registers and memory), which means it will never halt,"<<endl;
+        err << "                 print the state and exit with status "<<EXIT_NEVER_HALTS<<endl;
+        err << "  --timing    model a five-stage pipeline and print the cycle count, CPI"<<endl;
+        err << "                 and stalls by cause to stderr"<<endl;
+        err << "  --cache CACHE  with --timing, take the latency of lw and sw from this cache"<<endl;
+        err << "                 hierarchy (as for E20_Cache) instead of a one-cycle memory"<<endl;
+        err << "  --latency LATENCY  cycles of an access served by L1, L2, ... and memory,"<<endl;
+        err << "                 comma-separated (default: 1 for L1, 10 per level below,"<<endl;
+        err << "                 100 for memory)"<<endl;
+        err << "  --policy, --inclusion, --write-policy  configure the --cache hierarchy"<<endl;
+        err << "                 as for E20_Cache"<<endl;
+        err << "  --checkpoint-at N  after N instructions, save the machine state to the"<<endl;
+        err << "                 checkpoint file, then go on (not with --timing)"<<endl;
+        err << "  --checkpoint-file FILE  where --checkpoint-at writes (default: e20.ckpt)"<<endl;
+        err << "  --restore FILE  resume from the checkpoint FILE instead of running a"<<endl;
+        err << "                 program from the start"<<endl;
+        err << "  --batch MANIFEST  run every simulation listed in MANIFEST (one program"<<endl;
+        err << "                 and its options per line) in-process, instead of filename"<<endl;
+        err << "  --batch-dir DIR  write job N's output to DIR/N.out instead of a merged"<<endl;
+        err << "                 report on stdout"<<endl;
+        err << "  --jobs N    number of worker threads for --batch (default: all cores)"<<endl;
+        err << "  --lockstep  run every filename given, up to "<<Lockstep::LANES<<" at a time in the lanes"<<endl;
+        err << "                 of SIMD registers, and print each one's final state"<<endl;
         return 1;
     }
 
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file "<<filename<<endl;
+    if (do_lockstep)
+        return run_lockstep(lockstep_files, use_image_cache, do_stats, out, err);
+
+    Machine machine;
+    machine.set_loop_skipping(loop_skip);
+    machine.set_loop_detection(detect_loops);
+    try {
+        if (restoring) {
+            //Cache state in the checkpoint is for E20_Cache only
+            Checkpoint restored;
+            read_checkpoint(restore_file, restored);
+            machine.restore(restored);
+        }
+        else {
+            if (!emit_file.empty())
+                emit_machine_code(filename, emit_file);
+            if (!machine.load(filename, use_image_cache))
+                err << "Can't write program image " << program_image_name(filename) << endl;
+        }
+    } catch (LoadError const &e) {
+        err << e.what() << endl;
+        return 1;
+    }
+    unsigned long long executed = machine.instructions();
+    if (checkpointing && checkpoint_at <= executed) {
+        err << "The checkpoint must come after instruction " << executed << " of the restored run" << endl;
         return 1;
     }
+    //--max-instructions counts from the start of this run
+    unsigned long long limit = numeric_limits<unsigned long long>::max();
+    if (max_instructions > 0 && max_instructions < limit - executed)
+        limit = executed + max_instructions;
 
-    
-    unsigned short memory[8192] = {0}; 
-    unsigned short pc = 0; 
-    unsigned short registers[8] = {0}; 
-    
-    load_machine_code(f, memory); 
-
-    unsigned short dst; 
-    unsigned short srcA; 
-    unsigned short srcB; 
-    unsigned short imm; 
-    unsigned short opcode; 
-    bool halt = false; 
-
-    while (!halt){ 
-        unsigned short curr_instruction = memory[pc]; 
-        opcode = curr_instruction>>13;  
-        if (opcode == 0){
-            srcA = curr_instruction>>10 & 7;
-            srcB = curr_instruction>>7 & 7; 
-            dst = curr_instruction>>4 & 7;
-            if (dst != 0){ //the following directions all modify the dst register
-                if ((curr_instruction & 15) == 0){
-                    unsigned short result = registers[srcA] + registers[srcB]; 
-                    registers[dst] = result;  
-                    pc += 1; 
-                    //add
-                }
-                else if ((curr_instruction & 15) == 1){
-                    unsigned short result = registers[srcA] - registers[srcB]; 
-                    registers[dst] = result; 
-                    pc += 1; 
-                    //sub
-                }
-                else if ((curr_instruction & 15) == 2){
-                    unsigned short result = registers[srcA] | registers[srcB]; 
-                    registers[dst] = result; 
-                    pc += 1; 
-                    //or
-                }
-                else if ((curr_instruction & 15) == 3){
-                    unsigned short result = registers[srcA] & registers[srcB]; 
-                    registers[dst] = result; 
-                    pc += 1; 
-                    //and 
-                }
-                else if ((curr_instruction & 15) == 4){
-                    if (registers[srcA] < registers[srcB]){
-                        registers[dst] = 1; 
-                    }
-                    else{
-                        registers[dst] = 0; 
-                    }
-                    pc += 1; 
-                    //slt
-                }
-            }
-            if ((curr_instruction & 15) == 8){
-                pc = registers[srcA];
-                //jr 
-            }
+    vector<CacheLevelConfig> levels;
+    vector<WritePolicy> write_policies;
+    vector<unsigned> latencies;
+    if (do_timing) {
+        if (!cache_config.empty() && !parse_cache_levels(cache_config, levels)) {
+            err << "Invalid cache config" << endl;
+            return 1;
         }
-        else if (opcode == 7){
-            srcA = curr_instruction>>10 & 7;
-            dst = curr_instruction>>7 & 7; 
-            imm = signExtender7B(curr_instruction & 127);  
-            if (dst != 0){
-                if (registers[srcA] < imm){
-                    registers[dst] = 1; 
-                }
-                else{
-                    registers[dst] = 0; 
-                }
-            }
-            pc += 1; 
-            //slti
+        if (!write_policy.empty() && !parse_write_policies(write_policy, levels.size(), write_policies)) {
+            err << "Invalid write policy" << endl;
+            return 1;
         }
-        else if (opcode == 4){
-            srcA = curr_instruction>>10 & 7;
-            dst = curr_instruction>>7 & 7; 
-            imm = signExtender7B(curr_instruction & 127); 
-            if (dst != 0){
-                unsigned short result = registers[srcA] + imm;
-                registers[dst] = memory[result]; 
-            }
-            pc += 1; 
-            //lw
+        if (inclusion == EXCLUSIVE)
+            for (size_t i = 0; i < levels.size(); i++)
+                if (levels[i].blocksize != levels[0].blocksize ||
+                        (!write_policies.empty() && !write_policies[i].write_allocate)) {
+                    err << "Exclusive caches need the same blocksize and write-allocate at every level" << endl;
+                    return 1;
+                }
+        if (latency_config.empty()) {
+            for (size_t i = 0; i < levels.size(); i++)
+                latencies.push_back(i == 0 ? 1 : 10 * i);
+            latencies.push_back(levels.empty() ? 1 : 100);
         }
-        else if (opcode == 5){
-            srcA = curr_instruction>>10 & 7;
-            srcB = curr_instruction>>7 & 7; 
-            imm = signExtender7B(curr_instruction & 127); 
-            unsigned short address = registers[srcA] + imm; 
-            memory[address] = registers[srcB]; 
-            pc += 1; 
-            //sw 
+        else if (!parse_latencies(latency_config, levels.size() + 1, latencies)) {
+            err << "Invalid latency list" << endl;
+            return 1;
         }
-        else if (opcode == 6){
-            srcA = curr_instruction>>10 & 7;
-            srcB = curr_instruction>>7 & 7; 
-            imm = signExtender7B(curr_instruction & 127); 
-            if (registers[srcA] == registers[srcB]){
-                pc += imm;  
-            }
-            pc += 1; 
-            //jeq 
+        if (do_jit) {
+            err << "--timing runs on the interpreter, ignoring --jit" << endl;
+            do_jit = false;
         }
-        else if (opcode == 1){
-            srcA = curr_instruction>>10 & 7; 
-            dst = curr_instruction>>7 & 7;  
-            imm = signExtender7B(curr_instruction & 127); 
-            if (dst != 0){
-                unsigned short result = registers[srcA] + imm;
-                registers[dst] = result; 
-            }
-            pc += 1; 
-            //addi
+    }
+    if (do_jit && (max_instructions > 0 || detect_loops)) {
+        err << "--max-instructions and --detect-loops run on the interpreter, ignoring --jit" << endl;
+        do_jit = false;
+    }
+
+    auto start = chrono::steady_clock::now();
+    unsigned long long count = 0;
+    bool done = false;
+    int status = 0;
+    if (checkpointing) {
+        count = machine.run(min(checkpoint_at, limit) - executed);
+        if (machine.halted()) {
+            err << "The program ended after " << machine.instructions() << " instructions, before the checkpoint" << endl;
+            status = 1;
+            done = true;
         }
-        else if (opcode == 2){
-            imm = curr_instruction & 8191;
-            if (pc == imm){
-                halt = true; 
+        else if (machine.looping() || machine.instructions() < checkpoint_at)
+            done = true;
+        else {
+            Checkpoint checkpoint;
+            machine.save(checkpoint);
+            if (!write_checkpoint(checkpoint_file, checkpoint)) {
+                err << "Can't write checkpoint file " << checkpoint_file << endl;
+                return 1;
             }
-            else{
-                pc = imm;
-            } 
-            //j
         }
-        else if (opcode == 3){
-            imm = curr_instruction & 8191;
-            registers[7] = pc+1; 
-            pc = imm; 
-            //jal
+    }
+    PipelineTiming timing;
+    if (do_timing) {
+        //Stores drain through a write buffer and only wait for L1,
+        //unless a write-back L1 has to fetch the block first
+        bool store_fetches = !write_policies.empty() && write_policies[0].write_back && write_policies[0].write_allocate;
+        with_cache_hierarchy(policy, inclusion, [&](auto hierarchy_tag) {
+            typename decltype(hierarchy_tag)::type caches(levels, 1, write_policies);
+            auto ignore = [](size_t, CacheEvent, int, unsigned) {};
+            count += machine.trace(limit - machine.instructions(),
+                                   [&](DecodedInstr const &d, unsigned, unsigned short const regs[]) {
+                unsigned cycles = latencies[0];
+                if (d.op == OP_LW || d.op == OP_SW) {
+                    unsigned address = (regs[d.srcA] + d.imm) % MEM_SIZE;
+                    size_t served = 0;
+                    int row;
+                    while (served < caches.depth() && !caches.level(served).contains(address, row))
+                        served++;
+                    if (d.op == OP_LW) {
+                        caches.load(address, ignore);
+                        cycles = latencies[served];
+                    } else {
+                        caches.store(address, ignore);
+                        if (store_fetches)
+                            cycles = latencies[served];
+                    }
+                }
+                timing.issue(d, regs, cycles);
+            });
+        });
+        done = true;
+    }
+#ifdef E20_JIT
+    if (do_jit && !done){
+        Jit jit;
+        if (jit.available()){
+            //The JIT runs on a copy of the machine state, and only
+            //returns once the program halts
+            Checkpoint state;
+            machine.save(state);
+            unsigned long long ran = jit.run(state.pc, state.registers, state.memory.data());
+            machine.resume(state, ran, true);
+            count += ran;
+            done = true;
         }
-        pc %= 8192; 
+        else
+            err << "Can't allocate executable memory, falling back to the interpreter" << endl;
     }
+#else
+    if (do_jit)
+        err << "--jit is only supported on x86-64, falling back to the interpreter" << endl;
+#endif
+    if (!done)
+        count += machine.run(limit - machine.instructions());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
 
-    print_state(pc, registers, memory, 128); 
+    print_state(out, machine.pc(), machine.registers(), machine.memory(), 128);
+    if (machine.looping()) {
+        err << "The program came back to an earlier state at pc " << machine.pc() << " after " <<
+            machine.instructions() << " instructions, so it will never halt" << endl;
+        status = EXIT_NEVER_HALTS;
+    }
+    else if (!machine.halted()) {
+        err << "Stopped after " << machine.instructions() << " instructions without halting" << endl;
+        status = EXIT_INSTRUCTION_LIMIT;
+    }
 
-    f.close(); 
+    if (do_timing)
+        timing.print(err);
+    if (do_stats)
+        err << "Executed " << count << " instructions in " << elapsed.count() <<
+            " s (" << count / elapsed.count() << " instructions/s)" << endl;
+    if (do_stats && machine.skipped() > 0)
+        err << "Skipped " << machine.skipped() << " of them in counted loops" << endl;
 
-    return 0;
+    return status;
+}
+
+/*
+    Main function
+    Takes command-line args as documented in simulate
+*/
+int main(int argc, char *argv[]) {
+    string progname = argv[0];
+    vector<string> args(argv + 1, argv + argc);
+    BatchOptions batch;
+    if (parse_batch_options(args, batch)) {
+        SimulateFn simulate_job = [&progname](vector<string> const &job_args, ostream &out, ostream &err) {
+            return simulate(progname, job_args, out, err);
+        };
+        return run_batch(batch, simulate_job, cout, cerr);
+    }
+    return simulate(progname, args, cout, cerr);
 }
@@ -0,0 +1,200 @@
+#ifndef E20_PROFILE_H
+#define E20_PROFILE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "E20_Hierarchy.h"
+#include "E20_Machine.h"
+
+/*
+    Per-pc profile of a run, for E20_Cache --profile.
+
+    Counters live in flat arrays indexed by pc (13 bits): instructions
+    executed, branches taken (a jeq that jumps, and every j, jal and
+    jr), and the lw hits and misses of every cache level the
+    instruction at that pc caused.
+
+    Calls are followed through jal and jr: a jal enters a frame named
+    after its target, and a jr to the return address of an open frame
+    leaves it (and any frames above it); any other jr is a jump within
+    the current frame. The frames form a tree of call chains, each
+    counting the instructions executed in it, which write_folded()
+    prints as folded stacks for flame graph tools:
+
+        main;fn_12;fn_12 1520
+
+    Calls nested deeper than MAX_DEPTH are counted in the deepest frame.
+*/
+class Profiler {
+public:
+    static constexpr size_t MAX_DEPTH = 256;
+
+    explicit Profiler(size_t levels = 0)
+            : levels_(levels), executed_(MEM_SIZE, 0), taken_(MEM_SIZE, 0),
+              cache_(MEM_SIZE * levels * 2, 0), frames_(1, Frame{0, 0, 0, {}}), frame_(0) {}
+
+    /*
+        Counts the instruction d at pc, called before it executes.
+    */
+    E20_ALWAYS_INLINE void instruction(DecodedInstr const &d, unsigned pc, unsigned short const regs[]) {
+        executed_[pc]++;
+        frames_[frame_].instructions++;
+        switch (d.op) {
+        case OP_JEQ:
+            taken_[pc] += regs[d.srcA] == regs[d.srcB];
+            break;
+        case OP_J:
+            taken_[pc]++;
+            break;
+        case OP_JAL:
+            taken_[pc]++;
+            call(d.imm, (pc + 1) % MEM_SIZE);
+            break;
+        case OP_JR:
+            taken_[pc]++;
+            jump_register(regs[d.srcA] % MEM_SIZE);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /*
+        Counts a cache event caused by the instruction at pc; only lw
+        hits and misses are kept.
+    */
+    void cache_event(unsigned pc, size_t level, CacheEvent event) {
+        if (event == EVENT_HIT || event == EVENT_MISS)
+            cache_[(pc * levels_ + level) * 2 + (event == EVENT_MISS)]++;
+    }
+
+    /*
+        Prints every pc that executed, most executed first, and, with
+        caches, every pc that missed in L1, most misses first.
+    */
+    void write_report(std::ostream &out) const {
+        unsigned long long instructions = 0, taken = 0, misses = 0;
+        std::vector<unsigned> pcs;
+        for (unsigned pc = 0; pc < MEM_SIZE; pc++) {
+            instructions += executed_[pc];
+            taken += taken_[pc];
+            if (levels_ > 0)
+                misses += level_count(pc, 0, true);
+            if (executed_[pc] > 0)
+                pcs.push_back(pc);
+        }
+        out << "Profile: " << instructions << " instructions, " << taken << " branches taken";
+        if (levels_ > 0)
+            out << ", " << misses << " L1 misses";
+        out << std::endl << std::endl << "Hot spots:" << std::endl;
+        std::stable_sort(pcs.begin(), pcs.end(), [&](unsigned a, unsigned b) { return executed_[a] > executed_[b]; });
+        write_table(out, pcs, instructions, misses);
+        if (levels_ == 0)
+            return;
+
+        pcs.erase(std::remove_if(pcs.begin(), pcs.end(), [&](unsigned pc) { return level_count(pc, 0, true) == 0; }),
+                  pcs.end());
+        std::stable_sort(pcs.begin(), pcs.end(), [&](unsigned a, unsigned b) {
+            return level_count(a, 0, true) > level_count(b, 0, true);
+        });
+        out << std::endl << "L1 misses:" << std::endl;
+        write_table(out, pcs, instructions, misses);
+    }
+
+    /*
+        Prints one "frame;frame;... instructions" line per call chain
+        that executed instructions, in the order the chains were first
+        entered.
+    */
+    void write_folded(std::ostream &out) const {
+        for (size_t i = 0; i < frames_.size(); i++) {
+            if (frames_[i].instructions == 0)
+                continue;
+            std::vector<size_t> chain;
+            for (size_t f = i; f != 0; f = frames_[f].parent)
+                chain.push_back(f);
+            out << "main";
+            for (size_t j = chain.size(); j-- > 0;)
+                out << ";fn_" << frames_[chain[j]].entry;
+            out << " " << frames_[i].instructions << "\n";
+        }
+    }
+
+private:
+    struct Frame {
+        unsigned short entry;
+        uint32_t parent;
+        unsigned long long instructions;
+        std::vector<std::pair<unsigned short, uint32_t>> children;   // entry, frame
+    };
+
+    struct OpenCall {
+        unsigned short return_pc;
+        uint32_t caller;
+    };
+
+    void call(unsigned short entry, unsigned short return_pc) {
+        if (calls_.size() == MAX_DEPTH)
+            return;
+        calls_.push_back(OpenCall{return_pc, frame_});
+        for (auto const &child : frames_[frame_].children)
+            if (child.first == entry) {
+                frame_ = child.second;
+                return;
+            }
+        uint32_t child = frames_.size();
+        frames_[frame_].children.push_back(std::make_pair(entry, child));
+        frames_.push_back(Frame{entry, frame_, 0, {}});
+        frame_ = child;
+    }
+
+    void jump_register(unsigned short target) {
+        for (size_t i = calls_.size(); i-- > 0;)
+            if (calls_[i].return_pc == target) {
+                frame_ = calls_[i].caller;
+                calls_.resize(i);
+                return;
+            }
+    }
+
+    unsigned long long level_count(unsigned pc, size_t level, bool miss) const {
+        return cache_[(pc * levels_ + level) * 2 + miss];
+    }
+
+    void write_table(std::ostream &out, std::vector<unsigned> const &pcs,
+                     unsigned long long instructions, unsigned long long misses) const {
+        out << "   pc  instructions       %       taken";
+        for (size_t level = 0; level < levels_; level++)
+            out << "     L" << level + 1 << " hits   L" << level + 1 << " misses";
+        if (levels_ > 0)
+            out << "  % L1 misses";
+        out << std::endl;
+        for (unsigned pc : pcs) {
+            out << std::setw(5) << pc << std::setw(14) << executed_[pc] << std::setw(8) << std::fixed
+                << std::setprecision(2) << 100.0 * executed_[pc] / instructions << std::setw(12) << taken_[pc];
+            for (size_t level = 0; level < levels_; level++)
+                out << std::setw(12) << level_count(pc, level, false) << std::setw(12) << level_count(pc, level, true);
+            if (levels_ > 0)
+                out << std::setw(13) << (misses ? 100.0 * level_count(pc, 0, true) / misses : 0.0);
+            out << std::endl;
+        }
+    }
+
+    size_t levels_;
+    std::vector<unsigned long long> executed_;
+    std::vector<unsigned long long> taken_;
+    // Hits and misses, pc after pc, level after level.
+    std::vector<unsigned long long> cache_;
+    // The call tree; frames_[0] is the outermost frame.
+    std::vector<Frame> frames_;
+    uint32_t frame_;
+    std::vector<OpenCall> calls_;
+};
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef E20_REPLACEMENT_H
+#define E20_REPLACEMENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+    Replacement policies for TagStore.
+
+    A policy keeps the replacement state of every set of one cache and
+    is a template parameter of TagStore, so each policy gets its own
+    specialized access path without virtual calls. Every policy has the
+    same interface:
+
+        Policy(int rows, int assoc, uint32_t seed);
+        void hit(size_t row, int way);    // way of row was accessed
+        int victim(size_t row);           // way of a full row to replace
+        void fill(size_t row, int way);   // way of row now holds a new block
+
+        template <typename Archive>
+        void transfer(Archive &a);        // save or restore the state
+
+    TagStore fills the invalid ways of a set before it asks for a
+    victim, so victim() is only called on full sets.
+*/
+
+/*
+    Small deterministic random number generator (xorshift32) for the
+    policies that make random choices.
+*/
+class PolicyRandom {
+public:
+    explicit PolicyRandom(uint32_t seed) : state_(seed ? seed : 1) {}
+
+    uint32_t next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    template <typename Archive>
+    void transfer(Archive &a) { a(state_); }
+
+private:
+    uint32_t state_;
+};
+
+/*
+    True LRU. Each way has a 16-bit age: the most recently used way has
+    age 0 and the ages in a set are always a permutation of
+    0..assoc-1, so the victim is the way with age assoc-1. Each set is
+    padded to a multiple of sixteen ages, and aging a set and finding
+    its victim compare sixteen (AVX2) or eight (SSE2) ways at a time.
+*/
+class LruPolicy {
+public:
+    LruPolicy(int rows, int assoc, uint32_t)
+            : assoc_(assoc), stride_((assoc + 15) & ~15), ages_((size_t)rows * stride_, int16_t(AGE_PADDING)) {
+        for (size_t row = 0; row < (size_t)rows; row++)
+            for (int way = 0; way < assoc; way++)
+                ages_[row * stride_ + way] = assoc - 1 - way;
+    }
+
+    void hit(size_t row, int way) { touch(row, way); }
+    void fill(size_t row, int way) { touch(row, way); }
+
+    template <typename Archive>
+    void transfer(Archive &a) { a(ages_); }
+
+    int victim(size_t row) const {
+        int16_t const *ages = &ages_[row * stride_];
+        int16_t lru = assoc_ - 1;
+#if defined(__AVX2__)
+        __m256i key = _mm256_set1_epi16(lru);
+        for (int way = 0; ; way += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(ages + way));
+            unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, key));
+            if (mask)
+                return way + __builtin_ctz(mask) / 2;
+        }
+#elif defined(__SSE2__)
+        __m128i key = _mm_set1_epi16(lru);
+        for (int way = 0; ; way += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(ages + way));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, key));
+            if (mask)
+                return way + __builtin_ctz(mask) / 2;
+        }
+#else
+        int way = 0;
+        while (ages[way] != lru)
+            way++;
+        return way;
+#endif
+    }
+
+private:
+    // Age of the padding ways: never younger than a real way, and
+    // never equal to assoc-1.
+    static constexpr int16_t AGE_PADDING = 0x7fff;
+
+    /*
+        Makes way the youngest of its set, aging every way that was
+        younger than it by one.
+    */
+    void touch(size_t row, int way) {
+        int16_t *ages = &ages_[row * stride_];
+        int16_t age = ages[way];
+        if (age == 0)
+            return;
+#if defined(__AVX2__)
+        __m256i limit = _mm256_set1_epi16(age);
+        for (int w = 0; w < stride_; w += 16) {
+            __m256i *p = reinterpret_cast<__m256i *>(ages + w);
+            __m256i v = _mm256_loadu_si256(p);
+            _mm256_storeu_si256(p, _mm256_sub_epi16(v, _mm256_cmpgt_epi16(limit, v)));
+        }
+#elif defined(__SSE2__)
+        __m128i limit = _mm_set1_epi16(age);
+        for (int w = 0; w < stride_; w += 8) {
+            __m128i *p = reinterpret_cast<__m128i *>(ages + w);
+            __m128i v = _mm_loadu_si128(p);
+            _mm_storeu_si128(p, _mm_sub_epi16(v, _mm_cmpgt_epi16(limit, v)));
+        }
+#else
+        for (int w = 0; w < assoc_; w++)
+            ages[w] += ages[w] < age;
+#endif
+        ages[way] = 0;
+    }
+
+    int assoc_;
+    int stride_;
+    std::vector<int16_t> ages_;
+};
+
+/*
+    Tree pseudo-LRU. Each set has a binary tree of assoc-1 direction
+    bits (rounded up to a power of two); an access points every bit on
+    its path away from the accessed way, and the victim is found by
+    following the bits from the root. Costs log2(assoc) steps however
+    large the set is, without data-dependent branches.
+*/
+class PlruPolicy {
+public:
+    PlruPolicy(int rows, int assoc, uint32_t) : leaves_(1) {
+        while (leaves_ < assoc)
+            leaves_ *= 2;
+        bits_.assign((size_t)rows * leaves_, 0);
+
+        // With a non-power-of-two associativity some right subtrees
+        // hold no real ways, and their bits must never point there.
+        can_go_right_.assign(leaves_, 0);
+        for (int node = 1; node < leaves_; node++) {
+            int first = 2 * node + 1;
+            while (first < leaves_)
+                first *= 2;
+            can_go_right_[node] = first - leaves_ < assoc;
+        }
+    }
+
+    void hit(size_t row, int way) { touch(row, way); }
+    void fill(size_t row, int way) { touch(row, way); }
+
+    template <typename Archive>
+    void transfer(Archive &a) { a(bits_); }
+
+    int victim(size_t row) const {
+        unsigned char const *bits = &bits_[row * leaves_];
+        int node = 1;
+        while (node < leaves_)
+            node = 2 * node + (bits[node] & can_go_right_[node]);
+        return node - leaves_;
+    }
+
+private:
+    void touch(size_t row, int way) {
+        unsigned char *bits = &bits_[row * leaves_];
+        for (unsigned node = leaves_ + way; node > 1; node /= 2)
+            bits[node / 2] = !(node & 1);
+    }
+
+    int leaves_;
+    // Node n of a set's tree is bits_[row * leaves_ + n], root at 1,
+    // and the leaves n >= leaves_ are the ways; a set bit means the
+    // victim is in the right subtree.
+    std::vector<unsigned char> bits_;
+    std::vector<unsigned char> can_go_right_;
+};
+
+/*
+    First in, first out: ways are replaced round-robin in the order
+    they were filled, regardless of hits.
+*/
+class FifoPolicy {
+public:
+    FifoPolicy(int rows, int assoc, uint32_t) : assoc_(assoc), next_(rows, 0) {}
+
+    void hit(size_t, int) {}
+    int victim(size_t row) const { return next_[row]; }
+    void fill(size_t row, int way) { next_[row] = way + 1 == assoc_ ? 0 : way + 1; }
+
+    template <typename Archive>
+    void transfer(Archive &a) { a(next_); }
+
+private:
+    int assoc_;
+    std::vector<uint16_t> next_;
+};
+
+/*
+    Replaces a uniformly random way, from a seeded generator so runs
+    are reproducible.
+*/
+class RandomPolicy {
+public:
+    RandomPolicy(int, int assoc, uint32_t seed) : assoc_(assoc), random_(seed) {}
+
+    void hit(size_t, int) {}
+    int victim(size_t) { return random_.next() % assoc_; }
+    void fill(size_t, int) {}
+
+    template <typename Archive>
+    void transfer(Archive &a) { random_.transfer(a); }
+
+private:
+    int assoc_;
+    PolicyRandom random_;
+};
+
+/*
+    Re-reference interval prediction with 2-bit values (Jaleel et al.).
+    A hit predicts a near re-reference (0); the victim is a way with a
+    distant prediction (3), aging the whole set until there is one.
+    SRRIP inserts new blocks with a long prediction (2); BRRIP inserts
+    them distant, and long only once every 32 fills on average, which
+    resists thrashing.
+*/
+template <bool Bimodal>
+class RripPolicy {
+public:
+    RripPolicy(int rows, int assoc, uint32_t seed)
+        : assoc_(assoc), rrpv_((size_t)rows * assoc, (unsigned char)DISTANT), random_(seed) {}
+
+    void hit(size_t row, int way) { rrpv_[row * assoc_ + way] = 0; }
+
+    int victim(size_t row) {
+        unsigned char *rrpv = &rrpv_[row * assoc_];
+        while (true) {
+            for (int way = 0; way < assoc_; way++)
+                if (rrpv[way] == DISTANT)
+                    return way;
+            for (int way = 0; way < assoc_; way++)
+                rrpv[way]++;
+        }
+    }
+
+    void fill(size_t row, int way) {
+        bool distant = Bimodal && random_.next() % 32 != 0;
+        rrpv_[row * assoc_ + way] = distant ? DISTANT : DISTANT - 1;
+    }
+
+    template <typename Archive>
+    void transfer(Archive &a) {
+        a(rrpv_);
+        random_.transfer(a);
+    }
+
+private:
+    enum { DISTANT = 3 };
+
+    int assoc_;
+    std::vector<unsigned char> rrpv_;
+    PolicyRandom random_;
+};
+
+typedef RripPolicy<false> SrripPolicy;
+typedef RripPolicy<true> BrripPolicy;
+
+/*
+    Least frequently used: counts accesses to each block since it was
+    filled and replaces the block with the lowest count (the lowest
+    way on ties).
+*/
+class LfuPolicy {
+public:
+    LfuPolicy(int rows, int assoc, uint32_t) : assoc_(assoc), counts_((size_t)rows * assoc, 0) {}
+
+    void hit(size_t row, int way) {
+        uint32_t &count = counts_[row * assoc_ + way];
+        if (count != UINT32_MAX)
+            count++;
+    }
+
+    int victim(size_t row) const {
+        uint32_t const *counts = &counts_[row * assoc_];
+        int best = 0;
+        for (int way = 1; way < assoc_; way++)
+            if (counts[way] < counts[best])
+                best = way;
+        return best;
+    }
+
+    void fill(size_t row, int way) { counts_[row * assoc_ + way] = 1; }
+
+    template <typename Archive>
+    void transfer(Archive &a) { a(counts_); }
+
+private:
+    int assoc_;
+    std::vector<uint32_t> counts_;
+};
+
+enum ReplacementPolicy {
+    POLICY_LRU, POLICY_PLRU, POLICY_FIFO, POLICY_RANDOM, POLICY_SRRIP, POLICY_BRRIP, POLICY_LFU
+};
+
+/*
+    The command-line names of the policies, in ReplacementPolicy order.
+*/
+char const static *const REPLACEMENT_POLICY_NAMES[] = {
+    "lru", "plru", "fifo", "random", "srrip", "brrip", "lfu"
+};
+
+/*
+    @param name A policy name, as in REPLACEMENT_POLICY_NAMES
+    @param policy Receives the policy
+    @return false if the name is unknown
+*/
+inline bool parse_replacement_policy(std::string const &name, ReplacementPolicy &policy) {
+    for (size_t i = 0; i < sizeof(REPLACEMENT_POLICY_NAMES) / sizeof(REPLACEMENT_POLICY_NAMES[0]); i++)
+        if (name == REPLACEMENT_POLICY_NAMES[i]) {
+            policy = ReplacementPolicy(i);
+            return true;
+        }
+    return false;
+}
+
+/*
+    Names a policy type for with_replacement_policy.
+*/
+template <typename Policy>
+struct PolicyTag {
+    typedef Policy type;
+};
+
+/*
+    Calls f with the PolicyTag of policy, so that f (usually a generic
+    lambda) is instantiated once per policy type.
+
+    @return What f returns
+*/
+template <typename F>
+auto with_replacement_policy(ReplacementPolicy policy, F &&f) -> decltype(f(PolicyTag<LruPolicy>())) {
+    switch (policy) {
+    case POLICY_PLRU:   return f(PolicyTag<PlruPolicy>());
+    case POLICY_FIFO:   return f(PolicyTag<FifoPolicy>());
+    case POLICY_RANDOM: return f(PolicyTag<RandomPolicy>());
+    case POLICY_SRRIP:  return f(PolicyTag<SrripPolicy>());
+    case POLICY_BRRIP:  return f(PolicyTag<BrripPolicy>());
+    case POLICY_LFU:    return f(PolicyTag<LfuPolicy>());
+    case POLICY_LRU:
+    default:            return f(PolicyTag<LruPolicy>());
+    }
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef E20_TAGSTORE_H
+#define E20_TAGSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "E20_Replacement.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+    The tag store of one set-associative cache, with the replacement
+    policy as a template parameter (see E20_Replacement.h).
+
+    All tags live in one contiguous, 32-byte aligned array, set after
+    set. Each set is padded to a multiple of eight ways with tags that
+    never match, so a lookup compares a whole set eight (AVX2) or four
+    (SSE2) tags at a time. Invalid ways hold INVALID_TAG and are found
+    with the same compare.
+
+    A miss fills the lowest invalid way of its set; only full sets ask
+    the policy for a victim.
+
+    Blocks brought in by a prefetch are tagged until their first demand
+    access, so prefetchers can tell useful prefetches from wasted ones
+    (see E20_Prefetch.h).
+
+    When the block size and the number of rows are both powers of two,
+    the row and tag come from shifts and masks instead of divisions.
+*/
+template <typename Policy>
+class TagStore {
+public:
+    /*
+        The largest supported associativity.
+    */
+    static constexpr int MAX_ASSOC = 1<<14;
+
+    /*
+        @param rows Number of rows (sets), at least 1
+        @param assoc Associativity, 1..MAX_ASSOC
+        @param blocksize Block size in memory cells, at least 1
+        @param seed Seed for policies that make random choices
+    */
+    TagStore(int rows, int assoc, int blocksize, uint32_t seed = 1)
+            : rows_(rows), assoc_(assoc), blocksize_(blocksize), stride_((assoc + 7) & ~7),
+              invalid_(rows, assoc), dirty_((size_t)rows * assoc, 0), prefetched_((size_t)rows * assoc, 0),
+              policy_(rows, assoc, seed) {
+        pow2_ = is_pow2(rows) && is_pow2(blocksize);
+        block_shift_ = log2(blocksize);
+        row_shift_ = log2(rows);
+        row_mask_ = rows - 1;
+
+        storage_.assign((size_t)rows * stride_ + 8, int32_t(PADDING_TAG));
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage_.data());
+        offset_ = ((32 - (p & 31)) & 31) / sizeof(int32_t);
+        for (size_t row = 0; row < (size_t)rows; row++)
+            for (int way = 0; way < assoc; way++)
+                set_at(row)[way] = INVALID_TAG;
+    }
+
+    // Copies could land on a different alignment; moves keep the buffer.
+    TagStore(TagStore const &) = delete;
+    TagStore &operator=(TagStore const &) = delete;
+    TagStore(TagStore &&) = default;
+    TagStore &operator=(TagStore &&) = default;
+
+    int rows() const { return rows_; }
+    int assoc() const { return assoc_; }
+    int blocksize() const { return blocksize_; }
+
+    /*
+        A block pushed out of a set by access().
+    */
+    struct Eviction {
+        long address;   // first address of the block, or -1 if none
+        bool dirty;
+        bool prefetched;    // brought in by a prefetch and never used
+    };
+
+    /*
+        Looks up the block holding address, and brings it into its row
+        on a miss, replacing the block the policy chooses.
+
+        @param address The memory address being accessed
+        @param row Receives the row the address maps to
+        @param evicted Receives the block that was replaced, if any
+        @param allocate Whether a miss brings the block in; if not, a
+            miss leaves the set untouched
+        @param dirty Whether to mark the block dirty (a write-back write)
+            when it is present afterwards
+        @param prefetch Whether this is a prefetch: a miss tags the block
+            it brings in as prefetched
+        @param first_use If not null, the access is a demand access and
+            receives whether it hit a prefetched block for the first
+            time, which clears the tag
+        @return true on a hit, false on a miss
+    */
+    bool access(unsigned address, int &row, Eviction &evicted, bool allocate = true, bool dirty = false,
+                bool prefetch = false, bool *first_use = nullptr) {
+        unsigned tag = locate(address, row);
+        int32_t *set = set_at(row);
+        evicted.address = -1;
+        evicted.dirty = false;
+        evicted.prefetched = false;
+        int way = find(set, tag);
+        if (way >= 0) {
+            policy_.hit(row, way);
+            size_t index = (size_t)row * assoc_ + way;
+            dirty_[index] |= dirty;
+            if (first_use) {
+                *first_use = prefetched_[index];
+                prefetched_[index] = 0;
+            }
+            return true;
+        }
+        if (!allocate)
+            return false;
+        if (invalid_[row] > 0) {
+            way = find(set, INVALID_TAG);
+            invalid_[row]--;
+        } else {
+            way = policy_.victim(row);
+            evicted.address = ((long)set[way] * rows_ + row) * blocksize_;
+            evicted.dirty = dirty_[(size_t)row * assoc_ + way];
+            evicted.prefetched = prefetched_[(size_t)row * assoc_ + way];
+        }
+        set[way] = tag;
+        dirty_[(size_t)row * assoc_ + way] = dirty;
+        prefetched_[(size_t)row * assoc_ + way] = prefetch;
+        policy_.fill(row, way);
+        return false;
+    }
+
+    bool access(unsigned address, int &row) {
+        Eviction evicted;
+        return access(address, row, evicted);
+    }
+
+    /*
+        Looks up the block holding address without touching the
+        replacement state.
+
+        @param row Receives the row the address maps to
+        @return true if the block is present
+    */
+    bool contains(unsigned address, int &row) const {
+        unsigned tag = locate(address, row);
+        return find(set_at(row), tag) >= 0;
+    }
+
+    /*
+        Drops the block holding address, if present.
+
+        @param was_dirty If not null, receives whether the dropped block
+            was dirty
+        @return true if the block was present
+    */
+    bool invalidate(unsigned address, bool *was_dirty = nullptr) {
+        int row;
+        unsigned tag = locate(address, row);
+        int32_t *set = set_at(row);
+        int way = find(set, tag);
+        if (was_dirty)
+            *was_dirty = way >= 0 && dirty_[(size_t)row * assoc_ + way];
+        if (way < 0)
+            return false;
+        set[way] = INVALID_TAG;
+        invalid_[row]++;
+        return true;
+    }
+
+    /*
+        Saves or restores the contents and replacement state, for
+        checkpoints (see E20_Checkpoint.h). Restoring needs a TagStore
+        of the same geometry and policy. Prefetch tags are not saved.
+    */
+    template <typename Archive>
+    void transfer(Archive &a) {
+        a(set_at(0), (size_t)rows_ * stride_);
+        a(invalid_);
+        a(dirty_);
+        policy_.transfer(a);
+    }
+
+private:
+    // Tag of an invalid way, and of the padding after the last way of
+    // a set. Neither ever matches a real tag, and padding is never
+    // taken for an invalid way.
+    static constexpr int32_t INVALID_TAG = -1;
+    static constexpr int32_t PADDING_TAG = -2;
+
+    /*
+        @param row Receives the row address maps to
+        @return The tag of address
+    */
+    unsigned locate(unsigned address, int &row) const {
+        unsigned blockid;
+        if (pow2_) {
+            blockid = address >> block_shift_;
+            row = blockid & row_mask_;
+            return blockid >> row_shift_;
+        }
+        blockid = address / blocksize_;
+        row = blockid % rows_;
+        return blockid / rows_;
+    }
+
+    int32_t *set_at(size_t row) { return storage_.data() + offset_ + row * stride_; }
+    int32_t const *set_at(size_t row) const { return storage_.data() + offset_ + row * stride_; }
+
+    static bool is_pow2(int n) { return (n & (n - 1)) == 0; }
+
+    static unsigned log2(int n) {
+        unsigned bits = 0;
+        while ((1 << (bits + 1)) <= n)
+            bits++;
+        return bits;
+    }
+
+    /*
+        @return The way of set holding tag, or -1
+    */
+    int find(int32_t const *set, int32_t tag) const {
+#if defined(__AVX2__)
+        __m256i key = _mm256_set1_epi32(tag);
+        for (int way = 0; way < stride_; way += 8) {
+            __m256i ways = _mm256_load_si256(reinterpret_cast<__m256i const *>(set + way));
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(ways, key)));
+            if (mask)
+                return way + __builtin_ctz(mask);
+        }
+        return -1;
+#elif defined(__SSE2__)
+        __m128i key = _mm_set1_epi32(tag);
+        for (int way = 0; way < stride_; way += 4) {
+            __m128i ways = _mm_load_si128(reinterpret_cast<__m128i const *>(set + way));
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ways, key)));
+            if (mask)
+                return way + __builtin_ctz(mask);
+        }
+        return -1;
+#else
+        for (int way = 0; way < assoc_; way++)
+            if (set[way] == tag)
+                return way;
+        return -1;
+#endif
+    }
+
+    int rows_;
+    int assoc_;
+    int blocksize_;
+    int stride_;
+    bool pow2_;
+    unsigned block_shift_;
+    unsigned row_shift_;
+    unsigned row_mask_;
+    // The tags start at storage_[offset_], the first 32-byte aligned
+    // element.
+    std::vector<int32_t> storage_;
+    size_t offset_;
+    // Number of invalid ways in each set, so full sets skip looking
+    // for one.
+    std::vector<uint16_t> invalid_;
+    // Dirty bit of every way, set after set.
+    std::vector<unsigned char> dirty_;
+    // Prefetch tag of every way, set after set.
+    std::vector<unsigned char> prefetched_;
+    Policy policy_;
+};
+
+#endif
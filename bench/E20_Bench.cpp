@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "../E20_Machine.h"
+#include "../E20_Hierarchy.h"
+#include "../E20_Lockstep.h"
+
+using namespace std;
+
+extern char **environ;
+
+/*
+    Throughput benchmark for the simulators. For every program given it
+    prints, as tab-separated "benchmark metric value" lines:
+
+        instructions    dynamic instruction count (a behaviour check)
+        interp_ips      instructions/s of the interpreter, no loop skipping
+        run_ips         instructions/s of the interpreter as E20_Processor
+                        runs it, with counted loops fast-forwarded
+        lockstep_ips    instructions/s of Lockstep::LANES copies of the
+                        program run with --lockstep
+        accesses        lw and sw executed
+        cache_aps       accesses/s through the hierarchy of CACHE_CONFIG
+                        (LRU, non-inclusive), replayed from memory
+
+    Rates are the best of --repeat runs. With --processor and --cache it
+    also prints startup_ms for each executable: the median wall time of
+    running it on the --startup program (which should halt at once),
+    as a separate process. E20_Processor is timed with and without
+    --jit, and every such run must exit with status 0.
+
+    The output is meant to be saved per commit (--output FILE writes it
+    there as well as to stdout) and diffed; --baseline FILE adds the
+    value in such an earlier file and the ratio new/old to each line.
+
+    Usage: E20_Bench [--repeat N] [--processor EXE] [--cache EXE]
+                     [--startup PROGRAM] [--output FILE] [--baseline FILE]
+                     PROGRAM...
+*/
+
+static char const CACHE_CONFIG[] = "32,4,2,256,4,8";
+static int const STARTUP_RUNS = 21;
+
+/*
+    @return Seconds taken by the fastest of repeat calls of f
+*/
+template <typename F>
+double best_time(int repeat, F &&f) {
+    double best = 0;
+    for (int i = 0; i < repeat; i++) {
+        auto start = chrono::steady_clock::now();
+        f();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best;
+}
+
+/*
+    Runs a command with its output discarded.
+
+    @return Wall time in seconds, or a negative value if it can't be
+        started or fails
+*/
+double time_command(vector<string> const &command) {
+    vector<char *> argv;
+    for (string const &arg : command)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+    auto start = chrono::steady_clock::now();
+    pid_t pid;
+    int status = -1;
+    bool ok = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ) == 0 &&
+        waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    posix_spawn_file_actions_destroy(&actions);
+    return ok ? elapsed.count() : -1;
+}
+
+/*
+    Prints results, with the matching baseline values if there are any,
+    to stdout and optionally a file.
+*/
+class Report {
+public:
+    Report(map<string, double> const &baseline, ofstream *file) : baseline_(baseline), file_(file) {
+        emit(string("benchmark\tmetric\tvalue") + (baseline_.empty() ? "" : "\tbaseline\tratio"));
+    }
+
+    void add(string const &benchmark, string const &metric, double value, int precision = 0) {
+        ostringstream line;
+        line << benchmark << '\t' << metric << '\t' << fixed << setprecision(precision) << value;
+        if (!baseline_.empty()) {
+            auto old = baseline_.find(benchmark + '\t' + metric);
+            if (old == baseline_.end())
+                line << "\t-\t-";
+            else
+                line << '\t' << old->second << '\t' << setprecision(3) << (old->second ? value / old->second : 0);
+        }
+        emit(line.str());
+    }
+
+private:
+    void emit(string const &line) {
+        cout << line << endl;
+        if (file_)
+            *file_ << line << '\n';
+    }
+
+    map<string, double> const &baseline_;
+    ofstream *file_;
+};
+
+/*
+    Reads the output of an earlier run.
+
+    @return false if the file can't be read
+*/
+bool read_baseline(string const &filename, map<string, double> &values) {
+    ifstream f(filename);
+    if (!f.is_open())
+        return false;
+    string line;
+    getline(f, line);
+    while (getline(f, line)) {
+        istringstream fields(line);
+        string benchmark, metric;
+        double value;
+        if (getline(fields, benchmark, '\t') && getline(fields, metric, '\t') && fields >> value)
+            values[benchmark + '\t' + metric] = value;
+    }
+    return true;
+}
+
+/*
+    @return The file name of path without directories or extension
+*/
+string benchmark_name(string const &path) {
+    size_t slash = path.find_last_of('/');
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    return name.substr(0, name.find('.'));
+}
+
+int main(int argc, char *argv[]) {
+    int repeat = 5;
+    string processor, cache, startup, output_file, baseline_file;
+    vector<string> programs;
+    bool arg_error = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--repeat" && has_value)
+            repeat = atoi(argv[++i]);
+        else if (arg == "--processor" && has_value)
+            processor = argv[++i];
+        else if (arg == "--cache" && has_value)
+            cache = argv[++i];
+        else if (arg == "--startup" && has_value)
+            startup = argv[++i];
+        else if (arg == "--output" && has_value)
+            output_file = argv[++i];
+        else if (arg == "--baseline" && has_value)
+            baseline_file = argv[++i];
+        else if (arg.rfind("-", 0) == 0)
+            arg_error = true;
+        else
+            programs.push_back(arg);
+    }
+    if (arg_error || repeat < 1 || (programs.empty() && startup.empty()) ||
+            (startup.empty() && (!processor.empty() || !cache.empty()))) {
+        cerr << "usage " << argv[0] << " [--repeat N] [--processor EXE] [--cache EXE]" << endl;
+        cerr << "       [--startup PROGRAM] [--output FILE] [--baseline FILE] PROGRAM..." << endl;
+        return 1;
+    }
+
+    map<string, double> baseline;
+    if (!baseline_file.empty() && !read_baseline(baseline_file, baseline)) {
+        cerr << "Can't read baseline " << baseline_file << endl;
+        return 1;
+    }
+    vector<CacheLevelConfig> levels;
+    parse_cache_levels(CACHE_CONFIG, levels);
+
+    ofstream output;
+    if (!output_file.empty()) {
+        output.open(output_file);
+        if (!output.is_open()) {
+            cerr << "Can't write " << output_file << endl;
+            return 1;
+        }
+    }
+    Report report(baseline, output_file.empty() ? nullptr : &output);
+    for (string const &filename : programs) {
+        Machine program;
+        try {
+            program.load(filename);
+        } catch (LoadError const &e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        string name = benchmark_name(filename);
+
+        unsigned long long count = 0;
+        Machine machine;
+        double interp = best_time(repeat, [&] {
+            machine = program;
+            machine.set_loop_skipping(false);
+            count = machine.run();
+        });
+        double skipping = best_time(repeat, [&] {
+            machine = program;
+            machine.run();
+        });
+        double lockstep = best_time(repeat, [&] {
+            Lockstep group;
+            for (size_t lane = 0; lane < Lockstep::LANES; lane++)
+                group.load(lane, program);
+            group.run();
+        });
+
+        struct Access {
+            unsigned short address;
+            bool is_store;
+        };
+        vector<Access> accesses;
+        machine = program;
+        machine.run(numeric_limits<unsigned long long>::max(), [&](unsigned, unsigned address, bool is_store) {
+            accesses.push_back(Access{(unsigned short)address, is_store});
+        });
+        double replay = best_time(repeat, [&] {
+            CacheHierarchy<LruPolicy, NON_INCLUSIVE> caches(levels, 1);
+            auto ignore = [](size_t, CacheEvent, int, unsigned) {};
+            for (Access const &a : accesses)
+                if (a.is_store)
+                    caches.store(a.address, ignore);
+                else
+                    caches.load(a.address, ignore);
+        });
+
+        report.add(name, "instructions", count);
+        report.add(name, "interp_ips", count / interp);
+        report.add(name, "run_ips", count / skipping);
+        report.add(name, "lockstep_ips", Lockstep::LANES * count / lockstep);
+        report.add(name, "accesses", accesses.size());
+        report.add(name, "cache_aps", accesses.empty() ? 0 : accesses.size() / replay);
+    }
+
+    vector<pair<string, vector<string>>> commands;
+    if (!processor.empty()) {
+        commands.push_back({"E20_Processor", {processor, startup}});
+        commands.push_back({"E20_Processor_jit", {processor, "--jit", startup}});
+    }
+    if (!cache.empty())
+        commands.push_back({"E20_Cache", {cache, "--cache", CACHE_CONFIG, startup}});
+    for (auto const &command : commands) {
+        vector<double> times;
+        for (int i = 0; i < STARTUP_RUNS; i++) {
+            double t = time_command(command.second);
+            if (t < 0) {
+                cerr << "Can't run " << command.second[0] << " " << startup << endl;
+                return 1;
+            }
+            times.push_back(t);
+        }
+        sort(times.begin(), times.end());
+        report.add(command.first, "startup_ms", times[STARTUP_RUNS / 2] * 1000, 3);
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "../E20_TagStore.h"
+
+using namespace std;
+
+/*
+    Microbenchmark for TagStore: replays a synthetic stream of addresses
+    through a TagStore and through the row-of-vectors LRU cache that
+    E20_Cache used before, checks that both make the same hit/miss
+    decision for every access, and prints accesses per second for each
+    and for TagStore with each of the other replacement policies.
+
+    Usage: E20_TagStoreBench [ASSOC [ACCESSES]]   (defaults: 16, 20000000)
+
+    Build with -O2 -march=native to get the AVX2 tag compare.
+*/
+
+/*
+    The original tag store: one vector per row holding the tags in LRU
+    order (least recent first), shifted element by element on every
+    access.
+*/
+class ShiftingCache {
+public:
+    ShiftingCache(int rows, int assoc, int blocksize)
+        : rows(rows), blocksize(blocksize), cache(rows, vector<int>(assoc, -1)) {}
+
+    bool access(unsigned address) {
+        int blockid = address / blocksize;
+        vector<int> &row = cache[blockid % rows];
+        int tag = blockid / rows;
+        int i = row.size() - 1;
+        while (i >= 0 && row[i] != tag && row[i] != -1)
+            i--;
+        bool hit = i >= 0 && row[i] == tag;
+        if (!hit)
+            i = 0;
+        for (int j = i + 1; j < (int)row.size(); j++)
+            row[j-1] = row[j];
+        row[row.size() - 1] = tag;
+        return hit;
+    }
+
+private:
+    int rows;
+    int blocksize;
+    vector<vector<int>> cache;
+};
+
+/*
+    A loop-like access stream: mostly walks over a working set a bit
+    larger than the cache, with some random far accesses mixed in, so
+    that hits, misses and evictions all happen.
+*/
+vector<unsigned> make_addresses(size_t count, unsigned working_set) {
+    vector<unsigned> addresses(count);
+    unsigned seed = 12345;
+    unsigned next = 0;
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 8 == 0)
+            addresses[i] = (seed >> 8) % 8192;
+        else {
+            addresses[i] = next;
+            next = (next + 1) % working_set;
+        }
+    }
+    return addresses;
+}
+
+template <typename Cache>
+double measure(Cache &cache, vector<unsigned> const &addresses, unsigned long long &hits) {
+    hits = 0;
+    auto start = chrono::steady_clock::now();
+    for (unsigned address : addresses)
+        hits += cache.access(address);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return addresses.size() / elapsed.count();
+}
+
+template <typename Policy>
+struct TagStoreAdapter {
+    TagStore<Policy> store;
+    bool access(unsigned address) {
+        int row;
+        return store.access(address, row);
+    }
+};
+
+int main(int argc, char *argv[]) {
+    int assoc = argc > 1 ? atoi(argv[1]) : 16;
+    size_t count = argc > 2 ? strtoull(argv[2], nullptr, 10) : 20000000;
+    if (assoc < 1 || assoc > TagStore<LruPolicy>::MAX_ASSOC || count == 0) {
+        cerr << "usage " << argv[0] << " [ASSOC [ACCESSES]]" << endl;
+        return 1;
+    }
+    int blocksize = 4;
+    int rows = 16;
+    vector<unsigned> addresses = make_addresses(count, rows * assoc * blocksize * 5 / 4);
+
+    {
+        ShiftingCache shifting(rows, assoc, blocksize);
+        TagStoreAdapter<LruPolicy> flat{TagStore<LruPolicy>(rows, assoc, blocksize)};
+        for (size_t i = 0; i < count; i++)
+            if (shifting.access(addresses[i]) != flat.access(addresses[i])) {
+                cerr << "Hit/miss differs at access " << i << endl;
+                return 1;
+            }
+    }
+
+    ShiftingCache shifting(rows, assoc, blocksize);
+    TagStoreAdapter<LruPolicy> flat{TagStore<LruPolicy>(rows, assoc, blocksize)};
+    unsigned long long shifting_hits, flat_hits;
+    double shifting_rate = measure(shifting, addresses, shifting_hits);
+    double flat_rate = measure(flat, addresses, flat_hits);
+
+    cout << assoc << "-way, " << rows << " rows, blocksize " << blocksize << ", "
+         << count << " accesses, " << shifting_hits << " hits" << endl;
+    cout << fixed << setprecision(1);
+    cout << "shifting rows  " << setw(8) << shifting_rate / 1e6 << " M accesses/s" << endl;
+    cout << "TagStore lru   " << setw(8) << flat_rate / 1e6 << " M accesses/s" << endl;
+
+    // The other policies make different decisions, so only their speed
+    // is of interest.
+    for (int p = POLICY_PLRU; p <= POLICY_LFU; p++)
+        with_replacement_policy(ReplacementPolicy(p), [&](auto policy_tag) {
+            typedef typename decltype(policy_tag)::type Policy;
+            TagStoreAdapter<Policy> store{TagStore<Policy>(rows, assoc, blocksize)};
+            unsigned long long hits;
+            double rate = measure(store, addresses, hits);
+            cout << "TagStore " << left << setw(6) << REPLACEMENT_POLICY_NAMES[p] << right
+                 << setw(8) << rate / 1e6 << " M accesses/s (" << hits << " hits)" << endl;
+        });
+    return shifting_hits == flat_hits ? 0 : 1;
+}
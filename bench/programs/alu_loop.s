@@ -0,0 +1,20 @@
+# Tight ALU loop: 3000 x 1000 iterations of add/sub/or/and/slt.
+# The or/and keep the loop from being fast-forwarded. ~24M instructions.
+        j start
+outer_n: .fill 3000
+inner_n: .fill 1000
+start:  lw $1, outer_n($0)
+        lw $6, inner_n($0)
+outer:  addi $2, $0, 0
+inner:  add $3, $3, $2
+        sub $4, $4, $3
+        or $5, $5, $4
+        and $5, $5, $3
+        slt $3, $5, $4
+        addi $2, $2, 1
+        jeq $2, $6, next
+        j inner
+next:   addi $1, $1, -1
+        jeq $1, $0, done
+        j outer
+done:   halt
@@ -0,0 +1,2 @@
+# Halts at once; for measuring startup latency.
+start:  halt
@@ -0,0 +1,27 @@
+# Random memory walk: an LCG (x = 5x + 13) picks a word in 4096..8191
+# to increment, 1M times. ~12M instructions, 2M memory accesses.
+        j start
+mask:   .fill 4095
+base:   .fill 4096
+count:  .fill 50000
+start:  lw $2, mask($0)
+        lw $3, base($0)
+        addi $6, $0, 20
+        addi $1, $0, 1
+outer:  lw $5, count($0)
+loop:   add $7, $1, $1
+        add $7, $7, $7
+        add $1, $7, $1
+        addi $1, $1, 13
+        and $4, $1, $2
+        or $4, $4, $3
+        lw $7, 0($4)
+        addi $7, $7, 1
+        sw $7, 0($4)
+        addi $5, $5, -1
+        jeq $5, $0, next
+        j loop
+next:   addi $6, $6, -1
+        jeq $6, $0, done
+        j outer
+done:   halt
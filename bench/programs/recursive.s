@@ -0,0 +1,26 @@
+# Recursive fib(27) with jal/jr and a stack in memory, growing down
+# from 8000. ~6M instructions.
+        j start
+stack:  .fill 8000
+start:  lw $6, stack($0)
+        addi $1, $0, 27
+        jal fib
+done:   halt
+fib:    slti $2, $1, 2
+        jeq $2, $0, rec
+        add $3, $1, $0
+        jr $7
+rec:    sw $7, 0($6)
+        sw $1, -1($6)
+        addi $6, $6, -3
+        addi $1, $1, -1
+        jal fib
+        sw $3, 1($6)
+        lw $1, 2($6)
+        addi $1, $1, -2
+        jal fib
+        lw $4, 1($6)
+        add $3, $3, $4
+        addi $6, $6, 3
+        lw $7, 0($6)
+        jr $7
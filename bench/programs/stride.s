@@ -0,0 +1,19 @@
+# Strided memory walk: 2000 passes of lw/add/sw over words 4096..8191,
+# stride 8. ~6M instructions, 2M memory accesses.
+        j start
+passes: .fill 2000
+base:   .fill 4096
+limit:  .fill 8192
+start:  lw $1, passes($0)
+pass:   lw $3, base($0)
+        lw $6, limit($0)
+walk:   lw $4, 0($3)
+        add $4, $4, $3
+        sw $4, 0($3)
+        addi $3, $3, 8
+        jeq $3, $6, next
+        j walk
+next:   addi $1, $1, -1
+        jeq $1, $0, done
+        j pass
+done:   halt